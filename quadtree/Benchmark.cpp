@@ -0,0 +1,889 @@
+#include "pch.h"
+#include "Quadtree.h"
+#include "HugePageAllocator.h"
+#include "PointQuadtree.h"
+#include "QuadQueryService.h"
+#include "QuadtreePublisher.h"
+#include "ShardedQuadtree.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Benchmarks the quadtree's hot paths over a grid of element counts, element
+// distributions, coordinate types and maxElements/maxDepth settings. Run with --help
+// for the options.
+
+// Counts heap allocations so that each workload can report allocations per operation
+static std::atomic<long long> allocationCount(0);
+
+void* operator new(std::size_t size)
+{
+	allocationCount++;
+	if (void* p = std::malloc(size)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+struct BenchOptions
+{
+	std::vector<int> elementCounts;
+	std::vector<std::string> distributions;
+	std::vector<std::string> coordinates;
+	std::vector<std::pair<int, int>> configs;
+	std::vector<std::string> workloads;
+
+	// Timed operations per workload, for the workloads made of many small operations
+	int operations;
+	int threads;
+	unsigned seed;
+	bool csv;
+	bool stats;
+	bool reserve;
+	bool hugePages;
+
+	BenchOptions()
+		: elementCounts({ 10000, 100000, 1000000 }), distributions({ "uniform", "clustered", "zipf" }),
+		coordinates({ "int32" }), configs({ { 8, 8 }, { 32, 10 } }),
+		workloads({ "build", "build-parallel", "insert", "query-small", "query-large", "insert-tiled", "query-tiled", "build-points", "query-points", "build-linear", "query-linear", "query-cursor", "any", "count", "rebalance", "query-rebalanced", "relayout", "query-relayout", "query-packed", "query-batch", "service", "publish", "query-published", "nearest", "raycast", "segment", "segment-bbox", "frustum", "pairs", "pairs-parallel", "save", "load", "map", "move", "query-changed", "remove-backref", "remove", "cleanup", "shrink" }),
+		operations(100000), threads(0), seed(1234), csv(false), stats(false), reserve(false), hugePages(false) {
+	}
+};
+
+// The timings of one workload. Latencies are only kept for workloads timed one operation at a time
+struct BenchResult
+{
+	std::string workload;
+	long long operations;
+	double seconds;
+	long long allocations;
+	std::vector<std::uint32_t> latencies;
+
+	BenchResult(const std::string& workload) : workload(workload), operations(0), seconds(0), allocations(0) {
+	}
+};
+
+// Generates points spread over the world in one of the distributions:
+//  uniform:   anywhere in the world
+//  clustered: normally distributed around a few dozen centers
+//  zipf:      in a 64 x 64 grid of cells, where the cell of rank r is picked with
+//             probability proportional to 1 / r, so a few cells hold most points
+class PointGenerator
+{
+private:
+	std::string distribution;
+	int worldSize;
+	std::vector<std::pair<int, int>> clusterCenters;
+	std::normal_distribution<double> clusterOffset;
+	std::vector<int> cellByRank;
+	std::discrete_distribution<int> cellRank;
+
+	static const int numClusters = 32;
+	static const int gridSize = 64;
+
+	int clamp(const double v) const {
+		return std::min(std::max(static_cast<int>(v), 0), worldSize - 1);
+	}
+
+public:
+	PointGenerator(const std::string& distribution, const int worldSize, std::mt19937& rng)
+		: distribution(distribution), worldSize(worldSize), clusterOffset(0.0, worldSize / 40.0)
+	{
+		std::uniform_int_distribution<int> position(0, worldSize - 1);
+		for (int i = 0; i < numClusters; i++) {
+			clusterCenters.push_back(std::make_pair(position(rng), position(rng)));
+		}
+
+		std::vector<double> weights;
+		for (int i = 0; i < gridSize * gridSize; i++) {
+			cellByRank.push_back(i);
+			weights.push_back(1.0 / (i + 1));
+		}
+		std::shuffle(cellByRank.begin(), cellByRank.end(), rng);
+		cellRank = std::discrete_distribution<int>(weights.begin(), weights.end());
+	}
+
+	void point(std::mt19937& rng, int& x, int& y) {
+		if (distribution == "clustered") {
+			const std::pair<int, int> & center = clusterCenters[std::uniform_int_distribution<int>(0, numClusters - 1)(rng)];
+			x = clamp(center.first + clusterOffset(rng));
+			y = clamp(center.second + clusterOffset(rng));
+		}
+		else if (distribution == "zipf") {
+			const int cell = cellByRank[cellRank(rng)];
+			const double cellSize = static_cast<double>(worldSize) / gridSize;
+			std::uniform_real_distribution<double> offset(0.0, cellSize);
+			x = clamp((cell % gridSize) * cellSize + offset(rng));
+			y = clamp((cell / gridSize) * cellSize + offset(rng));
+		}
+		else {
+			std::uniform_int_distribution<int> position(0, worldSize - 1);
+			x = position(rng);
+			y = position(rng);
+		}
+	}
+};
+
+// Times op(i) for every i in [0, count) one call at a time, keeping each latency
+template <class Op>
+BenchResult timeEach(const std::string& workload, const int count, Op&& op)
+{
+	BenchResult result(workload);
+	result.latencies.resize(count);
+	const long long allocationsBefore = allocationCount;
+	const auto start = std::chrono::steady_clock::now();
+	auto last = start;
+	for (int i = 0; i < count; i++) {
+		op(i);
+		const auto now = std::chrono::steady_clock::now();
+		result.latencies[i] = static_cast<std::uint32_t>(std::min<long long>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count(), UINT32_MAX));
+		last = now;
+	}
+	result.seconds = std::chrono::duration<double>(last - start).count();
+	result.allocations = allocationCount - allocationsBefore;
+	result.operations = count;
+	return result;
+}
+
+// Times one call of op, which performs 'count' operations
+template <class Op>
+BenchResult timeAll(const std::string& workload, const long long count, Op&& op)
+{
+	BenchResult result(workload);
+	const long long allocationsBefore = allocationCount;
+	const auto start = std::chrono::steady_clock::now();
+	op();
+	const auto end = std::chrono::steady_clock::now();
+	result.seconds = std::chrono::duration<double>(end - start).count();
+	result.allocations = allocationCount - allocationsBefore;
+	result.operations = count;
+	return result;
+}
+
+static std::uint32_t percentile(const std::vector<std::uint32_t>& sorted, const double p)
+{
+	const size_t index = static_cast<size_t>(p * sorted.size());
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// Column widths of the table printed without --csv
+static const int columnWidths[] = { 13, 12, 10, 12, 9, 17, 10, 12, 9, 9, 9, 10, 10, 12, 16, 10 };
+
+static void printHeader(const BenchOptions& options)
+{
+	const char* columns[] = { "distribution", "coordinates", "elements", "maxElements", "maxDepth", "workload", "ops", "ops/s",
+		"p50 ns", "p90 ns", "p99 ns", "max ns", "allocs/op", "elements KB", "elementNodes KB", "nodes KB" };
+	for (int i = 0; i < 16; i++) {
+		if (options.csv) {
+			std::cout << (i > 0 ? "," : "") << columns[i];
+		}
+		else {
+			std::cout << std::setw(columnWidths[i]) << columns[i];
+		}
+	}
+	std::cout << std::endl;
+}
+
+// Prints one row: the result's throughput and latency percentiles, and the memory of
+// the tree's FreeLists at the end of the workload. The FreeLists never shrink, so the
+// last row of a run shows their peak
+static void printResult(const BenchOptions& options, const std::string& distribution, const std::string& coordinates, const int numElements, const std::pair<int, int>& config,
+	BenchResult& result, const QuadMemoryUsage& memory)
+{
+	std::vector<std::string> cells;
+	cells.push_back(distribution);
+	cells.push_back(coordinates);
+	cells.push_back(std::to_string(numElements));
+	cells.push_back(std::to_string(config.first));
+	cells.push_back(std::to_string(config.second));
+	cells.push_back(result.workload);
+	cells.push_back(std::to_string(result.operations));
+	std::ostringstream throughput;
+	throughput << std::fixed << std::setprecision(0) << (result.seconds > 0 ? result.operations / result.seconds : 0.0);
+	cells.push_back(throughput.str());
+
+	std::vector<std::uint32_t> & latencies = result.latencies;
+	std::sort(latencies.begin(), latencies.end());
+	const double ps[] = { 0.5, 0.9, 0.99, 1.0 };
+	for (int i = 0; i < 4; i++) {
+		cells.push_back(latencies.size() > 0 ? std::to_string(percentile(latencies, ps[i])) : "-");
+	}
+
+	std::ostringstream allocations;
+	allocations << std::setprecision(3) << (result.operations > 0 ? static_cast<double>(result.allocations) / result.operations : 0.0);
+	cells.push_back(allocations.str());
+	cells.push_back(std::to_string(memory.elements / 1024));
+	cells.push_back(std::to_string(memory.elementNodes / 1024));
+	cells.push_back(std::to_string(memory.nodes / 1024));
+
+	for (size_t i = 0; i < cells.size(); i++) {
+		if (options.csv) {
+			std::cout << (i > 0 ? "," : "") << cells[i];
+		}
+		else {
+			std::cout << std::setw(columnWidths[i]) << cells[i];
+		}
+	}
+	std::cout << std::endl;
+}
+
+// Prints the work counted during a workload per operation, as a comment line. The
+// counters are only collected when the library is built with QUADTREE_STATS
+static void printCounters(const BenchResult& result, const QuadCounters& counters)
+{
+	const double ops = static_cast<double>(std::max(result.operations, 1LL));
+	std::cout << std::setprecision(4) << "# " << result.workload << " per op:"
+		<< " queries " << counters.queries / ops
+		<< ", nodesVisited " << counters.nodesVisited / ops
+		<< ", leavesScanned " << counters.leavesScanned / ops
+		<< ", elementsTested " << counters.elementsTested / ops
+		<< ", elementsReturned " << counters.elementsReturned / ops
+		<< ", splits " << counters.splits / ops
+		<< ", collapses " << counters.collapses / ops << std::endl;
+}
+
+// Prints the tree's stats as comment lines
+static void printStats(const QuadStats& stats)
+{
+	std::ostringstream lines;
+	lines << stats;
+	std::string line;
+	std::istringstream stream(lines.str());
+	while (std::getline(stream, line)) {
+		std::cout << "# " << line << "\n";
+	}
+	std::cout.flush();
+}
+
+static bool hasWorkload(const BenchOptions& options, const std::string& workload)
+{
+	return std::find(options.workloads.begin(), options.workloads.end(), workload) != options.workloads.end();
+}
+
+// Runs every selected workload, in order, against one tree built from the given elements.
+// Tree is the quadtree instantiation for the coordinate type being measured
+template <class Tree>
+static void runConfig(const BenchOptions& options, ThreadPool& pool, const std::string& distribution, const std::string& coordinates, const int worldSize,
+	const std::vector<QuadElement>& entities, PointGenerator& points, const std::pair<int, int>& config, std::mt19937& rng)
+{
+	const int numElements = static_cast<int>(entities.size());
+	const int maxElements = config.first, maxDepth = config.second;
+	auto print = [&](BenchResult result, Tree& tree) {
+		printResult(options, distribution, coordinates, numElements, config, result, tree.memoryUsage());
+		if (options.stats) {
+			printCounters(result, tree.counters());
+			tree.resetCounters();
+		}
+	};
+
+	// Query rectangles centred on points from the same distribution as the elements
+	const int smallSize = 32, largeSize = worldSize / 16;
+	std::vector<typename Tree::Query> smallQueries, largeQueries;
+	for (int i = 0; i < options.operations; i++) {
+		int x, y;
+		points.point(rng, x, y);
+		smallQueries.push_back(typename Tree::Query(x - smallSize / 2, y - smallSize / 2, x + smallSize / 2, y + smallSize / 2, -1));
+		largeQueries.push_back(typename Tree::Query(x - largeSize / 2, y - largeSize / 2, x + largeSize / 2, y + largeSize / 2, -1));
+	}
+
+	// Room for every element, a second element node each and a node per element
+	auto reserve = [&](Tree& tree) {
+		if (options.reserve) {
+			tree.reserve(numElements, 2 * numElements, numElements);
+		}
+	};
+
+	if (hasWorkload(options, "build") || hasWorkload(options, "build-parallel")) {
+		std::vector<typename Tree::Element> elements;
+		for (const QuadElement& e : entities) {
+			elements.push_back(typename Tree::Element(e.id, e.x1, e.y1, e.x2, e.y2));
+		}
+		Tree built(worldSize, worldSize, maxElements, maxDepth, numElements);
+		reserve(built);
+		if (hasWorkload(options, "build")) {
+			print(timeAll("build", numElements, [&]() {
+				built.build(elements);
+			}), built);
+		}
+		if (hasWorkload(options, "build-parallel")) {
+			print(timeAll("build-parallel", numElements, [&]() {
+				built.build(pool, elements);
+			}), built);
+		}
+	}
+
+	Tree tree(worldSize, worldSize, maxElements, maxDepth, numElements);
+	reserve(tree);
+	std::vector<int> elementIndices(numElements);
+	BenchResult insertResult = timeEach("insert", numElements, [&](const int i) {
+		const QuadElement & e = entities[i];
+		elementIndices[i] = tree.insert(e.id, e.x1, e.y1, e.x2, e.y2);
+	});
+	if (hasWorkload(options, "insert")) {
+		print(insertResult, tree);
+	}
+	if (options.stats) {
+		printStats(tree.stats());
+		tree.resetCounters();
+	}
+
+	std::vector<typename Tree::Element> out;
+	auto runQueries = [&](const std::string& workload, const std::vector<typename Tree::Query>& queries) {
+		if (hasWorkload(options, workload)) {
+			print(timeEach(workload, options.operations, [&](const int i) {
+				const typename Tree::Query & q = queries[i];
+				tree.query(out, q.x1, q.y1, q.x2, q.y2, -1);
+			}), tree);
+		}
+	};
+	runQueries("query-small", smallQueries);
+	runQueries("query-large", largeQueries);
+
+	// The same inserts and small queries on a grid of 4096-wide tiles with 64-bit world
+	// coordinates, showing the cost of the fan-out over tiles
+	if (hasWorkload(options, "insert-tiled") || hasWorkload(options, "query-tiled")) {
+		ShardedQuadtree<Tree, long long> tiled(4096, maxElements, maxDepth, nullptr);
+		BenchResult result = timeEach("insert-tiled", numElements, [&](const int i) {
+			const QuadElement & e = entities[i];
+			tiled.insert(e.id, e.x1, e.y1, e.x2, e.y2);
+		});
+		if (hasWorkload(options, "insert-tiled")) {
+			printResult(options, distribution, coordinates, numElements, config, result, tiled.memoryUsage());
+		}
+		if (hasWorkload(options, "query-tiled")) {
+			std::vector<typename ShardedQuadtree<Tree, long long>::Element> tiledOut;
+			result = timeEach("query-tiled", options.operations, [&](const int i) {
+				const typename Tree::Query & q = smallQueries[i];
+				tiled.query(tiledOut, q.x1, q.y1, q.x2, q.y2, -1);
+			});
+			printResult(options, distribution, coordinates, numElements, config, result, tiled.memoryUsage());
+		}
+	}
+
+	// An index of the elements' top left corners rebuilt every frame: as a tree of
+	// zero-sized elements and as a linear point tree, each timed rebuilding over its
+	// previous build, then the small queries on each. The point tree's grid costs nothing
+	// per level, so it is 16 levels deep whatever the config
+	if (hasWorkload(options, "build-points") || hasWorkload(options, "query-points") || hasWorkload(options, "build-linear") || hasWorkload(options, "query-linear")) {
+		typedef BasicPointQuadtree<typename Tree::CoordType, typename Tree::PayloadType> PointTree;
+		std::vector<typename Tree::Element> pointElements;
+		std::vector<typename PointTree::Point> linearPoints;
+		for (const QuadElement& e : entities) {
+			pointElements.push_back(typename Tree::Element(e.id, e.x1, e.y1, e.x1, e.y1));
+			linearPoints.push_back(typename PointTree::Point(e.id, e.x1, e.y1));
+		}
+
+		Tree pointTree(worldSize, worldSize, maxElements, maxDepth, numElements);
+		pointTree.build(pointElements);
+		BenchResult result = timeAll("build-points", numElements, [&]() {
+			pointTree.build(pointElements);
+		});
+		if (hasWorkload(options, "build-points")) {
+			print(result, pointTree);
+		}
+		if (hasWorkload(options, "query-points")) {
+			print(timeEach("query-points", options.operations, [&](const int i) {
+				const typename Tree::Query & q = smallQueries[i];
+				pointTree.query(out, q.x1, q.y1, q.x2, q.y2, -1);
+			}), pointTree);
+		}
+
+		PointTree linear(worldSize, worldSize, maxElements, 16);
+		linear.build(linearPoints);
+		result = timeAll("build-linear", numElements, [&]() {
+			linear.build(linearPoints);
+		});
+		if (hasWorkload(options, "build-linear")) {
+			printResult(options, distribution, coordinates, numElements, config, result, linear.memoryUsage());
+		}
+		if (hasWorkload(options, "query-linear")) {
+			std::vector<typename PointTree::Point> linearOut;
+			result = timeEach("query-linear", options.operations, [&](const int i) {
+				const typename Tree::Query & q = smallQueries[i];
+				linear.query(linearOut, q.x1, q.y1, q.x2, q.y2);
+			});
+			printResult(options, distribution, coordinates, numElements, config, result, linear.memoryUsage());
+		}
+	}
+
+	// The same queries without building a result: pulling every element from a cursor,
+	// checking for any element in the small rectangles, and counting the large ones
+	int found = 0;
+	if (hasWorkload(options, "query-cursor")) {
+		print(timeEach("query-cursor", options.operations, [&](const int i) {
+			const typename Tree::Query & q = smallQueries[i];
+			for (int elementIndex : tree.queryCursor(q.x1, q.y1, q.x2, q.y2, -1)) {
+				found += elementIndex & 1;
+			}
+		}), tree);
+	}
+	if (hasWorkload(options, "any")) {
+		print(timeEach("any", options.operations, [&](const int i) {
+			const typename Tree::Query & q = smallQueries[i];
+			found += tree.any(q.x1, q.y1, q.x2, q.y2, -1);
+		}), tree);
+	}
+	if (hasWorkload(options, "count")) {
+		print(timeEach("count", options.operations, [&](const int i) {
+			const typename Tree::Query & q = largeQueries[i];
+			found += tree.count(q.x1, q.y1, q.x2, q.y2, -1);
+		}), tree);
+	}
+
+	// A copy of the tree reshaped by the cost split policy after recording the heat of the
+	// small queries, then the small queries again on it
+	if (hasWorkload(options, "rebalance") || hasWorkload(options, "query-rebalanced")) {
+		QuadCostSplitPolicy policy;
+		Tree tuned(tree);
+		tuned.setSplitPolicy(&policy);
+		tuned.trackQueryHeat(true);
+		for (const typename Tree::Query& q : smallQueries) {
+			tuned.query(out, q.x1, q.y1, q.x2, q.y2, -1);
+		}
+		BenchResult result = timeAll("rebalance", 1, [&]() {
+			tuned.rebalance();
+		});
+		tuned.trackQueryHeat(false);
+		if (hasWorkload(options, "rebalance")) {
+			print(result, tuned);
+		}
+		if (hasWorkload(options, "query-rebalanced")) {
+			print(timeEach("query-rebalanced", options.operations, [&](const int i) {
+				const typename Tree::Query & q = smallQueries[i];
+				tuned.query(out, q.x1, q.y1, q.x2, q.y2, -1);
+			}), tuned);
+		}
+	}
+
+	// Lay the inserted tree out in depth-first Morton order and repeat the large queries
+	if (hasWorkload(options, "relayout") || hasWorkload(options, "query-relayout")) {
+		BenchResult result = timeAll("relayout", numElements, [&]() {
+			tree.relayout();
+		});
+		if (hasWorkload(options, "relayout")) {
+			print(result, tree);
+		}
+		runQueries("query-relayout", largeQueries);
+	}
+	if (hasWorkload(options, "query-packed")) {
+		tree.pack();
+		runQueries("query-packed", smallQueries);
+	}
+
+	if (hasWorkload(options, "query-batch")) {
+		typename Tree::QueryBatchResult batchResult;
+		print(timeAll("query-batch", options.operations, [&]() {
+			tree.queryBatch(pool, smallQueries, batchResult);
+		}), tree);
+	}
+
+	// A load generator for the query service: client threads each submit a small query
+	// and wait for its future before the next, for increasing numbers of clients. Each
+	// row gives the latency from submit to result against the throughput of all clients
+	if (hasWorkload(options, "service")) {
+		QuadQueryService<Tree> service(tree, pool);
+		service.start(std::chrono::microseconds(20), 256);
+		for (int clients = 1; clients <= 64; clients *= 4) {
+			const int perClient = std::max(1, options.operations / clients);
+			std::vector<BenchResult> clientResults(clients, BenchResult(""));
+			BenchResult result = timeAll("service-" + std::to_string(clients), static_cast<long long>(perClient) * clients, [&]() {
+				std::vector<std::thread> threads;
+				for (int c = 0; c < clients; c++) {
+					threads.emplace_back([&, c]() {
+						clientResults[c] = timeEach("", perClient, [&](const int i) {
+							const typename Tree::Query & q = smallQueries[(c * perClient + i) % options.operations];
+							service.query(q.x1, q.y1, q.x2, q.y2, -1).get();
+						});
+					});
+				}
+				for (std::thread& thread : threads) {
+					thread.join();
+				}
+			});
+			for (const BenchResult& clientResult : clientResults) {
+				result.latencies.insert(result.latencies.end(), clientResult.latencies.begin(), clientResult.latencies.end());
+			}
+			print(result, tree);
+		}
+		service.stop();
+	}
+
+	// Publishing copies of the tree, then reader queries on the published copy while a
+	// writer thread moves elements of its own tree and publishes after every burst of moves
+	if (hasWorkload(options, "publish") || hasWorkload(options, "query-published")) {
+		QuadtreePublisher<Tree> publisher(1);
+		BenchResult result = timeEach("publish", std::max(1, options.operations / 1000), [&](const int) {
+			publisher.publish(tree);
+		});
+		if (hasWorkload(options, "publish")) {
+			print(result, tree);
+		}
+		if (hasWorkload(options, "query-published")) {
+			Tree writerTree(tree);
+			std::atomic<bool> done(false);
+			std::thread writer([&]() {
+				const int burst = 64;
+				// Even rounds move a burst of elements one unit right, odd rounds move them back
+				for (int round = 0; !done.load(); round++) {
+					for (int i = 0; i < burst; i++) {
+						const int n = (round / 2 * burst + i) % numElements;
+						const QuadElement & e = entities[n];
+						const int shift = round % 2 == 0 && e.x2 < worldSize - 1 ? 1 : 0;
+						writerTree.update(elementIndices[n], e.x1 + shift, e.y1, e.x2 + shift, e.y2);
+					}
+					publisher.publish(writerTree);
+				}
+			});
+			print(timeEach("query-published", options.operations, [&](const int i) {
+				const typename Tree::Query & q = smallQueries[i];
+				out.clear();
+				publisher.enter(0)->queryVisit(publisher.scratch(0), q.x1, q.y1, q.x2, q.y2, -1, [&](const int, const typename Tree::Element& e) {
+					out.push_back(e);
+				});
+				publisher.exit(0);
+			}), tree);
+			done.store(true);
+			writer.join();
+		}
+	}
+
+	if (hasWorkload(options, "nearest")) {
+		std::vector<QuadNeighbor> neighbors;
+		print(timeEach("nearest", options.operations, [&](const int i) {
+			const typename Tree::Query & q = smallQueries[i];
+			tree.nearest(neighbors, (q.x1 + q.x2) / 2, (q.y1 + q.y2) / 2, 8, -1);
+		}), tree);
+	}
+
+	// Diagonal segments an eighth of the world long from the small query centres: the first
+	// hit, every element crossed, and the old way of querying the segment's bounding box and
+	// filtering. Then view frustums with the segments as their axes
+	if (hasWorkload(options, "raycast") || hasWorkload(options, "segment") || hasWorkload(options, "segment-bbox") || hasWorkload(options, "frustum")) {
+		const double reach = worldSize / 8.0;
+		std::uniform_real_distribution<double> angle(0.0, 6.283185307179586);
+		std::vector<double> ax(options.operations), ay(options.operations), bx(options.operations), by(options.operations);
+		for (int i = 0; i < options.operations; i++) {
+			const typename Tree::Query & q = smallQueries[i];
+			const double a = angle(rng);
+			ax[i] = (q.x1 + q.x2) / 2.0;
+			ay[i] = (q.y1 + q.y2) / 2.0;
+			bx[i] = ax[i] + reach * std::cos(a);
+			by[i] = ay[i] + reach * std::sin(a);
+		}
+
+		std::vector<QuadNeighbor> hits;
+		if (hasWorkload(options, "raycast")) {
+			print(timeEach("raycast", options.operations, [&](const int i) {
+				tree.raycast(hits, ax[i], ay[i], bx[i], by[i], 1, -1);
+			}), tree);
+		}
+		if (hasWorkload(options, "segment")) {
+			print(timeEach("segment", options.operations, [&](const int i) {
+				tree.segmentQuery(hits, ax[i], ay[i], bx[i], by[i], -1);
+			}), tree);
+		}
+		if (hasWorkload(options, "segment-bbox")) {
+			print(timeEach("segment-bbox", options.operations, [&](const int i) {
+				const QuadPolygon segment({ ax[i], bx[i] }, { ay[i], by[i] });
+				const int x1 = static_cast<int>(std::floor(std::min(ax[i], bx[i]))), y1 = static_cast<int>(std::floor(std::min(ay[i], by[i])));
+				const int x2 = static_cast<int>(std::ceil(std::max(ax[i], bx[i]))), y2 = static_cast<int>(std::ceil(std::max(ay[i], by[i])));
+				tree.query(out, x1, y1, x2, y2, -1);
+				hits.clear();
+				for (const typename Tree::Element& e : out) {
+					if (segment.intersects(e.x1, e.y1, e.x2, e.y2)) {
+						hits.push_back(QuadNeighbor(e.id, 0.0));
+					}
+				}
+			}), tree);
+		}
+		if (hasWorkload(options, "frustum")) {
+			print(timeEach("frustum", options.operations, [&](const int i) {
+				tree.polygonQuery(out, QuadPolygon::frustum(ax[i], ay[i], bx[i] - ax[i], by[i] - ay[i], 0.4, 0.0, reach), -1);
+			}), tree);
+		}
+	}
+
+	std::vector<std::pair<int, int>> pairs;
+	if (hasWorkload(options, "pairs")) {
+		print(timeAll("pairs", numElements, [&]() {
+			tree.findAllIntersectingPairs(pairs);
+		}), tree);
+	}
+	if (hasWorkload(options, "pairs-parallel")) {
+		print(timeAll("pairs-parallel", numElements, [&]() {
+			tree.findAllIntersectingPairs(pool, pairs);
+		}), tree);
+	}
+
+	// Snapshots of the tree as inserted: written to memory, then loaded into another tree
+	// and queried in place, as a file opened with MappedFile would be. map checks the checksum
+	std::string snapshot;
+	if (hasWorkload(options, "save") || hasWorkload(options, "load") || hasWorkload(options, "map")) {
+		std::ostringstream stream;
+		BenchResult result = timeAll("save", numElements, [&]() {
+			tree.save(stream);
+		});
+		snapshot = stream.str();
+		if (hasWorkload(options, "save")) {
+			print(result, tree);
+		}
+	}
+	if (hasWorkload(options, "load")) {
+		Tree loaded(worldSize, worldSize, maxElements, maxDepth, 0);
+		std::istringstream stream(snapshot);
+		print(timeAll("load", numElements, [&]() {
+			loaded.load(stream);
+		}), loaded);
+	}
+	if (hasWorkload(options, "map")) {
+		Tree mapped(worldSize, worldSize, maxElements, maxDepth, 0);
+		print(timeAll("map", numElements, [&]() {
+			mapped.map(snapshot.data(), snapshot.size(), true);
+		}), mapped);
+	}
+
+	// Move churn: random elements move a few units each
+	std::vector<QuadElement> moved(entities);
+	if (hasWorkload(options, "move")) {
+		std::uniform_int_distribution<int> pick(0, numElements - 1);
+		std::uniform_int_distribution<int> step(-8, 8);
+		std::vector<int> moves(options.operations), dxs(options.operations), dys(options.operations);
+		for (int i = 0; i < options.operations; i++) {
+			moves[i] = pick(rng);
+			dxs[i] = step(rng);
+			dys[i] = step(rng);
+		}
+		print(timeEach("move", options.operations, [&](const int i) {
+			QuadElement & e = moved[moves[i]];
+			const int dx = std::min(std::max(dxs[i], -e.x1), worldSize - 1 - e.x2);
+			const int dy = std::min(std::max(dys[i], -e.y1), worldSize - 1 - e.y2);
+			e.x1 += dx;
+			e.x2 += dx;
+			e.y1 += dy;
+			e.y2 += dy;
+			tree.update(elementIndices[moves[i]], e.x1, e.y1, e.x2, e.y2);
+		}), tree);
+	}
+
+	// Interest management: after a tick moving 1% of the elements one unit, the large
+	// queries ask a copy tracking changes only for what changed in them during the tick
+	if (hasWorkload(options, "query-changed")) {
+		Tree tracked(tree);
+		tracked.trackChanges(true);
+		const std::uint64_t since = tracked.epoch();
+		std::uniform_int_distribution<int> pick(0, numElements - 1);
+		for (int i = 0; i < numElements / 100; i++) {
+			const int index = pick(rng);
+			const QuadElement & e = moved[index];
+			const int dx = e.x2 < worldSize - 1 ? 1 : -1;
+			tracked.update(elementIndices[index], e.x1 + dx, e.y1, e.x2 + dx, e.y2);
+		}
+		typename Tree::Changes changes;
+		print(timeEach("query-changed", options.operations, [&](const int i) {
+			const typename Tree::Query & q = largeQueries[i];
+			tracked.queryChangedSince(changes, q.x1, q.y1, q.x2, q.y2, since);
+		}), tracked);
+	}
+
+	// Remove up to half the elements in random order, then clean up what they leave behind.
+	// The same removals are timed first on a copy keeping back-references
+	std::vector<int> order(elementIndices);
+	std::shuffle(order.begin(), order.end(), rng);
+	if (hasWorkload(options, "remove-backref")) {
+		Tree linked(tree);
+		linked.keepBackReferences(true);
+		print(timeEach("remove-backref", std::min(options.operations, numElements / 2), [&](const int i) {
+			linked.remove(order[i]);
+		}), linked);
+	}
+	if (hasWorkload(options, "remove")) {
+		print(timeEach("remove", std::min(options.operations, numElements / 2), [&](const int i) {
+			tree.remove(order[i]);
+		}), tree);
+	}
+	if (hasWorkload(options, "cleanup")) {
+		print(timeAll("cleanup", 1, [&]() {
+			tree.cleanup();
+		}), tree);
+	}
+	if (hasWorkload(options, "shrink")) {
+		print(timeAll("shrink", 1, [&]() {
+			tree.shrinkToFit();
+		}), tree);
+	}
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::istringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+	return items;
+}
+
+static void printUsage()
+{
+	std::cout << "usage: quadtree_benchmark [options]\n"
+		"  --elements N,...         element counts (default 10000,100000,1000000)\n"
+		"  --distributions D,...    uniform, clustered, zipf (default all)\n"
+		"  --coordinates C,...      coordinate types of the tree: int32, int16, float, double (default int32).\n"
+		"                           int16 is skipped for worlds too large for it, beyond about 1000000 elements\n"
+		"  --configs E:D,...        maxElements:maxDepth settings (default 8:8,32:10)\n"
+		"  --workloads W,...        build, build-parallel, insert, query-small, query-large, insert-tiled,\n"
+		"                           query-tiled, build-points, query-points, build-linear, query-linear,\n"
+		"                           query-cursor, any, count, rebalance, query-rebalanced,\n"
+		"                           relayout, query-relayout, query-packed, query-batch, service, publish,\n"
+		"                           query-published, nearest, raycast, segment, segment-bbox, frustum, pairs,\n"
+		"                           pairs-parallel, save, load, map, move, query-changed, remove-backref,\n"
+		"                           remove, cleanup, shrink (default all)\n"
+		"  --operations N           operations timed per query, move and remove workload (default 100000)\n"
+		"  --threads N              threads for build-parallel, query-batch and pairs-parallel, 0 for all\n"
+		"                           cores (default 0)\n"
+		"  --seed N                 random seed (default 1234)\n"
+		"  --reserve                reserve the trees' memory up front, so inserts never wait on a list\n"
+		"                           being copied to grow\n"
+		"  --hugepages              allocate the int32 tree's lists with HugePageAllocator\n"
+		"  --csv                    print comma separated values\n"
+		"  --stats                  print the tree's stats after inserting, and the work counted per\n"
+		"                           operation after each workload, as lines starting with #. The\n"
+		"                           counters need the library built with QUADTREE_STATS\n";
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--csv") {
+			options.csv = true;
+		}
+		else if (arg == "--stats") {
+			options.stats = true;
+		}
+		else if (arg == "--reserve") {
+			options.reserve = true;
+		}
+		else if (arg == "--hugepages") {
+			options.hugePages = true;
+		}
+		else if (arg == "--elements" && hasValue) {
+			options.elementCounts.clear();
+			for (const std::string& n : split(argv[++i])) {
+				options.elementCounts.push_back(std::atoi(n.c_str()));
+			}
+		}
+		else if (arg == "--distributions" && hasValue) {
+			options.distributions = split(argv[++i]);
+		}
+		else if (arg == "--coordinates" && hasValue) {
+			options.coordinates = split(argv[++i]);
+			for (const std::string& coordinates : options.coordinates) {
+				if (coordinates != "int32" && coordinates != "int16" && coordinates != "float" && coordinates != "double") {
+					printUsage();
+					return 1;
+				}
+			}
+		}
+		else if (arg == "--configs" && hasValue) {
+			options.configs.clear();
+			for (const std::string& config : split(argv[++i])) {
+				const size_t colon = config.find(':');
+				if (colon == std::string::npos) {
+					printUsage();
+					return 1;
+				}
+				options.configs.push_back(std::make_pair(std::atoi(config.substr(0, colon).c_str()), std::atoi(config.substr(colon + 1).c_str())));
+			}
+		}
+		else if (arg == "--workloads" && hasValue) {
+			options.workloads = split(argv[++i]);
+		}
+		else if (arg == "--operations" && hasValue) {
+			options.operations = std::atoi(argv[++i]);
+		}
+		else if (arg == "--threads" && hasValue) {
+			options.threads = std::atoi(argv[++i]);
+		}
+		else if (arg == "--seed" && hasValue) {
+			options.seed = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else {
+			printUsage();
+			return arg == "--help" ? 0 : 1;
+		}
+	}
+
+	ThreadPool pool(options.threads);
+	if (!options.csv) {
+		std::cout << "intersect kernel: " << intersectKernelName() << ", threads: " << pool.size() << std::endl;
+	}
+	printHeader(options);
+
+	for (const std::string& distribution : options.distributions) {
+		for (const int numElements : options.elementCounts) {
+			// Grow the world with the element count so that the density stays the same
+			const int worldSize = std::max(4096, static_cast<int>(std::sqrt(static_cast<double>(numElements)) * 32));
+			std::mt19937 rng(options.seed);
+			PointGenerator points(distribution, worldSize, rng);
+			std::uniform_int_distribution<int> size(1, 16);
+
+			std::vector<QuadElement> entities;
+			entities.reserve(numElements);
+			for (int i = 0; i < numElements; i++) {
+				int x, y;
+				points.point(rng, x, y);
+				const int x2 = std::min(x + size(rng), worldSize - 1), y2 = std::min(y + size(rng), worldSize - 1);
+				entities.push_back(QuadElement(i, x, y, x2, y2));
+			}
+
+			for (const std::pair<int, int>& config : options.configs) {
+				for (const std::string& coordinates : options.coordinates) {
+					if (coordinates == "int32" && options.hugePages) {
+						runConfig<BasicQuadtree<int, int, 0, 0, HugePageAllocator<char>>>(options, pool, distribution, coordinates, worldSize, entities, points, config, rng);
+					}
+					else if (coordinates == "int32") {
+						runConfig<Quadtree>(options, pool, distribution, coordinates, worldSize, entities, points, config, rng);
+					}
+					else if (coordinates == "int16" && worldSize <= std::numeric_limits<short>::max()) {
+						runConfig<BasicQuadtree<short, int, 0, 0>>(options, pool, distribution, coordinates, worldSize, entities, points, config, rng);
+					}
+					else if (coordinates == "float") {
+						runConfig<BasicQuadtree<float, int, 0, 0>>(options, pool, distribution, coordinates, worldSize, entities, points, config, rng);
+					}
+					else if (coordinates == "double") {
+						runConfig<BasicQuadtree<double, int, 0, 0>>(options, pool, distribution, coordinates, worldSize, entities, points, config, rng);
+					}
+				}
+			}
+		}
+	}
+}
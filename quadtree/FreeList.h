@@ -1,17 +1,29 @@
 #pragma once
 #include "pch.h"
+#include <cstddef>
+#include <memory>
+#include <utility>
 #include <vector>
 
 /// Provides an indexed free list with constant-time removals from anywhere
 /// in the list without invalidating indices. T must be trivially constructible 
-/// and destructible.
-template <class T>
+/// and destructible. The slots are allocated with Allocator, rebound to the
+/// slot type, so an arena or huge page allocator can be plugged in.
+template <class T, class Allocator = std::allocator<T>>
 class FreeList
 {
 public:
 	/// Creates a new free list.
 	FreeList();
 
+	// Copies the list. A copy of a list attached to outside memory reads the same memory.
+	FreeList(const FreeList& other);
+	FreeList& operator=(const FreeList& other);
+
+	// Moves the list, leaving 'other' empty.
+	FreeList(FreeList&& other);
+	FreeList& operator=(FreeList&& other);
+
 	/// Inserts an element to the free list and returns an index to it.
 	int insert(const T& element);
 
@@ -21,21 +33,275 @@ public:
 	// Removes all elements from the free list.
 	void clear();
 
+	// Makes room for n slots, so that the list doesn't move until it grows past them.
+	void reserve(int n);
+
+	// Drops the free slots at the end of the list and releases the memory beyond
+	// the slots left.
+	void shrinkToFit();
+
 	// Returns the size/range of valid indices.
 	int size() const;
 
+	// Returns the number of free slots waiting to be reused.
+	int freeCount() const;
+
+	// Returns the number of bytes allocated for the list, including free slots.
+	std::size_t bytes() const;
+
 	// Returns the nth element.
 	T& operator[](int n);
 
 	// Returns the nth element.
 	const T& operator[](int n) const;
 
+	// Raw access to the slots, for snapshots. Each slot is slotSize() bytes and the free
+	// slots are chained from firstFree().
+	static std::size_t slotSize();
+	const void* slots() const;
+	int firstFree() const;
+
+	// Resizes the list to 'count' slots with the given free chain and returns them for
+	// the caller to fill in.
+	void* resizeSlots(int count, int firstFree);
+
+	// Reads 'count' slots in place from memory the caller keeps alive, without copying
+	// them. insert, erase, reserve and shrinkToFit copy the slots into the list's own
+	// memory first. Writing through operator[] writes to the outside memory.
+	void attach(const void* slots, int count, int firstFree);
+
 private:
 	union FreeElement
 	{
 		T element;
 		int next;
+
+		// Lets T have constructors, which delete the union's default constructor
+		FreeElement() : next(-1) {}
 	};
-	std::vector<FreeElement> data;
+	std::vector<FreeElement, typename std::allocator_traits<Allocator>::template rebind_alloc<FreeElement>> data;
+
+	void detach();
+
+	// The slots in use: data's, or outside memory after attach
+	FreeElement* items;
+	int count;
 	int first_free;
+
+	// True while items points to outside memory
+	bool is_attached;
 };
+
+template <class T, class Allocator>
+FreeList<T, Allocator>::FreeList() : items(nullptr), count(0), first_free(-1), is_attached(false)
+{
+}
+
+template <class T, class Allocator>
+FreeList<T, Allocator>::FreeList(const FreeList& other)
+	: data(other.data), count(other.count), first_free(other.first_free), is_attached(other.is_attached)
+{
+	items = is_attached ? other.items : data.data();
+}
+
+template <class T, class Allocator>
+FreeList<T, Allocator>& FreeList<T, Allocator>::operator=(const FreeList& other)
+{
+	data = other.data;
+	items = other.is_attached ? other.items : data.data();
+	count = other.count;
+	first_free = other.first_free;
+	is_attached = other.is_attached;
+	return *this;
+}
+
+// Moving the vector keeps its buffer, so 'items' stays valid whichever memory it points to
+template <class T, class Allocator>
+FreeList<T, Allocator>::FreeList(FreeList&& other)
+	: data(std::move(other.data)), items(other.items), count(other.count), first_free(other.first_free), is_attached(other.is_attached)
+{
+	other.clear();
+}
+
+template <class T, class Allocator>
+FreeList<T, Allocator>& FreeList<T, Allocator>::operator=(FreeList&& other)
+{
+	if (this != &other) {
+		data = std::move(other.data);
+		items = other.items;
+		count = other.count;
+		first_free = other.first_free;
+		is_attached = other.is_attached;
+		other.clear();
+	}
+	return *this;
+}
+
+// Insert an element into the FreeList - either an empty node or a new node
+// Return the index to where the element was inserted
+template <class T, class Allocator>
+int FreeList<T, Allocator>::insert(const T& element)
+{
+	detach();
+	if (first_free != -1)
+	{
+		const int index = first_free;
+		first_free = items[first_free].next;
+		items[index].element = element;
+		return index;
+	}
+	else
+	{
+		FreeElement fe;
+		fe.element = element;
+		data.push_back(fe);
+		items = data.data();
+		return count++;
+	}
+}
+
+// Erase the element at index n
+// The empty node becomes the first in the free linked list
+template <class T, class Allocator>
+void FreeList<T, Allocator>::erase(int n)
+{
+	detach();
+	items[n].next = first_free;
+	first_free = n;
+}
+
+template <class T, class Allocator>
+void FreeList<T, Allocator>::clear()
+{
+	data.clear();
+	items = data.data();
+	count = 0;
+	first_free = -1;
+	is_attached = false;
+}
+
+// A reservation beyond what the list ends up using mostly costs address space, as the OS
+// only commits pages of a large allocation once they are written to
+template <class T, class Allocator>
+void FreeList<T, Allocator>::reserve(int n)
+{
+	detach();
+	data.reserve(n);
+	items = data.data();
+}
+
+// Walks the free chain, so takes time linear in the size of the list. Indices of the
+// elements left are unchanged, and the remaining free slots are chained in index order
+// so that the next inserts fill the lowest ones first
+template <class T, class Allocator>
+void FreeList<T, Allocator>::shrinkToFit()
+{
+	detach();
+	std::vector<bool> isFree(count, false);
+	for (int n = first_free; n != -1; n = items[n].next) {
+		isFree[n] = true;
+	}
+	while (count > 0 && isFree[count - 1]) {
+		count--;
+	}
+	first_free = -1;
+	for (int n = count - 1; n >= 0; n--) {
+		if (isFree[n]) {
+			items[n].next = first_free;
+			first_free = n;
+		}
+	}
+	data.resize(count);
+	data.shrink_to_fit();
+	items = data.data();
+}
+
+template <class T, class Allocator>
+int FreeList<T, Allocator>::size() const
+{
+	return count;
+}
+
+// Walks the free chain, so takes time linear in the number of free slots
+template <class T, class Allocator>
+int FreeList<T, Allocator>::freeCount() const
+{
+	int numFree = 0;
+	for (int n = first_free; n != -1; n = items[n].next) {
+		numFree++;
+	}
+	return numFree;
+}
+
+// The vector never shrinks, so this is also the most the list has used. Attached
+// memory isn't counted
+template <class T, class Allocator>
+std::size_t FreeList<T, Allocator>::bytes() const
+{
+	return data.capacity() * sizeof(FreeElement);
+}
+
+template <class T, class Allocator>
+T& FreeList<T, Allocator>::operator[](int n)
+{
+	return items[n].element;
+}
+
+template <class T, class Allocator>
+const T& FreeList<T, Allocator>::operator[](int n) const
+{
+	return items[n].element;
+}
+
+template <class T, class Allocator>
+std::size_t FreeList<T, Allocator>::slotSize()
+{
+	return sizeof(FreeElement);
+}
+
+template <class T, class Allocator>
+const void* FreeList<T, Allocator>::slots() const
+{
+	return items;
+}
+
+template <class T, class Allocator>
+int FreeList<T, Allocator>::firstFree() const
+{
+	return first_free;
+}
+
+template <class T, class Allocator>
+void* FreeList<T, Allocator>::resizeSlots(int n, int firstFree)
+{
+	data.resize(n);
+	items = data.data();
+	count = n;
+	first_free = firstFree;
+	is_attached = false;
+	return items;
+}
+
+// The slots are only read through the list, and the list isn't modified while
+// attached, so dropping const is safe
+template <class T, class Allocator>
+void FreeList<T, Allocator>::attach(const void* slots, int n, int firstFree)
+{
+	data.clear();
+	items = static_cast<FreeElement*>(const_cast<void*>(slots));
+	count = n;
+	first_free = firstFree;
+	is_attached = true;
+}
+
+// Copies attached slots into the list's own memory, so that changing the list neither
+// writes to the outside memory nor loses the slots when the vector is resized
+template <class T, class Allocator>
+void FreeList<T, Allocator>::detach()
+{
+	if (is_attached) {
+		data.assign(items, items + count);
+		items = data.data();
+		is_attached = false;
+	}
+}
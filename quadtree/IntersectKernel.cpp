@@ -0,0 +1,195 @@
+#include "pch.h"
+#include "IntersectKernel.h"
+
+#ifdef QUADTREE_X86_KERNELS
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang need the instruction set enabled per function to compile its intrinsics
+// without enabling it for the whole file. MSVC compiles any intrinsic as is
+#if defined(__GNUC__)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL_TARGET(isa)
+#endif
+
+int intersectScalar(const int* x1, const int* y1, const int* x2, const int* y2, const int count,
+	const int qx1, const int qy1, const int qx2, const int qy2, int* out)
+{
+	// Always write the position and only advance on a hit, which keeps the loop branch free
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		out[n] = i;
+		n += x1[i] <= qx2 && x2[i] >= qx1 && y1[i] <= qy2 && y2[i] >= qy1;
+	}
+	return n;
+}
+
+#ifdef QUADTREE_X86_KERNELS
+
+// Returns the index of the lowest set bit of a non-zero mask
+static inline int lowestBit(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Writes base + the position of every set bit in the mask to out
+static inline int writeHits(unsigned mask, const int base, int* out)
+{
+	int n = 0;
+	while (mask != 0) {
+		out[n++] = base + lowestBit(mask);
+		mask &= mask - 1;
+	}
+	return n;
+}
+
+// Each kernel tests a full vector of boxes at a time. An element misses the query if
+// x1 > qx2, qx1 > x2, y1 > qy2 or qy1 > y2, so the hit mask is the complement of the
+// OR of those comparisons. The remaining boxes go through the scalar loop
+
+KERNEL_TARGET("sse2")
+int intersectSse2(const int* x1, const int* y1, const int* x2, const int* y2, const int count,
+	const int qx1, const int qy1, const int qx2, const int qy2, int* out)
+{
+	const __m128i vqx1 = _mm_set1_epi32(qx1), vqy1 = _mm_set1_epi32(qy1);
+	const __m128i vqx2 = _mm_set1_epi32(qx2), vqy2 = _mm_set1_epi32(qy2);
+	int n = 0, i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const __m128i miss = _mm_or_si128(
+			_mm_or_si128(_mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x1 + i)), vqx2),
+				_mm_cmpgt_epi32(vqx1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(x2 + i)))),
+			_mm_or_si128(_mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y1 + i)), vqy2),
+				_mm_cmpgt_epi32(vqy1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(y2 + i)))));
+		const unsigned hits = ~static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(miss))) & 0xF;
+		n += writeHits(hits, i, out + n);
+	}
+	const int tail = intersectScalar(x1 + i, y1 + i, x2 + i, y2 + i, count - i, qx1, qy1, qx2, qy2, out + n);
+	for (int j = n; j < n + tail; j++) {
+		out[j] += i;
+	}
+	return n + tail;
+}
+
+KERNEL_TARGET("avx2")
+int intersectAvx2(const int* x1, const int* y1, const int* x2, const int* y2, const int count,
+	const int qx1, const int qy1, const int qx2, const int qy2, int* out)
+{
+	const __m256i vqx1 = _mm256_set1_epi32(qx1), vqy1 = _mm256_set1_epi32(qy1);
+	const __m256i vqx2 = _mm256_set1_epi32(qx2), vqy2 = _mm256_set1_epi32(qy2);
+	int n = 0, i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const __m256i miss = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpgt_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x1 + i)), vqx2),
+				_mm256_cmpgt_epi32(vqx1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x2 + i)))),
+			_mm256_or_si256(_mm256_cmpgt_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(y1 + i)), vqy2),
+				_mm256_cmpgt_epi32(vqy1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y2 + i)))));
+		const unsigned hits = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(miss))) & 0xFF;
+		n += writeHits(hits, i, out + n);
+	}
+	const int tail = intersectScalar(x1 + i, y1 + i, x2 + i, y2 + i, count - i, qx1, qy1, qx2, qy2, out + n);
+	for (int j = n; j < n + tail; j++) {
+		out[j] += i;
+	}
+	return n + tail;
+}
+
+KERNEL_TARGET("avx512f")
+int intersectAvx512(const int* x1, const int* y1, const int* x2, const int* y2, const int count,
+	const int qx1, const int qy1, const int qx2, const int qy2, int* out)
+{
+	const __m512i vqx1 = _mm512_set1_epi32(qx1), vqy1 = _mm512_set1_epi32(qy1);
+	const __m512i vqx2 = _mm512_set1_epi32(qx2), vqy2 = _mm512_set1_epi32(qy2);
+	int n = 0, i = 0;
+	for (; i + 16 <= count; i += 16) {
+		// AVX-512 compares straight into a mask, so the hit test is used as is
+		__mmask16 hits = _mm512_cmple_epi32_mask(_mm512_loadu_si512(x1 + i), vqx2);
+		hits = _mm512_mask_cmpge_epi32_mask(hits, _mm512_loadu_si512(x2 + i), vqx1);
+		hits = _mm512_mask_cmple_epi32_mask(hits, _mm512_loadu_si512(y1 + i), vqy2);
+		hits = _mm512_mask_cmpge_epi32_mask(hits, _mm512_loadu_si512(y2 + i), vqy1);
+		n += writeHits(static_cast<unsigned>(hits), i, out + n);
+	}
+	const int tail = intersectScalar(x1 + i, y1 + i, x2 + i, y2 + i, count - i, qx1, qy1, qx2, qy2, out + n);
+	for (int j = n; j < n + tail; j++) {
+		out[j] += i;
+	}
+	return n + tail;
+}
+
+// Returns true if the CPU and OS support AVX2 / AVX-512F (the OS must save the wider registers)
+static bool cpuSupports(const bool avx512)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave) {
+		return false;
+	}
+	const unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	if (avx512) {
+		return (info[1] & (1 << 16)) != 0 && (xcr0 & 0xE6) == 0xE6;
+	}
+	return (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+#else
+	__builtin_cpu_init();
+	return avx512 ? __builtin_cpu_supports("avx512f") : __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+namespace
+{
+	struct KernelChoice
+	{
+		IntersectKernel kernel;
+		const char* name;
+	};
+
+	KernelChoice chooseKernel()
+	{
+#ifdef QUADTREE_X86_KERNELS
+		if (cpuSupports(true)) {
+			return { intersectAvx512, "avx512" };
+		}
+		if (cpuSupports(false)) {
+			return { intersectAvx2, "avx2" };
+		}
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		return { intersectSse2, "sse2" };
+#endif
+#endif
+		return { intersectScalar, "scalar" };
+	}
+
+	const KernelChoice& kernelChoice()
+	{
+		static const KernelChoice choice = chooseKernel();
+		return choice;
+	}
+}
+
+IntersectKernel intersectKernel()
+{
+	return kernelChoice().kernel;
+}
+
+const char* intersectKernelName()
+{
+	return kernelChoice().name;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "pch.h"
+
+/// Tests one AABB against a run of AABBs stored as structure-of-arrays and
+/// writes the positions (0 to count - 1) of those that intersect it to 'out',
+/// in increasing order. Returns the number of positions written. 'out' must
+/// have room for 'count' entries. Uses the same inclusive test as
+/// Quadtree::intersect.
+typedef int (*IntersectKernel)(const int* x1, const int* y1, const int* x2, const int* y2, int count,
+	int qx1, int qy1, int qx2, int qy2, int* out);
+
+/// Returns the widest kernel the CPU supports (AVX-512, AVX2, SSE2 or scalar),
+/// detected on the first call.
+IntersectKernel intersectKernel();
+
+/// Returns the name of the kernel returned by intersectKernel.
+const char* intersectKernelName();
+
+// The individual kernels, for benchmarking. Only call a SIMD kernel if the
+// CPU supports it.
+int intersectScalar(const int* x1, const int* y1, const int* x2, const int* y2, int count,
+	int qx1, int qy1, int qx2, int qy2, int* out);
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define QUADTREE_X86_KERNELS
+int intersectSse2(const int* x1, const int* y1, const int* x2, const int* y2, int count,
+	int qx1, int qy1, int qx2, int qy2, int* out);
+int intersectAvx2(const int* x1, const int* y1, const int* x2, const int* y2, int count,
+	int qx1, int qy1, int qx2, int qy2, int* out);
+int intersectAvx512(const int* x1, const int* y1, const int* x2, const int* y2, int count,
+	int qx1, int qy1, int qx2, int qy2, int* out);
+#endif
+
+/// The scalar kernel for any coordinate type, used by trees whose coordinates
+/// are not int.
+template <class T>
+int intersectGeneric(const T* x1, const T* y1, const T* x2, const T* y2, int count,
+	T qx1, T qy1, T qx2, T qy2, int* out)
+{
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		out[n] = i;
+		n += x1[i] <= qx2 && x2[i] >= qx1 && y1[i] <= qy2 && y2[i] >= qy1;
+	}
+	return n;
+}
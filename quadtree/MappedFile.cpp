@@ -0,0 +1,95 @@
+#include "pch.h"
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : address(nullptr), length(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char* path)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	// The view keeps the file mapping alive, so both handles can be closed once it exists
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		return false;
+	}
+	address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (address == nullptr) {
+		return false;
+	}
+	length = static_cast<std::size_t>(fileSize.QuadPart);
+#else
+	const int file = ::open(path, O_RDONLY);
+	if (file == -1) {
+		return false;
+	}
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0) {
+		::close(file);
+		return false;
+	}
+
+	// The mapping holds its own reference to the file, so it can be closed straight away
+	void* mapped = mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+	::close(file);
+	if (mapped == MAP_FAILED) {
+		return false;
+	}
+	address = mapped;
+	length = static_cast<std::size_t>(status.st_size);
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (address == nullptr) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(address);
+#else
+	munmap(address, length);
+#endif
+	address = nullptr;
+	length = 0;
+}
+
+const void* MappedFile::data() const
+{
+	return address;
+}
+
+std::size_t MappedFile::size() const
+{
+	return length;
+}
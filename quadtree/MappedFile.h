@@ -0,0 +1,32 @@
+#pragma once
+#include "pch.h"
+#include <cstddef>
+
+/// Maps a whole file read-only into memory. The pages come from the OS page
+/// cache, so every process mapping the same file shares one copy of them.
+class MappedFile
+{
+public:
+	MappedFile();
+
+	/// Unmaps the file.
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Maps the file at 'path', unmapping any file mapped before. Returns false if
+	// the file can't be opened or mapped, or is empty.
+	bool open(const char* path);
+
+	// Unmaps the file. Anything reading the mapping must be done with it.
+	void close();
+
+	// The mapped bytes, nullptr if no file is mapped.
+	const void* data() const;
+	std::size_t size() const;
+
+private:
+	void* address;
+	std::size_t length;
+};
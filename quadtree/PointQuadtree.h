@@ -0,0 +1,369 @@
+#pragma once
+#include "pch.h"
+#include "Quadtree.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Represents a point in a point quadtree.
+template <class Coord, class Payload>
+struct BasicQuadPoint
+{
+	// Stores the ID for the point (can be used to refer to external data).
+	Payload id;
+
+	// Stores the position of the point.
+	Coord x, y;
+
+	BasicQuadPoint(const Payload& id, Coord x, Coord y) : id(id), x(x), y(y) {
+	}
+};
+
+typedef BasicQuadPoint<int, int> QuadPoint;
+
+/// A linear quadtree of points, for indexes of point entities rebuilt every frame.
+/// The world is divided into a grid of 2^maxDepth by 2^maxDepth cells and the points are
+/// kept sorted by the Morton code of their cell, so that every node of the implied
+/// quadtree is a contiguous range of the sorted points. There are no nodes, element
+/// nodes or duplicates: a node's children are found by binary searching its range for
+/// the keys where each quarter starts, and a query turns its rectangle into the key
+/// ranges of the nodes it covers. Points in nodes wholly inside the rectangle are
+/// reported without testing them, so only the cells along its border are tested.
+/// A tree costs the point and a 4-byte key per point, and is built with a radix sort
+/// rather than by inserting points one at a time. Points are never moved or removed
+/// individually: a new set of points is built in their place.
+///   Coord: the coordinate type, e.g. short, int, float or double
+///   Payload: the id stored with each point
+///   Allocator: allocates the points, keys and sort buffers
+template <class Coord, class Payload, class Allocator = std::allocator<char>>
+class BasicPointQuadtree
+{
+public:
+	typedef Coord CoordType;
+	typedef Payload PayloadType;
+	typedef BasicQuadPoint<Coord, Payload> Point;
+
+private:
+	// A key and the index of its point in the points passed to build, sorted by build
+	struct SortItem
+	{
+		std::uint32_t key;
+		std::uint32_t index;
+	};
+
+	// A node still to be visited by a query: its cell in the grid, its size as a shift,
+	// and the range of points in it
+	struct NodeRange
+	{
+		std::uint32_t cellX, cellY;
+		int shift;
+		int begin, end;
+	};
+
+	template <class T>
+	using Vector = std::vector<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+	// The points and their keys, both sorted by key
+	Vector<Point> points;
+	Vector<std::uint32_t> keys;
+
+	// The radix sort's buffers, kept between builds so that rebuilding allocates nothing
+	Vector<SortItem> sortItems, sortTemp;
+
+	// The number of points a node may hold before a query splits it rather than testing
+	// them, and the depth of the grid, at most 16 so that keys fit in 32 bits
+	int maxElements;
+	int maxDepth;
+
+	// Cells per world unit along each axis
+	double scaleX, scaleY;
+
+	std::uint32_t cellOf(const Coord v, const double scale) const;
+	std::uint32_t keyOf(const Coord x, const Coord y) const;
+	static bool contains(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const Point& point);
+	template <class RangeVisitor>
+	void visitRanges(const Coord x1, const Coord y1, const Coord x2, const Coord y2, RangeVisitor&& visit) const;
+
+public:
+	void build(const std::vector<Point>& newPoints);
+	std::vector<Point> query(const Coord x1, const Coord y1, const Coord x2, const Coord y2) const;
+	void query(std::vector<Point>& out, const Coord x1, const Coord y1, const Coord x2, const Coord y2) const;
+	template <class Visitor>
+	void queryVisit(const Coord x1, const Coord y1, const Coord x2, const Coord y2, Visitor&& visit) const;
+	int count(const Coord x1, const Coord y1, const Coord x2, const Coord y2) const;
+	const Point& point(const int index) const;
+	int size() const;
+	void reserve(const int numPoints);
+	void shrinkToFit();
+	QuadMemoryUsage memoryUsage() const;
+	BasicPointQuadtree(const Coord width, const Coord height, const int maxElements, const int maxDepth);
+
+	// Stores the quadtree extents
+	const Coord width, height;
+};
+
+typedef BasicPointQuadtree<int, int> PointQuadtree;
+
+// Calls visit(index, point) once for every point in the specified rectangle, in key
+// order. The index is the point's position in the tree, see point(). The tree is only
+// read, so threads may query it concurrently as long as nothing rebuilds it
+template <class Coord, class Payload, class Allocator>
+template <class Visitor>
+void BasicPointQuadtree<Coord, Payload, Allocator>::queryVisit(const Coord x1, const Coord y1, const Coord x2, const Coord y2, Visitor&& visit) const
+{
+	visitRanges(x1, y1, x2, y2, [&](const int begin, const int end, const bool inside) {
+		for (int i = begin; i < end; i++) {
+			if (inside || contains(x1, y1, x2, y2, points[i])) {
+				visit(i, points[i]);
+			}
+		}
+	});
+}
+
+// Calls visit(begin, end, inside) for ranges of points holding every point in the
+// specified rectangle. Points in a range with inside set are all in the rectangle; the
+// others must be tested.
+// The rectangle's corners are mapped to cells. Cells strictly between the corner cells
+// only hold points strictly inside the rectangle, as the mapping never decreases, so
+// nodes made of them are inside. Nodes on the border are split while they hold more
+// than maxElements points, and their points tested once they hold fewer.
+// The descent starts at the smallest node holding both corner cells, whose range is
+// found with two binary searches, rather than splitting every node above it
+template <class Coord, class Payload, class Allocator>
+template <class RangeVisitor>
+void BasicPointQuadtree<Coord, Payload, Allocator>::visitRanges(const Coord x1, const Coord y1, const Coord x2, const Coord y2, RangeVisitor&& visit) const
+{
+	if (points.size() == 0 || x2 < x1 || y2 < y1) {
+		return;
+	}
+	const std::uint32_t cx1 = cellOf(x1, scaleX), cy1 = cellOf(y1, scaleY);
+	const std::uint32_t cx2 = cellOf(x2, scaleX), cy2 = cellOf(y2, scaleY);
+
+	int startShift = 0;
+	while ((cx1 >> startShift) != (cx2 >> startShift) || (cy1 >> startShift) != (cy2 >> startShift)) {
+		startShift++;
+	}
+	const std::uint32_t startX = cx1 >> startShift << startShift, startY = cy1 >> startShift << startShift;
+	const std::uint32_t startKey = quadSpreadBits(startX) | (quadSpreadBits(startY) << 1);
+	const std::uint32_t startLastKey = startKey + static_cast<std::uint32_t>((std::uint64_t(1) << (2 * startShift)) - 1);
+	const int startBegin = static_cast<int>(std::lower_bound(keys.begin(), keys.end(), startKey) - keys.begin());
+	const int startEnd = static_cast<int>(std::upper_bound(keys.begin() + startBegin, keys.end(), startLastKey) - keys.begin());
+	if (startBegin == startEnd) {
+		return;
+	}
+
+	// Each level pushes at most 4 children in place of the node popped
+	NodeRange stack[3 * 16 + 1];
+	int top = 0;
+	stack[top++] = NodeRange{ startX, startY, startShift, startBegin, startEnd };
+	while (top > 0) {
+		const NodeRange node = stack[--top];
+		const std::uint32_t last = (1u << node.shift) - 1;
+		if (node.cellX > cx1 && node.cellX + last < cx2 && node.cellY > cy1 && node.cellY + last < cy2) {
+			visit(node.begin, node.end, true);
+			continue;
+		}
+		if (node.shift == 0 || node.end - node.begin <= maxElements) {
+			visit(node.begin, node.end, false);
+			continue;
+		}
+
+		// The children are the four quarters of the node's key range, in Morton order.
+		// Push them backwards so they are visited in key order
+		const int shift = node.shift - 1;
+		const std::uint32_t half = 1u << shift;
+		const std::uint32_t quarter = 1u << (2 * shift);
+		const std::uint32_t base = quadSpreadBits(node.cellX) | (quadSpreadBits(node.cellY) << 1);
+		int ends[4];
+		ends[3] = node.end;
+		for (int q = 2; q >= 0; q--) {
+			ends[q] = static_cast<int>(std::lower_bound(keys.begin() + node.begin, keys.begin() + ends[q + 1], base + (q + 1) * quarter) - keys.begin());
+		}
+		for (int q = 3; q >= 0; q--) {
+			const int begin = q > 0 ? ends[q - 1] : node.begin;
+			const std::uint32_t cellX = node.cellX + (q & 1 ? half : 0);
+			const std::uint32_t cellY = node.cellY + (q & 2 ? half : 0);
+			if (begin < ends[q] && cellX <= cx2 && cellX + half - 1 >= cx1 && cellY <= cy2 && cellY + half - 1 >= cy1) {
+				stack[top++] = NodeRange{ cellX, cellY, shift, begin, ends[q] };
+			}
+		}
+	}
+}
+
+// Replaces the points with a new set, sorted by key with a least significant digit
+// radix sort over the bytes of the keys. Bytes that are the same in every key, such as
+// the high bytes of a shallow grid, are skipped
+template <class Coord, class Payload, class Allocator>
+void BasicPointQuadtree<Coord, Payload, Allocator>::build(const std::vector<Point>& newPoints)
+{
+	const std::size_t n = newPoints.size();
+	sortItems.resize(n);
+	sortTemp.resize(n);
+
+	// Count every byte of the keys in one pass
+	std::size_t counts[4][256] = {};
+	for (std::size_t i = 0; i < n; i++) {
+		const std::uint32_t key = keyOf(newPoints[i].x, newPoints[i].y);
+		sortItems[i].key = key;
+		sortItems[i].index = static_cast<std::uint32_t>(i);
+		counts[0][key & 255]++;
+		counts[1][(key >> 8) & 255]++;
+		counts[2][(key >> 16) & 255]++;
+		counts[3][key >> 24]++;
+	}
+
+	// Skip the bytes that are the same in every key, and every byte of an empty set
+	for (int digit = 0; digit < 4 && 8 * digit < 2 * maxDepth; digit++) {
+		std::size_t * count = counts[digit];
+		const int shift = 8 * digit;
+		if (n == 0 || count[(sortItems[0].key >> shift) & 255] == n) {
+			continue;
+		}
+		std::size_t offset = 0;
+		for (int b = 0; b < 256; b++) {
+			const std::size_t c = count[b];
+			count[b] = offset;
+			offset += c;
+		}
+		for (std::size_t i = 0; i < n; i++) {
+			const SortItem & item = sortItems[i];
+			sortTemp[count[(item.key >> shift) & 255]++] = item;
+		}
+		sortItems.swap(sortTemp);
+	}
+
+	points.clear();
+	keys.clear();
+	for (std::size_t i = 0; i < n; i++) {
+		points.push_back(newPoints[sortItems[i].index]);
+		keys.push_back(sortItems[i].key);
+	}
+}
+
+// Returns the points in the specified rectangle
+template <class Coord, class Payload, class Allocator>
+std::vector<typename BasicPointQuadtree<Coord, Payload, Allocator>::Point> BasicPointQuadtree<Coord, Payload, Allocator>::query(const Coord x1, const Coord y1, const Coord x2, const Coord y2) const
+{
+	std::vector<Point> out;
+	query(out, x1, y1, x2, y2);
+	return out;
+}
+
+// Same as above but fills the vector supplied (cleared first), so that repeated queries
+// reuse its memory
+template <class Coord, class Payload, class Allocator>
+void BasicPointQuadtree<Coord, Payload, Allocator>::query(std::vector<Point>& out, const Coord x1, const Coord y1, const Coord x2, const Coord y2) const
+{
+	out.clear();
+	visitRanges(x1, y1, x2, y2, [&](const int begin, const int end, const bool inside) {
+		if (inside) {
+			out.insert(out.end(), points.begin() + begin, points.begin() + end);
+			return;
+		}
+		for (int i = begin; i < end; i++) {
+			if (contains(x1, y1, x2, y2, points[i])) {
+				out.push_back(points[i]);
+			}
+		}
+	});
+}
+
+// Returns the number of points in the specified rectangle. Ranges inside it are counted
+// without reading their points
+template <class Coord, class Payload, class Allocator>
+int BasicPointQuadtree<Coord, Payload, Allocator>::count(const Coord x1, const Coord y1, const Coord x2, const Coord y2) const
+{
+	int found = 0;
+	visitRanges(x1, y1, x2, y2, [&](const int begin, const int end, const bool inside) {
+		if (inside) {
+			found += end - begin;
+			return;
+		}
+		for (int i = begin; i < end; i++) {
+			found += contains(x1, y1, x2, y2, points[i]) ? 1 : 0;
+		}
+	});
+	return found;
+}
+
+// Returns the point at an index, as passed to visitors. Indices change on every build
+template <class Coord, class Payload, class Allocator>
+const typename BasicPointQuadtree<Coord, Payload, Allocator>::Point& BasicPointQuadtree<Coord, Payload, Allocator>::point(const int index) const
+{
+	return points[index];
+}
+
+template <class Coord, class Payload, class Allocator>
+int BasicPointQuadtree<Coord, Payload, Allocator>::size() const
+{
+	return static_cast<int>(points.size());
+}
+
+// Reserves room for builds of up to numPoints points
+template <class Coord, class Payload, class Allocator>
+void BasicPointQuadtree<Coord, Payload, Allocator>::reserve(const int numPoints)
+{
+	points.reserve(numPoints);
+	keys.reserve(numPoints);
+	sortItems.reserve(numPoints);
+	sortTemp.reserve(numPoints);
+}
+
+// Frees the sort buffers and any room beyond the points, for a tree that won't be
+// rebuilt for a while
+template <class Coord, class Payload, class Allocator>
+void BasicPointQuadtree<Coord, Payload, Allocator>::shrinkToFit()
+{
+	points.shrink_to_fit();
+	keys.shrink_to_fit();
+	Vector<SortItem>().swap(sortItems);
+	Vector<SortItem>().swap(sortTemp);
+}
+
+// Returns the bytes allocated for the points, counted as elements, and for their keys
+// and the sort buffers, counted as nodes. There are no element nodes
+template <class Coord, class Payload, class Allocator>
+QuadMemoryUsage BasicPointQuadtree<Coord, Payload, Allocator>::memoryUsage() const
+{
+	return QuadMemoryUsage(points.capacity() * sizeof(Point), 0,
+		keys.capacity() * sizeof(std::uint32_t) + (sortItems.capacity() + sortTemp.capacity()) * sizeof(SortItem));
+}
+
+// Maps a coordinate to its cell along an axis. Coordinates outside the world go to the
+// cells on its edge, so points outside it are still found
+template <class Coord, class Payload, class Allocator>
+std::uint32_t BasicPointQuadtree<Coord, Payload, Allocator>::cellOf(const Coord v, const double scale) const
+{
+	const double cell = static_cast<double>(v) * scale;
+	const std::uint32_t last = (1u << maxDepth) - 1;
+	if (!(cell > 0)) {
+		return 0;
+	}
+	return cell >= last ? last : static_cast<std::uint32_t>(cell);
+}
+
+// The Morton code of a position's cell: the bits of its cell's x and y interleaved, x in
+// the even bits
+template <class Coord, class Payload, class Allocator>
+std::uint32_t BasicPointQuadtree<Coord, Payload, Allocator>::keyOf(const Coord x, const Coord y) const
+{
+	return quadSpreadBits(cellOf(x, scaleX)) | (quadSpreadBits(cellOf(y, scaleY)) << 1);
+}
+
+template <class Coord, class Payload, class Allocator>
+bool BasicPointQuadtree<Coord, Payload, Allocator>::contains(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const Point& point)
+{
+	return point.x >= x1 && point.x <= x2 && point.y >= y1 && point.y <= y2;
+}
+
+template <class Coord, class Payload, class Allocator>
+BasicPointQuadtree<Coord, Payload, Allocator>::BasicPointQuadtree(const Coord width, const Coord height, const int maxElements, const int maxDepth)
+	: maxElements(std::max(maxElements, 1)), maxDepth(std::min(std::max(maxDepth, 0), 16)),
+	scaleX(static_cast<double>(1u << this->maxDepth) / width), scaleY(static_cast<double>(1u << this->maxDepth) / height), width(width), height(height)
+{
+}
+
+// The int tree is compiled once, in quadtree.cpp
+extern template class BasicPointQuadtree<int, int>;
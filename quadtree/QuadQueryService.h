@@ -0,0 +1,293 @@
+#pragma once
+#include "pch.h"
+#include "Quadtree.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// Runs queries submitted from any thread in batches on a thread pool, so that the
+/// many small queries of scripts and connections don't each pay for a descent on the
+/// thread that asked. A query is queued and answered later through a future, or a
+/// callback from which a coroutine or task scheduler can resume the caller.
+/// Each batch holds whatever was queued since the last one. It is sorted by the Morton
+/// code of the queries' centers, and the pool runs it in runs of consecutive queries,
+/// so a worker's queries are near each other and find the leaves they read still in
+/// cache. Queries keep being queued while a batch runs, to make up the next one.
+/// Batches run either when the owner calls tick, e.g. once per frame between updates
+/// to the tree, or on a dispatcher thread started with start, for a tree that isn't
+/// being changed.
+/// Tree is a BasicQuadtree instantiation.
+template <class Tree>
+class QuadQueryService
+{
+public:
+	typedef typename Tree::CoordType Coord;
+	typedef typename Tree::Element Element;
+
+	// Called with the results of a query, on a pool worker. The results may be moved
+	// from. Callbacks should be quick, as the rest of the worker's run waits on them
+	typedef std::function<void(std::vector<Element>&)> QueryCallback;
+	typedef std::function<void(std::vector<QuadNeighbor>&)> RadiusCallback;
+
+	/// Creates a service querying 'tree' on 'pool'. Nothing runs until tick or start.
+	QuadQueryService(const Tree& tree, ThreadPool& pool);
+
+	/// Stops the dispatcher thread if it was started, running the queries still queued.
+	/// Without it, queries queued since the last tick are dropped unanswered, so their
+	/// futures report a broken promise.
+	~QuadQueryService();
+
+	QuadQueryService(const QuadQueryService&) = delete;
+	QuadQueryService& operator=(const QuadQueryService&) = delete;
+
+	// Any thread: queues a query for the elements in a rectangle, excluding the
+	// specified element to omit (-1 to omit nothing), as Tree::query.
+	std::future<std::vector<Element>> query(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex);
+	void query(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex, QueryCallback done);
+
+	// Any thread: queues a query for the elements within a radius of a point, nearest
+	// first, as Tree::withinRadius.
+	std::future<std::vector<QuadNeighbor>> queryRadius(const double x, const double y, const double radius, const int omitElementIndex);
+	void queryRadius(const double x, const double y, const double radius, const int omitElementIndex, RadiusCallback done);
+
+	// Owner thread: runs the queries queued so far as one batch and returns how many
+	// ran. The tree must not change until it returns. Not to be called while started.
+	int tick();
+
+	// Starts a dispatcher thread running batches on its own: once a query is queued, it
+	// waits until maxBatch queries are or 'window' has passed, then runs them. A longer
+	// window makes batches larger at the cost of latency. The tree must not change
+	// until stop.
+	void start(const std::chrono::microseconds window, const int maxBatch);
+
+	// Runs the queries still queued and stops the dispatcher thread, if started.
+	void stop();
+
+private:
+	// A queued query: a rectangle query if queryDone is set, otherwise a radius query
+	struct Request
+	{
+		Coord x1, y1, x2, y2;
+		double x, y, radius;
+		int omitElementIndex;
+		QueryCallback queryDone;
+		RadiusCallback radiusDone;
+	};
+
+	void submit(Request& request, const double centerX, const double centerY);
+	void runBatch();
+	void dispatch();
+
+	const Tree& tree;
+	ThreadPool& pool;
+
+	// Queries queued for the next batch and the Morton codes of their centers, guarded
+	// by mutex. The dispatcher waits on pendingCondition for them
+	std::mutex mutex;
+	std::condition_variable pendingCondition;
+	std::vector<Request> pending;
+	std::vector<std::uint32_t> pendingKeys;
+
+	// The batch being run, swapped with the queued queries, and the order to run it in.
+	// Kept with the workers' scratch and results to reuse their capacity
+	std::vector<Request> batch;
+	std::vector<std::uint32_t> batchKeys;
+	std::vector<std::pair<std::uint32_t, int>> order;
+	std::vector<typename Tree::Scratch> workerScratch;
+	std::vector<std::vector<Element>> workerElements;
+	std::vector<std::vector<QuadNeighbor>> workerNeighbors;
+
+	// The dispatcher thread and its settings, which are guarded by mutex
+	std::thread dispatcher;
+	std::chrono::microseconds window;
+	int maxBatch;
+	bool stopping;
+};
+
+template <class Tree>
+QuadQueryService<Tree>::QuadQueryService(const Tree& tree, ThreadPool& pool)
+	: tree(tree), pool(pool), window(0), maxBatch(1), stopping(false)
+{
+}
+
+template <class Tree>
+QuadQueryService<Tree>::~QuadQueryService()
+{
+	stop();
+}
+
+template <class Tree>
+std::future<std::vector<typename QuadQueryService<Tree>::Element>> QuadQueryService<Tree>::query(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex)
+{
+	std::shared_ptr<std::promise<std::vector<Element>>> promise = std::make_shared<std::promise<std::vector<Element>>>();
+	std::future<std::vector<Element>> future = promise->get_future();
+	query(x1, y1, x2, y2, omitElementIndex, [promise](std::vector<Element>& found) {
+		promise->set_value(std::move(found));
+	});
+	return future;
+}
+
+template <class Tree>
+void QuadQueryService<Tree>::query(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex, QueryCallback done)
+{
+	Request request{ x1, y1, x2, y2, 0.0, 0.0, 0.0, omitElementIndex, std::move(done), RadiusCallback() };
+	submit(request, (static_cast<double>(x1) + x2) / 2, (static_cast<double>(y1) + y2) / 2);
+}
+
+template <class Tree>
+std::future<std::vector<QuadNeighbor>> QuadQueryService<Tree>::queryRadius(const double x, const double y, const double radius, const int omitElementIndex)
+{
+	std::shared_ptr<std::promise<std::vector<QuadNeighbor>>> promise = std::make_shared<std::promise<std::vector<QuadNeighbor>>>();
+	std::future<std::vector<QuadNeighbor>> future = promise->get_future();
+	queryRadius(x, y, radius, omitElementIndex, [promise](std::vector<QuadNeighbor>& found) {
+		promise->set_value(std::move(found));
+	});
+	return future;
+}
+
+template <class Tree>
+void QuadQueryService<Tree>::queryRadius(const double x, const double y, const double radius, const int omitElementIndex, RadiusCallback done)
+{
+	Request request{ Coord(), Coord(), Coord(), Coord(), x, y, radius, omitElementIndex, QueryCallback(), std::move(done) };
+	submit(request, x, y);
+}
+
+// Queues a request under the Morton code of its center's cell in a 65536 by 65536 grid
+// over the tree. The dispatcher is woken by the first query of a batch, and again once
+// the batch is full
+template <class Tree>
+void QuadQueryService<Tree>::submit(Request& request, const double centerX, const double centerY)
+{
+	const double left = static_cast<double>(tree.rootMx) - tree.rootHx, top = static_cast<double>(tree.rootMy) - tree.rootHy;
+	const double cellsX = 65536.0 / (2.0 * tree.rootHx), cellsY = 65536.0 / (2.0 * tree.rootHy);
+	const double cellX = std::min(std::max((centerX - left) * cellsX, 0.0), 65535.0);
+	const double cellY = std::min(std::max((centerY - top) * cellsY, 0.0), 65535.0);
+	const std::uint32_t key = quadSpreadBits(static_cast<std::uint32_t>(cellX)) | (quadSpreadBits(static_cast<std::uint32_t>(cellY)) << 1);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	pending.push_back(std::move(request));
+	pendingKeys.push_back(key);
+	if (pending.size() == 1 || pending.size() == maxBatch) {
+		pendingCondition.notify_one();
+	}
+}
+
+template <class Tree>
+int QuadQueryService<Tree>::tick()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		batch.swap(pending);
+		batchKeys.swap(pendingKeys);
+	}
+	const int count = static_cast<int>(batch.size());
+	runBatch();
+	return count;
+}
+
+// Runs the batch in Morton order, handing each worker runs of consecutive queries
+template <class Tree>
+void QuadQueryService<Tree>::runBatch()
+{
+	// Number of queries handed to a worker at once
+	const int chunkSize = 32;
+	const int numRequests = static_cast<int>(batch.size());
+	const int numChunks = (numRequests + chunkSize - 1) / chunkSize;
+
+	order.clear();
+	for (int i = 0; i < numRequests; i++) {
+		order.push_back(std::make_pair(batchKeys[i], i));
+	}
+	std::sort(order.begin(), order.end());
+
+	if (workerScratch.size() < pool.size()) {
+		workerScratch.resize(pool.size());
+		workerElements.resize(pool.size());
+		workerNeighbors.resize(pool.size());
+	}
+	pool.run(numChunks, [&](const int chunk, const int worker) {
+		typename Tree::Scratch & scratch = workerScratch[worker];
+		const int end = std::min(numRequests, (chunk + 1) * chunkSize);
+		for (int i = chunk * chunkSize; i < end; i++) {
+			Request & request = batch[order[i].second];
+			if (request.queryDone) {
+				std::vector<Element> & found = workerElements[worker];
+				found.clear();
+				tree.queryVisit(scratch, request.x1, request.y1, request.x2, request.y2, request.omitElementIndex, [&found](const int, const Element& e) {
+					found.push_back(e);
+				});
+				request.queryDone(found);
+			}
+			else {
+				std::vector<QuadNeighbor> & found = workerNeighbors[worker];
+				tree.search(scratch, found, request.x, request.y, std::numeric_limits<int>::max(), request.radius, request.omitElementIndex);
+				request.radiusDone(found);
+			}
+		}
+	});
+	batch.clear();
+	batchKeys.clear();
+}
+
+template <class Tree>
+void QuadQueryService<Tree>::start(const std::chrono::microseconds window, const int maxBatch)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->window = window;
+		this->maxBatch = std::max(maxBatch, 1);
+		stopping = false;
+	}
+	dispatcher = std::thread(&QuadQueryService::dispatch, this);
+}
+
+// Does nothing if the dispatcher isn't running
+template <class Tree>
+void QuadQueryService<Tree>::stop()
+{
+	if (!dispatcher.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	pendingCondition.notify_one();
+	dispatcher.join();
+}
+
+// The dispatcher thread: waits for a query, gives the batch until 'window' later to
+// fill up, then runs it without holding the lock so that queries keep being queued
+template <class Tree>
+void QuadQueryService<Tree>::dispatch()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		pendingCondition.wait(lock, [this]() {
+			return stopping || pending.size() > 0;
+		});
+		if (!stopping) {
+			pendingCondition.wait_for(lock, window, [this]() {
+				return stopping || pending.size() >= maxBatch;
+			});
+		}
+		if (pending.size() == 0) {
+			break;
+		}
+		batch.swap(pending);
+		batchKeys.swap(pendingKeys);
+		lock.unlock();
+		runBatch();
+		lock.lock();
+	}
+}
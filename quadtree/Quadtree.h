@@ -0,0 +1,3857 @@
+#pragma once
+#include "pch.h"
+#include "FreeList.h"
+#include "ThreadPool.h"
+#include "IntersectKernel.h"
+#include <vector>
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <utility>
+#include <istream>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <iterator>
+
+// Instrumentation. Define QUADTREE_STATS to count the work done by each operation in
+// QuadCounters; without it the counters stay zero and the counting compiles away
+#ifdef QUADTREE_STATS
+#define QUADTREE_COUNT(counter, n) ((counter) += (n))
+#else
+#define QUADTREE_COUNT(counter, n) ((void)0)
+#endif
+
+// Represents a node in the quadtree.
+struct QuadNode
+{
+	// Points to the first child if this node is a branch or the first
+	// element node if this node is a leaf.
+	int firstChildIndex;
+
+	// Stores the number of elements in the leaf or -1 if it this node is
+	// not a leaf
+	int count;
+
+	QuadNode(int firstChildIndex, int count) : firstChildIndex(firstChildIndex), count(count) {
+	}
+};
+
+// Represents an element node in the quadtree.
+struct QuadElementNode
+{
+	// Points to the next element node in the leaf node. A value of -1
+	// indicates the end of the list.
+	int nextIndex;
+
+	// Stores the element index.
+	int elementIndex;
+
+	QuadElementNode(int nextIndex, int elementIndex)
+		: nextIndex(nextIndex), elementIndex(elementIndex) {
+	}
+};
+
+// Where an element node sits, kept beside each element node by a tree that keeps
+// back-references. It is stored apart from QuadElementNode so that queries, which only
+// follow nextIndex, read no more memory than without it.
+struct QuadElementNodeLink
+{
+	// The leaf whose list holds the element node.
+	int nodeIndex;
+
+	// Points to the previous element node in the leaf's list, making the list doubly
+	// linked. A value of -1 indicates the head of the list.
+	int prevIndex;
+
+	// Points to the next element node of the same element. A value of -1 indicates
+	// the end of the element's chain.
+	int nextDuplicateIndex;
+
+	QuadElementNodeLink(int nodeIndex, int prevIndex, int nextDuplicateIndex)
+		: nodeIndex(nodeIndex), prevIndex(prevIndex), nextDuplicateIndex(nextDuplicateIndex) {
+	}
+};
+
+// Represents an element in the quadtree.
+template <class Coord, class Payload>
+struct BasicQuadElement
+{
+	// Stores the ID for the element (can be used to
+	// refer to external data).
+	Payload id;
+
+	// Stores the rectangle, AABB for the element.
+	// x1, y1 = top left point
+	// x2, y2 = bottom right point
+	Coord x1, y1, x2, y2;
+
+	BasicQuadElement(const Payload& id, Coord x1, Coord y1, Coord x2, Coord y2)
+		: id(id), x1(x1), y1(y1), x2(x2), y2(y2) {
+	}
+};
+
+typedef BasicQuadElement<int, int> QuadElement;
+
+// Contains the AABB, depth and the index of the Node in the nodes FreeList. The AABB is calculated at runtime
+template <class Coord>
+struct BasicQuadNodeData
+{
+	// The index of the node in the nodes FreeList this QuadNodeData object refers to
+	int nodeIndex;
+
+	// The depth of the node
+	int depth;
+
+	// Mid point
+	Coord mx;
+	Coord my;
+	// Half-lengthsQuadElt
+	Coord hx;
+	Coord hy;
+
+	BasicQuadNodeData(int nodeIndex, int depth, Coord mx, Coord my, Coord hx, Coord hy)
+		: nodeIndex(nodeIndex), depth(depth), mx(mx), my(my), hx(hx), hy(hy) {
+	}
+
+};
+
+typedef BasicQuadNodeData<int> QuadNodeData;
+
+// A leaf together with the region it owns under the descent rule of findLeaves (a point
+// on a midpoint goes to the left/top child): x in (left, right], y in (top, bottom].
+// The regions of all leaves tile the plane, so every point is owned by exactly one leaf
+template <class Coord>
+struct BasicQuadLeafRegion
+{
+	int nodeIndex;
+	Coord left, top, right, bottom;
+
+	BasicQuadLeafRegion(int nodeIndex, Coord left, Coord top, Coord right, Coord bottom)
+		: nodeIndex(nodeIndex), left(left), top(top), right(right), bottom(bottom) {
+	}
+};
+
+typedef BasicQuadLeafRegion<int> QuadLeafRegion;
+
+// An entry in the priority queue of nearest and withinRadius: either a node, with the
+// region it owns, or an element found in a leaf, ordered by squared distance to the point.
+// Segment queries order it by where the segment enters the node or element instead
+template <class Coord>
+struct BasicQuadSearchEntry
+{
+	double distance;
+
+	// The element, or -1 if this entry is a node
+	int elementIndex;
+
+	BasicQuadNodeData<Coord> node;
+	BasicQuadLeafRegion<Coord> region;
+
+	BasicQuadSearchEntry(double distance, int elementIndex, const BasicQuadNodeData<Coord>& node, const BasicQuadLeafRegion<Coord>& region)
+		: distance(distance), elementIndex(elementIndex), node(node), region(region) {
+	}
+
+	// Orders the heap so that the closest entry is on top
+	bool operator<(const BasicQuadSearchEntry& other) const {
+		return distance > other.distance;
+	}
+};
+
+typedef BasicQuadSearchEntry<int> QuadSearchEntry;
+
+// An element found by nearest or withinRadius and its distance from the point, or found
+// by a segment query and its distance along the segment from its start
+struct QuadNeighbor
+{
+	int elementIndex;
+	double distance;
+
+	QuadNeighbor(int elementIndex, double distance) : elementIndex(elementIndex), distance(distance) {
+	}
+};
+
+// A convex polygon for polygon queries, such as a camera's view frustum. The vertices go
+// in order around the polygon, either way round. Its edge normals are the separating axes
+// tested besides x and y, and are set up here once so that a query only projects onto them
+struct QuadPolygon
+{
+	std::vector<double> x, y;
+
+	// The edge normals and the polygon's extent along each
+	std::vector<double> axisX, axisY, axisMin, axisMax;
+
+	// Bounding box
+	double left, top, right, bottom;
+
+	QuadPolygon(const std::vector<double>& x, const std::vector<double>& y);
+
+	// The area seen from (x, y) looking along (dirX, dirY) with a field of view of twice
+	// halfAngle radians, between nearDistance and farDistance: a trapezoid, or a triangle
+	// when nearDistance is 0
+	static QuadPolygon frustum(const double x, const double y, const double dirX, const double dirY, const double halfAngle, const double nearDistance, const double farDistance);
+
+	// Returns true if the polygon and the AABB overlap, touching included
+	bool intersects(const double x1, const double y1, const double x2, const double y2) const;
+};
+// Work done by a tree's operations, counted when QUADTREE_STATS is defined
+struct QuadCounters
+{
+	// Queries run through queryVisit (and so query and queryBatch), nearest, withinRadius,
+	// segment and polygon queries
+	long long queries;
+
+	// Nodes taken off the traversal stack by findLeaves or the nearest search, for any operation
+	long long nodesVisited;
+
+	// Leaves whose elements a query or findAllIntersectingPairs went through
+	long long leavesScanned;
+
+	// Elements tested against a query rectangle or point, or pairs of elements tested by
+	// findAllIntersectingPairs, and the elements the queries returned
+	long long elementsTested;
+	long long elementsReturned;
+
+	// Leaves split by leafInsert and branches collapsed by cleanup
+	long long splits;
+	long long collapses;
+
+	QuadCounters()
+		: queries(0), nodesVisited(0), leavesScanned(0), elementsTested(0), elementsReturned(0), splits(0), collapses(0) {
+	}
+
+	QuadCounters& operator+=(const QuadCounters& other) {
+		queries += other.queries;
+		nodesVisited += other.nodesVisited;
+		leavesScanned += other.leavesScanned;
+		elementsTested += other.elementsTested;
+		elementsReturned += other.elementsReturned;
+		splits += other.splits;
+		collapses += other.collapses;
+		return *this;
+	}
+};
+
+// What a split policy decides on: a leaf that could be split, or a branch whose children
+// are all leaves that could be merged back into one
+struct QuadLeafInfo
+{
+	// Depth of the node, and the size of its cell. -1 and 0 for merges asked by
+	// cleanup, which scans nodes by index without their geometry
+	int depth;
+	double cellWidth, cellHeight;
+
+	// Distinct elements in the leaf, or under the branch
+	int count;
+
+	// Elements each child holds, or would hold after a split. Elements overlapping
+	// several children are counted in each, so the sum over count is the duplication
+	int childCounts[4];
+
+	// Mean size of the elements, to compare with the cell's
+	double elementWidth, elementHeight;
+
+	// Queries that scanned the leaf, or the branch and its children, decayed by each
+	// rebalance. 0 unless the tree tracks query heat
+	double queryHits;
+
+	QuadLeafInfo()
+		: depth(0), cellWidth(0), cellHeight(0), count(0), childCounts{ 0, 0, 0, 0 }, elementWidth(0), elementHeight(0), queryHits(0) {
+	}
+
+	// Element nodes per element after a split: 1 for points, up to 4 for elements as big
+	// as the cell
+	double duplication() const {
+		return count > 0 ? static_cast<double>(childCounts[0] + childCounts[1] + childCounts[2] + childCounts[3]) / count : 1.0;
+	}
+};
+
+// Decides where the tree splits and merges, in place of the fixed leaf capacity. Asked by
+// insert each time a leaf reaches the capacity times a power of 2, so the capacity is the
+// smallest leaf insert splits and a leaf the policy keeps costs amortized O(1) per insert.
+// Also asked by cleanup for every branch it could collapse, and by rebalance for every
+// leaf and branch, and by build for every node above the capacity, concurrently from the
+// pool's workers in the parallel build. The depth limit applies regardless
+class IQuadSplitPolicy
+{
+public:
+	virtual ~IQuadSplitPolicy() {
+	}
+
+	// Returns true to split the leaf
+	virtual bool split(const QuadLeafInfo& leaf) const = 0;
+
+	// Returns true to merge the branch's children into one leaf
+	virtual bool merge(const QuadLeafInfo& branch) const = 0;
+};
+
+// Splits where doing so saves queries work, by a cost model in element tests per query.
+// A query scanning the leaf tests its count elements. Split, a query at a random point of
+// the cell tests one child's elements, a quarter of the sum of the child counts, plus
+// nodeCost for visiting the extra level. The gain is the difference, weighed by how hot
+// the leaf is (1 + queryHits). A leaf splits when the weighted gain reaches splitGain,
+// and a branch merges when it drops below half of it, so that nodes don't thrash. Leaves
+// of elements as big as the cell never gain, as every child would hold them all, and hot
+// leaves split at lower counts than cold ones
+class QuadCostSplitPolicy : public IQuadSplitPolicy
+{
+public:
+	explicit QuadCostSplitPolicy(double nodeCost = 2.0, double splitGain = 4.0);
+
+	bool split(const QuadLeafInfo& leaf) const;
+	bool merge(const QuadLeafInfo& branch) const;
+
+	// Element tests per query saved by splitting, weighed by heat
+	double gain(const QuadLeafInfo& info) const;
+
+private:
+	double nodeCost;
+	double splitGain;
+};
+
+// A snapshot of the shape of a tree, built by Quadtree::stats
+struct QuadStats
+{
+	int branches;
+	int leaves;
+	int emptyLeaves;
+
+	// The depth of the deepest leaf
+	int depth;
+
+	// Live elements, and the element nodes referencing them. Elements overlapping several
+	// leaves have an element node in each, so duplication is elementNodes / elements
+	int elements;
+	int elementNodes;
+	double duplication;
+
+	// Free slots waiting for reuse in each FreeList. Nodes are freed 4 at a time, so
+	// freeNodeBlocks counts blocks of 4 on the tree's free chain
+	int freeElements;
+	int freeElementNodes;
+	int freeNodeBlocks;
+
+	// Number of leaves at each depth, and number of leaves holding each element count
+	std::vector<int> leavesByDepth;
+	std::vector<int> leavesByCount;
+
+	QuadStats()
+		: branches(0), leaves(0), emptyLeaves(0), depth(0), elements(0), elementNodes(0), duplication(0),
+		freeElements(0), freeElementNodes(0), freeNodeBlocks(0) {
+	}
+};
+
+std::ostream& operator<<(std::ostream& out, const QuadStats& stats);
+
+// Per-thread scratch state for queries. Queries only read the tree, so several threads can
+// query it at once as long as each one passes its own scratch
+template <class Coord, class Payload>
+struct BasicQuadQueryScratch
+{
+	// Temp buffer for queries - used to check if element is already found (avoid returning repeated elements)
+	std::vector<bool> tempBuffer;
+
+	// Elements marked in tempBuffer by the current query, unmarked again once the query is done
+	std::vector<int> clearList;
+
+	// Traversal stack used by findLeaves
+	std::vector<BasicQuadNodeData<Coord>> nodeStack;
+
+	// Leaves found by the current query
+	std::vector<BasicQuadNodeData<Coord>> leaves;
+
+	// The element indices and AABBs of the leaf being tested by findAllIntersectingPairs,
+	// copied out of the leaf's linked list so the pair loop runs over contiguous memory
+	std::vector<int> leafElementIndices;
+	std::vector<BasicQuadElement<Coord, Payload>> leafElementBounds;
+
+	// Positions within a packed leaf of the elements the intersect kernel found
+	std::vector<int> hits;
+
+	// Priority queue of nearest, withinRadius and segment queries, and a max-heap of the
+	// distances of the k closest elements queued so far. Polygon queries use the queue as
+	// a plain traversal stack
+	std::vector<BasicQuadSearchEntry<Coord>> searchHeap;
+	std::vector<double> searchBest;
+
+	// Work done by the operations run with this scratch
+	QuadCounters counters;
+
+	// Queries through queryVisit that scanned each leaf, by node index, recorded while
+	// trackLeafHits is set. The tree's split policy reads them, see trackQueryHeat
+	std::vector<std::uint32_t> leafHits;
+	bool trackLeafHits;
+
+	BasicQuadQueryScratch() : trackLeafHits(false) {
+	}
+};
+
+typedef BasicQuadQueryScratch<int, int> QuadQueryScratch;
+
+// Structure-of-arrays copy of the elements of every leaf, built by Quadtree::pack so
+// that a query can test a whole leaf with one SIMD kernel call. The elements of leaf n
+// are in slots leafStart[n] up to leafStart[n] + nodes[n].count
+template <class Coord>
+struct BasicQuadPackedLeaves
+{
+	std::vector<int> leafStart;
+	std::vector<Coord> x1, y1, x2, y2;
+	std::vector<int> elementIndex;
+
+	// The most elements held by one leaf
+	int maxLeafCount;
+
+	BasicQuadPackedLeaves() : maxLeafCount(0) {
+	}
+};
+
+typedef BasicQuadPackedLeaves<int> QuadPackedLeaves;
+
+// A rectangle query for queryBatch
+template <class Coord>
+struct BasicQuadQuery
+{
+	// x1, y1 = top left point
+	// x2, y2 = bottom right point
+	Coord x1, y1, x2, y2;
+
+	// The element to leave out of the results, -1 to omit nothing
+	int omitElementIndex;
+
+	BasicQuadQuery(Coord x1, Coord y1, Coord x2, Coord y2, int omitElementIndex)
+		: x1(x1), y1(y1), x2(x2), y2(y2), omitElementIndex(omitElementIndex) {
+	}
+};
+
+typedef BasicQuadQuery<int> QuadQuery;
+
+// Holds the results of queryBatch. The elements found by query i are
+// elements[offsets[i]] up to (but not including) elements[offsets[i + 1]]
+template <class Coord, class Payload>
+struct BasicQuadQueryBatchResult
+{
+	std::vector<int> offsets;
+	std::vector<BasicQuadElement<Coord, Payload>> elements;
+};
+
+typedef BasicQuadQueryBatchResult<int, int> QuadQueryBatchResult;
+
+// Holds the results of queryChangedSince: what changed in a rectangle since an epoch
+template <class Coord, class Payload>
+struct BasicQuadChanges
+{
+	// The elements in the rectangle inserted since the epoch
+	std::vector<int> added;
+
+	// The elements moved by update since the epoch that are in the rectangle now or were
+	// at the epoch, so elements entering and leaving the rectangle are both reported
+	std::vector<int> moved;
+
+	// The elements removed since the epoch that were in the rectangle at the epoch, as
+	// they were then. Their indices may already be reused
+	std::vector<std::pair<int, BasicQuadElement<Coord, Payload>>> removed;
+};
+
+typedef BasicQuadChanges<int, int> QuadChanges;
+
+// Header of a tree snapshot written by save. The slot arrays of the elements, element
+// nodes and nodes FreeLists follow it byte for byte, each starting on a multiple of
+// QuadSnapshotHeader::alignment from the start of the snapshot, so that a snapshot
+// mapped at a page boundary can be queried in place. A snapshot only loads into a tree
+// of the same type and extents, on a machine with the same byte order
+struct QuadSnapshotHeader
+{
+	static const std::size_t alignment = 64;
+
+	// "QUADTREE", the format version, and 1 as a native int to catch another byte order
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byteOrder;
+
+	// The size of the coordinate type, the payload and each list's slots, and whether the
+	// coordinates are floating point
+	std::uint32_t coordSize;
+	std::uint32_t payloadSize;
+	std::uint32_t floatingPoint;
+	std::uint32_t elementSlotSize;
+	std::uint32_t elementNodeSlotSize;
+	std::uint32_t nodeSlotSize;
+
+	std::int32_t maxElements;
+	std::int32_t maxDepth;
+	std::int32_t freeNodeIndex;
+
+	// The number of slots in each list and the first of its free slots
+	std::int32_t elementCount, elementFirstFree;
+	std::int32_t elementNodeCount, elementNodeFirstFree;
+	std::int32_t nodeCount, nodeFirstFree;
+
+	// The tree's extents
+	double rootMx, rootMy, rootHx, rootHy;
+
+	// quadChecksum of this header with both checksums 0, checked before the list sizes
+	// above are trusted to allocate or read anything
+	std::uint64_t headerChecksum;
+
+	// quadChecksum of the three slot arrays in order, continuing from headerChecksum
+	std::uint64_t checksum;
+};
+
+// FNV-1a over 64-bit words, then over any bytes left. Checks snapshots for damage, not
+// tampering. Chain buffers by passing the previous result as 'hash', starting from
+// quadChecksumSeed
+const std::uint64_t quadChecksumSeed = 14695981039346656037ULL;
+std::uint64_t quadChecksum(std::uint64_t hash, const void* data, std::size_t size);
+
+// The checksum of a snapshot header, leaving out its checksum fields
+inline std::uint64_t quadSnapshotHeaderChecksum(QuadSnapshotHeader header)
+{
+	header.headerChecksum = 0;
+	header.checksum = 0;
+	return quadChecksum(quadChecksumSeed, &header, sizeof(header));
+}
+
+// Rounds a snapshot offset up to the next section boundary
+inline std::size_t quadSnapshotAlign(const std::size_t offset)
+{
+	return (offset + QuadSnapshotHeader::alignment - 1) / QuadSnapshotHeader::alignment * QuadSnapshotHeader::alignment;
+}
+
+// The bytes allocated for each of a tree's FreeLists
+struct QuadMemoryUsage
+{
+	std::size_t elements;
+	std::size_t elementNodes;
+	std::size_t nodes;
+
+	QuadMemoryUsage(std::size_t elements, std::size_t elementNodes, std::size_t nodes)
+		: elements(elements), elementNodes(elementNodes), nodes(nodes) {
+	}
+};
+
+// Halves a node's half-size for its children: a shift for integer coordinates, which
+// are never negative here, and a division otherwise
+template <class Coord>
+inline typename std::enable_if<std::is_integral<Coord>::value, Coord>::type quadHalf(const Coord size)
+{
+	return static_cast<Coord>(size >> 1);
+}
+
+template <class Coord>
+inline typename std::enable_if<!std::is_integral<Coord>::value, Coord>::type quadHalf(const Coord size)
+{
+	return size / 2;
+}
+
+// Spreads the low 16 bits of v out to the even bits. Interleaving the spread bits of a
+// cell's x and y, x in the even bits, gives its Morton code
+inline std::uint32_t quadSpreadBits(std::uint32_t v)
+{
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+// The kernel pack and queryVisit use to test a packed leaf. The SIMD kernels are written
+// for int coordinates; other coordinate types get the scalar loop of intersectGeneric
+template <class Coord>
+struct QuadIntersectKernel
+{
+	typedef int (*Type)(const Coord* x1, const Coord* y1, const Coord* x2, const Coord* y2, int count,
+		Coord qx1, Coord qy1, Coord qx2, Coord qy2, int* out);
+
+	static Type get() {
+		return &intersectGeneric<Coord>;
+	}
+};
+
+template <>
+struct QuadIntersectKernel<int>
+{
+	typedef IntersectKernel Type;
+
+	static Type get() {
+		return intersectKernel();
+	}
+};
+
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator = std::allocator<char>>
+class BasicQuadtree;
+
+// The quadtree with int coordinates and ids, and its limits set at runtime
+typedef BasicQuadtree<int, int, 0, 0> Quadtree;
+
+template <class Tree, class Coord>
+class IBasicQuadtreeVisitor
+{
+	// Called when traversing a branch node.
+	// (mx, my) indicate the center of the node's AABB.
+	// (hx, hy) indicate the half-size of the node's AABB.
+public:
+	virtual void branch(const Tree& quadtree, const int node, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy) const = 0;
+
+	// Called when traversing a leaf node.
+	// (mx, my) indicate the center of the node's AABB.
+	// (hx, hy) indicate the half-size of the node's AABB.
+	virtual void leaf(const Tree& quadtree, const int node, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy) const = 0;
+};
+
+typedef IBasicQuadtreeVisitor<Quadtree, int> IQuadtreeVisitor;
+
+template <class Tree, class Coord>
+class QuadStatsVisitor;
+
+template <class Tree, class Coord>
+class BasicQuadQueryCursor;
+
+// A quadtree of AABBs in which each element is stored in every leaf it overlaps.
+//   Coord: the coordinate type, e.g. short, int, float or double. A 16-bit type halves
+//     the size of the AABBs for worlds that fit in it
+//   Payload: the id stored with each element
+//   MaxElements, MaxDepth: when above 0 they fix the leaf capacity and depth limit at
+//     compile time, and the constructor's maxElements and maxDepth are ignored
+//   Allocator: allocates the FreeLists, e.g. HugePageAllocator for big trees
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+class BasicQuadtree
+{
+	template <class Tree, class VisitorCoord>
+	friend class QuadStatsVisitor;
+	friend class BasicQuadQueryCursor<BasicQuadtree, Coord>;
+
+public:
+	typedef Coord CoordType;
+	typedef Payload PayloadType;
+	typedef BasicQuadElement<Coord, Payload> Element;
+	typedef BasicQuadNodeData<Coord> NodeData;
+	typedef BasicQuadLeafRegion<Coord> LeafRegion;
+	typedef BasicQuadSearchEntry<Coord> SearchEntry;
+	typedef BasicQuadQueryScratch<Coord, Payload> Scratch;
+	typedef BasicQuadPackedLeaves<Coord> PackedLeaves;
+	typedef BasicQuadQuery<Coord> Query;
+	typedef BasicQuadQueryBatchResult<Coord, Payload> QueryBatchResult;
+	typedef IBasicQuadtreeVisitor<BasicQuadtree, Coord> TreeVisitor;
+	typedef BasicQuadQueryCursor<BasicQuadtree, Coord> QueryCursor;
+	typedef BasicQuadChanges<Coord, Payload> Changes;
+
+private:
+	// The maximum depth allowed for the quadtree.
+	int maxDepth;
+	// The maximum numbeer of elements allowed in a leaf before subdividing
+	int maxElements;
+
+	// Stores all the elements in the quadtree.
+	FreeList<Element, Allocator> elements;
+
+	// Stores all the element nodes in the quadtree.
+	FreeList<QuadElementNode, Allocator> elementNodes;
+
+	// Stores all the nodes in the quadtree. The first node in this
+	// sequence is always the root.
+	FreeList<QuadNode, Allocator> nodes;
+
+	// Stores the first free node in the quadtree to be reclaimed as 4
+	// contiguous nodes at once. A value of -1 indicates that the free
+	// list is empty, at which point we simply insert 4 nodes to the
+	// back of the nodes array.
+	int freeNodeIndex;
+
+	// The node the next incremental cleanup slice starts scanning from
+	int cleanupCursor;
+
+	// The packed leaf layout and the kernel used to scan it. Queries use it while
+	// packedValid is set, which any change to the tree clears
+	PackedLeaves packed;
+	typename QuadIntersectKernel<Coord>::Type packedKernel;
+	bool packedValid;
+
+	// Scratch buffers for queries and removals on the calling thread, kept between calls so
+	// that a query does no heap allocation once they have grown
+	Scratch scratch;
+
+	// Scratch for each worker of the pool passed to queryBatch, and the per-chunk result
+	// buffers the workers fill before they are gathered into the batch result
+	std::vector<Scratch> workerScratch;
+	std::vector<std::vector<Element>> batchChunks;
+
+	// All the leaves of the tree, and per-chunk pair buffers, for findAllIntersectingPairs
+	std::vector<LeafRegion> pairLeaves;
+	std::vector<std::vector<std::pair<int, int>>> pairChunks;
+
+	// The leaves an element is moved into by update
+	std::vector<NodeData> updateLeaves;
+
+	// Decides splits and merges in place of the leaf capacity, or nullptr. Not owned
+	const IQuadSplitPolicy* splitPolicy;
+
+	// Set while queries record leaf heat for the split policy
+	bool trackHeat;
+
+	// Back-references, kept while keepBackReferences is on: the first element node of
+	// each element, and where each element node sits. They let remove and update reach an
+	// element's element nodes without a descent or a walk of the leaves' lists
+	std::vector<int> firstElementNodes;
+	std::vector<QuadElementNodeLink> elementNodeLinks;
+	bool backReferences;
+
+	// When an element was inserted and when it last changed, 0 for free slots
+	struct ElementEpochs
+	{
+		std::uint64_t inserted, changed;
+
+		ElementEpochs(std::uint64_t inserted, std::uint64_t changed) : inserted(inserted), changed(changed) {
+		}
+	};
+
+	// A removal or move in the change log, with the element as it was before it
+	struct ChangeRecord
+	{
+		std::uint64_t epoch, inserted;
+		int elementIndex;
+		bool removed;
+		Element element;
+
+		ChangeRecord(std::uint64_t epoch, std::uint64_t inserted, int elementIndex, bool removed, const Element& element)
+			: epoch(epoch), inserted(inserted), elementIndex(elementIndex), removed(removed), element(element) {
+		}
+	};
+
+	// Change tracking, kept while trackChanges is on. Every insert, remove and update
+	// advances changeEpoch and stamps the element with it, and the leaves it is in along
+	// with every node above them, so a node's epoch is the latest change in its subtree.
+	// Removals and moves are also logged in epoch order with the AABB they left.
+	// Changes after historyStart can be queried. blockParents holds the parent of each
+	// block of 4 children, for walking up from a leaf
+	bool changeTracking;
+	std::uint64_t changeEpoch;
+	std::uint64_t historyStart;
+	std::vector<std::uint64_t> nodeEpochs;
+	std::vector<int> blockParents;
+	std::vector<ElementEpochs> elementEpochs;
+	std::vector<ChangeRecord> changeLog;
+
+	// The leaf capacity and depth limit in force. Constants when given as template arguments
+	int leafCapacity() const { return MaxElements > 0 ? MaxElements : maxElements; }
+	int depthLimit() const { return MaxDepth > 0 ? MaxDepth : maxDepth; }
+
+	void nodeInsert(const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy, const int elementIndex);
+	void leafInsert(const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy, const int elt);
+	void leafRemove(const int nodeIndex, const int elementIndex);
+	void linkElementNode(const int nodeIndex, const int elementNodeIndex);
+	void unlinkDuplicate(const int elementNodeIndex);
+	void removeElementNode(const int elementNodeIndex, const int prevDuplicateIndex);
+	void rebuildBackReferences();
+	void markChanged(int nodeIndex);
+	void logChange(const int elementIndex, const bool removed);
+	void rebuildBlockParents();
+	void resetChanges();
+	void splitLeaf(const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy);
+	bool policySplit(const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy) const;
+	static void addToLeafInfo(QuadLeafInfo& info, const Coord mx, const Coord my, const Coord x1, const Coord y1, const Coord x2, const Coord y2);
+	double heat(const int nodeIndex) const;
+	void clearHeat();
+	bool collapse(const int nodeIndex);
+	int allocateChildren();
+	void freeChildren(const int firstChildIndex);
+	static bool containsLeaf(const std::vector<NodeData>& leaves, const int nodeIndex);
+	// An element being handed down by build, with its AABB copied along so that splitting
+	// a node reads its range of elements sequentially
+	struct BuildElement
+	{
+		int elementIndex;
+		Coord x1, y1, x2, y2;
+	};
+
+	// A node still to be built and the range of build's work array holding its elements
+	struct BuildNode
+	{
+		NodeData data;
+		int begin, end;
+	};
+
+	// A subtree built by a worker of the parallel build, with node and element node
+	// indices local to it until it is stitched into the tree. Nodes are allocated in
+	// blocks of 4 from 0, so they stay aligned once moved to a multiple of 4
+	struct BuildTask
+	{
+		BuildNode root;
+		QuadNode rootNode;
+		std::vector<QuadNode> nodes;
+		std::vector<QuadElementNode> elementNodes;
+		int nodeOffset, elementNodeOffset;
+
+		BuildTask(const BuildNode& root) : root(root), rootNode(-1, 0), nodeOffset(0), elementNodeOffset(0) {
+		}
+	};
+
+	bool isBuildLeaf(const std::vector<BuildElement>& work, const BuildNode& pending) const;
+	static void splitBuildNode(std::vector<BuildElement>& work, int& workEnd, const BuildNode& pending, const int firstChildIndex, std::vector<BuildNode>& toProcess);
+	void buildSubtree(BuildTask& task, std::vector<BuildElement>& work, std::vector<BuildNode>& toProcess) const;
+	void pushChildren(std::vector<NodeData>& stack, const NodeData& nodeData, const Coord x1, const Coord y1, const Coord x2, const Coord y2) const;
+	void findLeaves(std::vector<NodeData>& leaves, Scratch& scratch, const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy, const Coord left, const Coord right, const Coord top, const Coord bottom) const;
+	void traverse(const TreeVisitor& visitor) const;
+	void findAllLeaves(std::vector<LeafRegion>& leaves) const;
+	void leafPairs(Scratch& scratch, const LeafRegion& leaf, std::vector<std::pair<int, int>>& pairs) const;
+	static bool intersect(const Coord l1, const Coord r1, const Coord t1, const Coord b1, const Coord l2, const Coord r2, const Coord t2, const Coord b2);
+	static double distanceSquared(const double x, const double y, const double left, const double top, const double right, const double bottom);
+	static bool segmentEntry(const double ax, const double ay, const double dx, const double dy, const double left, const double top, const double right, const double bottom, double& t);
+	QuadSnapshotHeader snapshotHeader() const;
+	bool matchesSnapshot(const QuadSnapshotHeader& header) const;
+
+public:
+	int insert(const Payload& id, const Coord x1, const Coord y1, const Coord x2, const Coord y2);
+	void remove(const int elementIndex);
+	void update(const int elementIndex, const Coord x1, const Coord y1, const Coord x2, const Coord y2);
+	std::vector<Element> query(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex);
+	std::vector<Element> query(const Coord x1, const Coord y1, const Coord x2, const Coord y2);
+	void query(std::vector<Element>& out, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex);
+	void query(std::vector<Element>& out, const Coord x1, const Coord y1, const Coord x2, const Coord y2);
+	template <class Visitor>
+	void queryVisit(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex, Visitor&& visit);
+	template <class Visitor>
+	void queryVisit(Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex, Visitor&& visit) const;
+	QueryCursor queryCursor(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex);
+	QueryCursor queryCursor(Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex) const;
+	bool any(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex);
+	bool any(Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex) const;
+	int count(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex);
+	int count(Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex) const;
+	const Element& element(const int elementIndex) const;
+	void queryBatch(ThreadPool& pool, const std::vector<Query>& queries, QueryBatchResult& result);
+	void nearest(std::vector<QuadNeighbor>& out, const double x, const double y, const int k, const int omitElementIndex);
+	void withinRadius(std::vector<QuadNeighbor>& out, const double x, const double y, const double radius, const int omitElementIndex);
+	void search(Scratch& scratch, std::vector<QuadNeighbor>& out, const double x, const double y, const int k, const double radius, const int omitElementIndex) const;
+	void raycast(std::vector<QuadNeighbor>& out, const double ax, const double ay, const double bx, const double by, const int k, const int omitElementIndex);
+	void segmentQuery(std::vector<QuadNeighbor>& out, const double ax, const double ay, const double bx, const double by, const int omitElementIndex);
+	void segmentSearch(Scratch& scratch, std::vector<QuadNeighbor>& out, const double ax, const double ay, const double bx, const double by, const int k, const int omitElementIndex) const;
+	void polygonQuery(std::vector<Element>& out, const QuadPolygon& polygon, const int omitElementIndex);
+	template <class Visitor>
+	void polygonVisit(Scratch& scratch, const QuadPolygon& polygon, const int omitElementIndex, Visitor&& visit) const;
+	void findAllIntersectingPairs(std::vector<std::pair<int, int>>& pairs);
+	void findAllIntersectingPairs(ThreadPool& pool, std::vector<std::pair<int, int>>& pairs);
+	void cleanup();
+	bool cleanup(const std::chrono::nanoseconds budget);
+	void pack();
+	void relayout();
+	void build(const std::vector<Element>& newElements);
+	void build(ThreadPool& pool, const std::vector<Element>& newElements);
+	bool save(std::ostream& out) const;
+	bool load(std::istream& in);
+	bool map(const void* snapshot, const std::size_t size, const bool verify);
+	void reserve(const int numElements, const int numElementNodes, const int numNodes);
+	void shrinkToFit();
+	void copyFrom(const BasicQuadtree& other);
+	void setSplitPolicy(const IQuadSplitPolicy* policy);
+	void trackQueryHeat(const bool enabled);
+	int rebalance();
+	void keepBackReferences(const bool enabled);
+	void trackChanges(const bool enabled);
+	std::uint64_t epoch() const;
+	bool queryChangedSince(Changes& changes, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const std::uint64_t since);
+	bool queryChangedSince(Scratch& scratch, Changes& changes, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const std::uint64_t since) const;
+	void discardChangesBefore(const std::uint64_t since);
+	QuadMemoryUsage memoryUsage() const;
+	QuadStats stats() const;
+	QuadCounters counters() const;
+	void resetCounters();
+	BasicQuadtree(const Coord width, const Coord height, const int startMaxElements, const int maxDepth, const int tempBufferSize);
+	BasicQuadtree(const Coord width, const Coord height, const int startMaxElements, const int maxDepth, const std::vector<Element>& initialElements);
+
+	// Stores the quadtree extents - boundaries
+	const Coord rootMx, rootMy, rootHx, rootHy;
+};
+
+// Calls visit(elementIndex, element) once for every element found in the specified
+// rectangle, excluding the specified element to omit (-1 to omit nothing).
+// Uses the tree's scratch buffers, so no heap allocation takes place once they have grown
+// to fit. The visitor must not modify or query the tree.
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+template <class Visitor>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::queryVisit(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex, Visitor&& visit)
+{
+	queryVisit(scratch, x1, y1, x2, y2, omitElementIndex, visit);
+}
+
+// Same as above but with caller-supplied scratch. The tree is only read, so threads may
+// run this concurrently with their own scratch as long as nothing modifies the tree
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+template <class Visitor>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::queryVisit(Scratch& scratch, const Coord qx1, const Coord qy1, const Coord qx2, const Coord qy2, const int omitElementIndex, Visitor&& visit) const
+{
+	std::vector<bool> & tempBuffer = scratch.tempBuffer;
+	std::vector<int> & clearList = scratch.clearList;
+
+	std::vector<NodeData> & leaves = scratch.leaves;
+	findLeaves(leaves, scratch, 0, 0, rootMx, rootMy, rootHx, rootHy, qx1, qy1, qx2, qy2);
+	QUADTREE_COUNT(scratch.counters.queries, 1);
+	QUADTREE_COUNT(scratch.counters.leavesScanned, leaves.size());
+	if (scratch.trackLeafHits) {
+		if (scratch.leafHits.size() < nodes.size()) {
+			scratch.leafHits.resize(nodes.size(), 0);
+		}
+		for (int i = 0; i < leaves.size(); i++) {
+			scratch.leafHits[leaves[i].nodeIndex]++;
+		}
+	}
+
+	// tempBuffer is used to track whether an element has already been added (elementNodes)
+	// Increase temporary buffer size to acomodate number of elements
+	// Check speed - may be faster by avoiding resizing multiple times, may be slower by unnecessary check
+	if (tempBuffer.size() < elements.size()) {
+		tempBuffer.assign(elements.size(), false);
+	}
+
+	if (packedValid) {
+		// Test each leaf's packed elements in one kernel call, then filter the hits
+		std::vector<int> & hits = scratch.hits;
+		if (hits.size() < packed.maxLeafCount) {
+			hits.resize(packed.maxLeafCount);
+		}
+
+		for (int i = 0; i < leaves.size(); i++) {
+			const int nodeIndex = leaves[i].nodeIndex;
+			const int count = nodes[nodeIndex].count;
+			if (count == 0) {
+				continue;
+			}
+
+			const int start = packed.leafStart[nodeIndex];
+			const int numHits = packedKernel(&packed.x1[start], &packed.y1[start], &packed.x2[start], &packed.y2[start], count,
+				qx1, qy1, qx2, qy2, hits.data());
+			QUADTREE_COUNT(scratch.counters.elementsTested, count);
+			for (int j = 0; j < numHits; j++) {
+				const int elementIndex = packed.elementIndex[start + hits[j]];
+				if (!tempBuffer[elementIndex] && elementIndex != omitElementIndex) {
+					tempBuffer[elementIndex] = true;
+					clearList.push_back(elementIndex);
+					QUADTREE_COUNT(scratch.counters.elementsReturned, 1);
+					visit(elementIndex, elements[elementIndex]);
+				}
+			}
+		}
+	}
+
+	// For each leaf, look for elements that intersect the AABB
+	for (int i = 0; !packedValid && i < leaves.size(); i++) {
+		const int nodeIndex = leaves[i].nodeIndex;
+
+		// Walk the list and visit elements that intersect
+		int elementNodeIndex = nodes[nodeIndex].firstChildIndex;
+		while (elementNodeIndex != -1) {
+			// elementIndex checks
+			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+			if (!tempBuffer[elementIndex] && elementIndex != omitElementIndex) {
+				const Element & e = elements[elementIndex];
+				QUADTREE_COUNT(scratch.counters.elementsTested, 1);
+				// Element checks
+				if (intersect(qx1, qy1, qx2, qy2, e.x1, e.y1, e.x2, e.y2)) {
+					// Element found - mark it so that it is only visited once
+					tempBuffer[elementIndex] = true;
+					clearList.push_back(elementIndex);
+					QUADTREE_COUNT(scratch.counters.elementsReturned, 1);
+					visit(elementIndex, e);
+				}
+			}
+			elementNodeIndex = elementNodes[elementNodeIndex].nextIndex;
+		}
+	}
+
+	// Clear the element buffer - Unmark visited elements
+	for (int i = 0; i < clearList.size(); i++) {
+		tempBuffer[clearList[i]] = false;
+	}
+	clearList.clear();
+}
+
+// Returns a cursor over the elements found in the specified rectangle, excluding the
+// specified element to omit. The tree is only walked as far as the cursor is advanced,
+// see BasicQuadQueryCursor. Uses the tree's scratch buffers while the cursor lives
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+typename BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::QueryCursor BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::queryCursor(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex)
+{
+	return QueryCursor(*this, scratch, x1, y1, x2, y2, omitElementIndex);
+}
+
+// Same as above but with caller-supplied scratch, which serves one cursor at a time
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+typename BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::QueryCursor BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::queryCursor(Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex) const
+{
+	return QueryCursor(*this, scratch, x1, y1, x2, y2, omitElementIndex);
+}
+
+// Returns true if any element other than the one to omit intersects the specified
+// rectangle. Stops at the first such element, so checking for free space only walks the
+// tree up to the first thing in the way. Any hit will do, so elements aren't marked
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::any(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex)
+{
+	return any(scratch, x1, y1, x2, y2, omitElementIndex);
+}
+
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::any(Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex) const
+{
+	std::vector<NodeData> & stack = scratch.nodeStack;
+	stack.clear();
+	stack.push_back(NodeData(0, 0, rootMx, rootMy, rootHx, rootHy));
+	QUADTREE_COUNT(scratch.counters.queries, 1);
+
+	if (packedValid && scratch.hits.size() < packed.maxLeafCount) {
+		scratch.hits.resize(packed.maxLeafCount);
+	}
+
+	while (stack.size() > 0) {
+		const NodeData nodeData = stack.back();
+		stack.pop_back();
+		QUADTREE_COUNT(scratch.counters.nodesVisited, 1);
+		const QuadNode & node = nodes[nodeData.nodeIndex];
+		if (node.count == -1) {
+			pushChildren(stack, nodeData, x1, y1, x2, y2);
+			continue;
+		}
+
+		QUADTREE_COUNT(scratch.counters.leavesScanned, 1);
+		QUADTREE_COUNT(scratch.counters.elementsTested, node.count);
+		if (packedValid) {
+			if (node.count == 0) {
+				continue;
+			}
+			const int start = packed.leafStart[nodeData.nodeIndex];
+			const int numHits = packedKernel(&packed.x1[start], &packed.y1[start], &packed.x2[start], &packed.y2[start], node.count,
+				x1, y1, x2, y2, scratch.hits.data());
+			for (int j = 0; j < numHits; j++) {
+				if (packed.elementIndex[start + scratch.hits[j]] != omitElementIndex) {
+					QUADTREE_COUNT(scratch.counters.elementsReturned, 1);
+					return true;
+				}
+			}
+			continue;
+		}
+
+		for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+			const Element & e = elements[elementIndex];
+			if (elementIndex != omitElementIndex && intersect(x1, y1, x2, y2, e.x1, e.y1, e.x2, e.y2)) {
+				QUADTREE_COUNT(scratch.counters.elementsReturned, 1);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Returns the number of elements found in the specified rectangle, excluding the
+// specified element to omit, without copying any of them
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+int BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::count(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex)
+{
+	return count(scratch, x1, y1, x2, y2, omitElementIndex);
+}
+
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+int BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::count(Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex) const
+{
+	int found = 0;
+	queryVisit(scratch, x1, y1, x2, y2, omitElementIndex, [&found](const int, const Element&) {
+		found++;
+	});
+	return found;
+}
+
+// Returns the element at an element index, as passed to visitors and yielded by cursors
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+const typename BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::Element& BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::element(const int elementIndex) const
+{
+	return elements[elementIndex];
+}
+
+// Insert an element into the quadtree - make sure the element's fields are initialised
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+int BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::insert(const Payload& id, const Coord x1, const Coord y1, const Coord x2, const Coord y2)
+{
+	packedValid = false;
+	const int newElementIndex = elements.insert(Element(id, x1, y1, x2, y2));
+	if (changeTracking) {
+		changeEpoch++;
+		if (elementEpochs.size() <= newElementIndex) {
+			elementEpochs.resize(elements.size(), ElementEpochs(0, 0));
+		}
+		elementEpochs[newElementIndex] = ElementEpochs(changeEpoch, changeEpoch);
+	}
+	nodeInsert(0, 0, rootMx, rootMy, rootHx, rootHy, newElementIndex);
+	return newElementIndex;
+}
+
+// Remove an element from the quadtree - removes all element nodes and the element itself.
+// With back-references this is O(duplicates): the element's chain gives its element nodes
+// and each is spliced out of its doubly linked leaf list
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::remove(const int elementIndex)
+{
+	packedValid = false;
+	if (changeTracking) {
+		changeEpoch++;
+		logChange(elementIndex, true);
+		elementEpochs[elementIndex] = ElementEpochs(0, 0);
+	}
+	if (backReferences) {
+		while (firstElementNodes[elementIndex] != -1) {
+			removeElementNode(firstElementNodes[elementIndex], -1);
+		}
+		elements.erase(elementIndex);
+		return;
+	}
+
+	const Element & e = elements[elementIndex];
+	std::vector<NodeData> & leaves = scratch.leaves;
+	findLeaves(leaves, scratch, 0, 0, rootMx, rootMy, rootHx, rootHy, e.x1, e.y1, e.x2, e.y2);
+
+	// For each leaf node remove the element nodes
+	for (int i = 0; i < leaves.size(); i++) {
+		leafRemove(leaves[i].nodeIndex, elementIndex);
+	}
+	// Remove the element itself
+	elements.erase(elementIndex);
+}
+
+// Move an element to a new AABB, keeping its element index.
+// Only the leaves the element enters or leaves are touched. If it stays in the same
+// leaves, which is the common case for small moves, only its coordinates are rewritten
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::update(const int elementIndex, const Coord x1, const Coord y1, const Coord x2, const Coord y2)
+{
+	packedValid = false;
+	if (changeTracking) {
+		changeEpoch++;
+		logChange(elementIndex, false);
+		elementEpochs[elementIndex].changed = changeEpoch;
+	}
+	std::vector<NodeData> & oldLeaves = scratch.leaves;
+	Element & e = elements[elementIndex];
+	if (backReferences) {
+		// The element's chain gives the leaves it is in without a descent. Only their
+		// indices are needed, to compare against the new leaves
+		oldLeaves.clear();
+		for (int elementNodeIndex = firstElementNodes[elementIndex]; elementNodeIndex != -1; elementNodeIndex = elementNodeLinks[elementNodeIndex].nextDuplicateIndex) {
+			oldLeaves.push_back(NodeData(elementNodeLinks[elementNodeIndex].nodeIndex, 0, 0, 0, 0, 0));
+		}
+	}
+	else {
+		findLeaves(oldLeaves, scratch, 0, 0, rootMx, rootMy, rootHx, rootHy, e.x1, e.y1, e.x2, e.y2);
+	}
+	findLeaves(updateLeaves, scratch, 0, 0, rootMx, rootMy, rootHx, rootHy, x1, y1, x2, y2);
+
+	e.x1 = x1;
+	e.y1 = y1;
+	e.x2 = x2;
+	e.y2 = y2;
+
+	// The element changed in every leaf it is in now. Leaves it enters are marked again by
+	// leafInsert, which is cheap as the walk up stops at the first node already marked
+	if (changeTracking) {
+		for (int i = 0; i < updateLeaves.size(); i++) {
+			markChanged(updateLeaves[i].nodeIndex);
+		}
+	}
+
+	// findLeaves visits nodes in a fixed order, so the same set of leaves comes back in the
+	// same order. The chain is in no particular order, so the sets are compared instead
+	bool sameLeaves = oldLeaves.size() == updateLeaves.size();
+	for (int i = 0; sameLeaves && i < oldLeaves.size(); i++) {
+		sameLeaves = backReferences ? containsLeaf(updateLeaves, oldLeaves[i].nodeIndex) : oldLeaves[i].nodeIndex == updateLeaves[i].nodeIndex;
+	}
+	if (sameLeaves) {
+		return;
+	}
+
+	// Leave the leaves that no longer overlap the element
+	for (int i = 0; i < oldLeaves.size(); i++) {
+		if (!containsLeaf(updateLeaves, oldLeaves[i].nodeIndex)) {
+			leafRemove(oldLeaves[i].nodeIndex, elementIndex);
+		}
+	}
+
+	// Enter the new ones. A split in leafInsert only replaces the leaf being inserted into,
+	// so the remaining entries of updateLeaves stay valid
+	for (int i = 0; i < updateLeaves.size(); i++) {
+		const NodeData & leaf = updateLeaves[i];
+		if (!containsLeaf(oldLeaves, leaf.nodeIndex)) {
+			leafInsert(leaf.nodeIndex, leaf.depth, leaf.mx, leaf.my, leaf.hx, leaf.hy, elementIndex);
+		}
+	}
+}
+
+// Returns true if the list of leaves contains the node. Elements span few leaves, so a linear search is enough
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::containsLeaf(const std::vector<NodeData>& leaves, const int nodeIndex)
+{
+	for (int i = 0; i < leaves.size(); i++) {
+		if (leaves[i].nodeIndex == nodeIndex) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Remove the element node referring to an element from a leaf
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::leafRemove(const int nodeIndex, const int elementIndex)
+{
+	// With back-references walk the element's few element nodes instead of the leaf's list
+	if (backReferences) {
+		int elementNodeIndex = firstElementNodes[elementIndex];
+		int prevDuplicateIndex = -1;
+		while (elementNodeIndex != -1 && elementNodeLinks[elementNodeIndex].nodeIndex != nodeIndex) {
+			prevDuplicateIndex = elementNodeIndex;
+			elementNodeIndex = elementNodeLinks[elementNodeIndex].nextDuplicateIndex;
+		}
+		if (elementNodeIndex != -1) {
+			removeElementNode(elementNodeIndex, prevDuplicateIndex);
+		}
+		return;
+	}
+
+	// Traverse the list until the element node is found
+	int elementNodeIndex = nodes[nodeIndex].firstChildIndex;
+	int prevElementNodeIndex = -1;
+	while (elementNodeIndex != -1 && elementNodes[elementNodeIndex].elementIndex != elementIndex) {
+		prevElementNodeIndex = elementNodeIndex;
+		elementNodeIndex = elementNodes[elementNodeIndex].nextIndex;
+	}
+	// If nodeIndex == -1, the element could not be found in the leaf
+	if (elementNodeIndex != -1) {
+		// Remove the element node (LinkedList removal)
+		const int nextIndex = elementNodes[elementNodeIndex].nextIndex;
+		if (prevElementNodeIndex == -1) {
+			nodes[nodeIndex].firstChildIndex = nextIndex;
+		}
+		else {
+			elementNodes[prevElementNodeIndex].nextIndex = nextIndex;
+		}
+
+		elementNodes.erase(elementNodeIndex);
+		nodes[nodeIndex].count--;
+	}
+}
+
+// Records an element node just put at the head of a leaf's list in the back-references,
+// if they are kept
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::linkElementNode(const int nodeIndex, const int elementNodeIndex)
+{
+	if (!backReferences) {
+		return;
+	}
+
+	// The FreeLists only grow at the back, so these only grow when they do
+	const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+	if (elementNodeLinks.size() <= elementNodeIndex) {
+		elementNodeLinks.resize(elementNodes.size(), QuadElementNodeLink(-1, -1, -1));
+	}
+	if (firstElementNodes.size() <= elementIndex) {
+		firstElementNodes.resize(elements.size(), -1);
+	}
+
+	elementNodeLinks[elementNodeIndex] = QuadElementNodeLink(nodeIndex, -1, firstElementNodes[elementIndex]);
+	firstElementNodes[elementIndex] = elementNodeIndex;
+	const int nextIndex = elementNodes[elementNodeIndex].nextIndex;
+	if (nextIndex != -1) {
+		elementNodeLinks[nextIndex].prevIndex = elementNodeIndex;
+	}
+}
+
+// Takes an element node out of its element's chain, if back-references are kept. For a
+// leaf's list being torn down as a whole, so the list itself is left alone
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::unlinkDuplicate(const int elementNodeIndex)
+{
+	if (!backReferences) {
+		return;
+	}
+
+	const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+	int duplicateIndex = firstElementNodes[elementIndex];
+	int prevDuplicateIndex = -1;
+	while (duplicateIndex != elementNodeIndex) {
+		prevDuplicateIndex = duplicateIndex;
+		duplicateIndex = elementNodeLinks[duplicateIndex].nextDuplicateIndex;
+	}
+	if (prevDuplicateIndex == -1) {
+		firstElementNodes[elementIndex] = elementNodeLinks[elementNodeIndex].nextDuplicateIndex;
+	}
+	else {
+		elementNodeLinks[prevDuplicateIndex].nextDuplicateIndex = elementNodeLinks[elementNodeIndex].nextDuplicateIndex;
+	}
+}
+
+// Splices an element node out of its leaf's list and its element's chain, and frees it.
+// prevDuplicateIndex is the element node before it in the chain, or -1 at the head.
+// Only used while back-references are kept
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::removeElementNode(const int elementNodeIndex, const int prevDuplicateIndex)
+{
+	const QuadElementNodeLink link = elementNodeLinks[elementNodeIndex];
+	const QuadElementNode elementNode = elementNodes[elementNodeIndex];
+
+	if (link.prevIndex == -1) {
+		nodes[link.nodeIndex].firstChildIndex = elementNode.nextIndex;
+	}
+	else {
+		elementNodes[link.prevIndex].nextIndex = elementNode.nextIndex;
+	}
+	if (elementNode.nextIndex != -1) {
+		elementNodeLinks[elementNode.nextIndex].prevIndex = link.prevIndex;
+	}
+
+	if (prevDuplicateIndex == -1) {
+		firstElementNodes[elementNode.elementIndex] = link.nextDuplicateIndex;
+	}
+	else {
+		elementNodeLinks[prevDuplicateIndex].nextDuplicateIndex = link.nextDuplicateIndex;
+	}
+
+	elementNodes.erase(elementNodeIndex);
+	nodes[link.nodeIndex].count--;
+}
+
+// Rebuilds the back-references from the leaves' lists, for operations that rewrite the
+// element nodes wholesale. Clears them if they aren't kept
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::rebuildBackReferences()
+{
+	firstElementNodes.clear();
+	elementNodeLinks.clear();
+	if (!backReferences) {
+		return;
+	}
+
+	firstElementNodes.resize(elements.size(), -1);
+	elementNodeLinks.resize(elementNodes.size(), QuadElementNodeLink(-1, -1, -1));
+	std::vector<int> toProcess(1, 0);
+	while (toProcess.size() > 0) {
+		const int nodeIndex = toProcess.back();
+		toProcess.pop_back();
+		const QuadNode & node = nodes[nodeIndex];
+		if (node.count == -1) {
+			for (int i = 0; i < 4; i++) {
+				toProcess.push_back(node.firstChildIndex + i);
+			}
+			continue;
+		}
+
+		int prevIndex = -1;
+		for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+			elementNodeLinks[elementNodeIndex] = QuadElementNodeLink(nodeIndex, prevIndex, firstElementNodes[elementIndex]);
+			firstElementNodes[elementIndex] = elementNodeIndex;
+			prevIndex = elementNodeIndex;
+		}
+	}
+}
+
+//class A : public IQuadtreeVisitor {
+//	virtual void branch(const Quadtree& quadtree, const int node, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy) override {
+//
+//	}
+//
+//	virtual void leaf(const Quadtree& quadtree, const int node, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy) override {
+//
+//	}
+//};
+
+// Traverse all the nodes in the tree, calling 'branch' for branch nodes and 'leaf' for leaf nodes
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::traverse(const TreeVisitor& visitor) const
+{
+	std::vector<NodeData> toProcess;
+	toProcess.push_back(NodeData(0, 0, rootMx, rootMy, rootHx, rootHy));
+
+	while (toProcess.size() > 0) {
+		const NodeData nodeData = toProcess.back();
+		toProcess.pop_back();
+		const QuadNode & node = nodes[nodeData.nodeIndex];
+		const int fc = node.firstChildIndex;
+
+		// If the node is not a leaf
+		if (node.count == -1) {
+
+			// Push the child nodes onto the list (calculate the AABB)
+			const Coord hx = quadHalf(nodeData.hx), hy = quadHalf(nodeData.hy);
+			const Coord leftMx = nodeData.mx - hx, topMy = nodeData.my - hy, rightMx = nodeData.mx + hx, bottomMy = nodeData.my + hy;
+			toProcess.push_back(NodeData(fc + 0, nodeData.depth + 1, leftMx, topMy, hx, hy));
+			toProcess.push_back(NodeData(fc + 1, nodeData.depth + 1, rightMx, topMy, hx, hy));
+			toProcess.push_back(NodeData(fc + 2, nodeData.depth + 1, leftMx, bottomMy, hx, hy));
+			toProcess.push_back(NodeData(fc + 3, nodeData.depth + 1, rightMx, bottomMy, hx, hy));
+
+			// Visit the branch
+			visitor.branch(*this, nodeData.nodeIndex, nodeData.depth, nodeData.mx, nodeData.my, nodeData.hx, nodeData.hy);
+		}
+		else {
+			visitor.leaf(*this, nodeData.nodeIndex, nodeData.depth, nodeData.mx, nodeData.my, nodeData.hx, nodeData.hy);
+		}
+	}
+
+}
+
+
+// Writes the elements found in the specified rectangle to 'out', excluding the
+// specified element to omit. 'out' is cleared first, keeping its capacity, so a
+// caller that reuses the same buffer does not allocate once it has grown.
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::query(std::vector<Element>& out, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex)
+{
+	out.clear();
+	queryVisit(x1, y1, x2, y2, omitElementIndex, [&out](const int, const Element& e) {
+		out.push_back(e);
+	});
+}
+
+// Writes the elements found in the specified rectangle to 'out'
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::query(std::vector<Element>& out, const Coord x1, const Coord y1, const Coord x2, const Coord y2)
+{
+	query(out, x1, y1, x2, y2, -1);
+}
+
+// Returns a list of elements found in the specified rectangle excluding the
+// specified element to omit.
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+std::vector<BasicQuadElement<Coord, Payload>> BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::query(const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex)
+{
+	std::vector<Element> out;
+	query(out, x1, y1, x2, y2, omitElementIndex);
+	return out;
+}
+
+// Returns a list of elements found in the specified rectangle
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+std::vector<BasicQuadElement<Coord, Payload>> BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::query(const Coord x1, const Coord y1, const Coord x2, const Coord y2)
+{
+	return query(x1, y1, x2, y2, -1);
+}
+
+// Writes the k elements closest to the point to 'out' (cleared first), sorted by
+// distance, excluding the specified element to omit (-1 to omit nothing). The distance
+// to an element is from the point to the nearest point of its AABB
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::nearest(std::vector<QuadNeighbor>& out, const double x, const double y, const int k, const int omitElementIndex)
+{
+	search(scratch, out, x, y, k, std::numeric_limits<double>::infinity(), omitElementIndex);
+}
+
+// Writes the elements within the radius of the point to 'out' (cleared first), sorted
+// by distance, excluding the specified element to omit (-1 to omit nothing)
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::withinRadius(std::vector<QuadNeighbor>& out, const double x, const double y, const double radius, const int omitElementIndex)
+{
+	search(scratch, out, x, y, std::numeric_limits<int>::max(), radius, omitElementIndex);
+}
+
+// Writes the first k elements the segment from (ax, ay) to (bx, by) crosses to 'out'
+// (cleared first), in order along it, excluding the specified element to omit (-1 to
+// omit nothing). The distances are from (ax, ay) to where the segment enters each element.
+// For line of sight or a projectile's sweep, k = 1 stops at the first hit. A ray is a
+// segment long enough to leave the tree
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::raycast(std::vector<QuadNeighbor>& out, const double ax, const double ay, const double bx, const double by, const int k, const int omitElementIndex)
+{
+	segmentSearch(scratch, out, ax, ay, bx, by, k, omitElementIndex);
+}
+
+// Writes every element the segment crosses to 'out' (cleared first), in order along it
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::segmentQuery(std::vector<QuadNeighbor>& out, const double ax, const double ay, const double bx, const double by, const int omitElementIndex)
+{
+	segmentSearch(scratch, out, ax, ay, bx, by, std::numeric_limits<int>::max(), omitElementIndex);
+}
+
+// Best-first search behind raycast and segmentQuery, run like search with the distance
+// along the segment in place of the distance to a point. A node is queued at the point
+// where the segment enters the region it owns, and only if the segment crosses it, so the
+// search steps through the leaves the segment crosses in order and never looks at the
+// rest. An element is queued where the segment enters it. That is inside some leaf holding
+// the element, which comes off the queue first, so elements come off the queue in order
+// and the search stops at the k-th one.
+// Like queryVisit with a scratch, threads may run this concurrently on an unchanging tree
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::segmentSearch(Scratch& scratch, std::vector<QuadNeighbor>& out, const double ax, const double ay, const double bx, const double by, const int k, const int omitElementIndex) const
+{
+	out.clear();
+	if (k <= 0) {
+		return;
+	}
+	QUADTREE_COUNT(scratch.counters.queries, 1);
+
+	const double dx = bx - ax, dy = by - ay;
+	const double length = std::sqrt(dx * dx + dy * dy);
+	std::vector<SearchEntry> & heap = scratch.searchHeap;
+	std::vector<bool> & tempBuffer = scratch.tempBuffer;
+	std::vector<int> & clearList = scratch.clearList;
+	if (tempBuffer.size() < elements.size()) {
+		tempBuffer.assign(elements.size(), false);
+	}
+
+	heap.clear();
+	heap.push_back(SearchEntry(0.0, -1, NodeData(0, 0, rootMx, rootMy, rootHx, rootHy),
+		LeafRegion(0, std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::max(), std::numeric_limits<Coord>::max())));
+
+	while (heap.size() > 0 && out.size() < k) {
+		std::pop_heap(heap.begin(), heap.end());
+		const SearchEntry entry = heap.back();
+		heap.pop_back();
+
+		if (entry.elementIndex != -1) {
+			out.push_back(QuadNeighbor(entry.elementIndex, entry.distance * length));
+			QUADTREE_COUNT(scratch.counters.elementsReturned, 1);
+			continue;
+		}
+		QUADTREE_COUNT(scratch.counters.nodesVisited, 1);
+
+		const NodeData & nodeData = entry.node;
+		const LeafRegion & region = entry.region;
+		const QuadNode & node = nodes[nodeData.nodeIndex];
+		double t;
+
+		// A leaf queues the elements the segment crosses
+		if (node.count != -1) {
+			QUADTREE_COUNT(scratch.counters.leavesScanned, 1);
+			for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+				const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+				if (tempBuffer[elementIndex] || elementIndex == omitElementIndex) {
+					continue;
+				}
+				tempBuffer[elementIndex] = true;
+				clearList.push_back(elementIndex);
+
+				const Element & e = elements[elementIndex];
+				QUADTREE_COUNT(scratch.counters.elementsTested, 1);
+				if (segmentEntry(ax, ay, dx, dy, e.x1, e.y1, e.x2, e.y2, t)) {
+					heap.push_back(SearchEntry(t, elementIndex, nodeData, region));
+					std::push_heap(heap.begin(), heap.end());
+				}
+			}
+			continue;
+		}
+
+		// A branch queues the children the segment crosses, splitting its region the same
+		// way findAllLeaves does
+		const Coord mx = nodeData.mx, my = nodeData.my;
+		const Coord hx = quadHalf(nodeData.hx), hy = quadHalf(nodeData.hy);
+		const int fc = node.firstChildIndex;
+		const Coord leftMx = mx - hx, topMy = my - hy, rightMx = mx + hx, bottomMy = my + hy;
+		const int depth = nodeData.depth + 1;
+		const SearchEntry children[4] = {
+			SearchEntry(0.0, -1, NodeData(fc + 0, depth, leftMx, topMy, hx, hy), LeafRegion(fc + 0, region.left, region.top, mx, my)),
+			SearchEntry(0.0, -1, NodeData(fc + 1, depth, rightMx, topMy, hx, hy), LeafRegion(fc + 1, mx, region.top, region.right, my)),
+			SearchEntry(0.0, -1, NodeData(fc + 2, depth, leftMx, bottomMy, hx, hy), LeafRegion(fc + 2, region.left, my, mx, region.bottom)),
+			SearchEntry(0.0, -1, NodeData(fc + 3, depth, rightMx, bottomMy, hx, hy), LeafRegion(fc + 3, mx, my, region.right, region.bottom))
+		};
+		for (int i = 0; i < 4; i++) {
+			const LeafRegion & childRegion = children[i].region;
+			if (segmentEntry(ax, ay, dx, dy, childRegion.left, childRegion.top, childRegion.right, childRegion.bottom, t)) {
+				SearchEntry child = children[i];
+				child.distance = t;
+				heap.push_back(child);
+				std::push_heap(heap.begin(), heap.end());
+			}
+		}
+	}
+
+	for (int i = 0; i < clearList.size(); i++) {
+		tempBuffer[clearList[i]] = false;
+	}
+	clearList.clear();
+}
+
+// Writes the elements overlapping the convex polygon to 'out' (cleared first), excluding
+// the specified element to omit (-1 to omit nothing)
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::polygonQuery(std::vector<Element>& out, const QuadPolygon& polygon, const int omitElementIndex)
+{
+	out.clear();
+	polygonVisit(scratch, polygon, omitElementIndex, [&out](const int, const Element& e) {
+		out.push_back(e);
+	});
+}
+
+// Calls visit(elementIndex, element) once for every element overlapping the convex
+// polygon, excluding the specified element to omit. Only descends into the children whose
+// regions the polygon overlaps by the separating axis test, so a thin diagonal frustum
+// touches far fewer leaves than its bounding box would. Threads may run this concurrently
+// with their own scratch as long as nothing modifies the tree
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+template <class Visitor>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::polygonVisit(Scratch& scratch, const QuadPolygon& polygon, const int omitElementIndex, Visitor&& visit) const
+{
+	QUADTREE_COUNT(scratch.counters.queries, 1);
+	std::vector<SearchEntry> & stack = scratch.searchHeap;
+	std::vector<bool> & tempBuffer = scratch.tempBuffer;
+	std::vector<int> & clearList = scratch.clearList;
+	if (tempBuffer.size() < elements.size()) {
+		tempBuffer.assign(elements.size(), false);
+	}
+
+	stack.clear();
+	stack.push_back(SearchEntry(0.0, -1, NodeData(0, 0, rootMx, rootMy, rootHx, rootHy),
+		LeafRegion(0, std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::max(), std::numeric_limits<Coord>::max())));
+
+	while (stack.size() > 0) {
+		const NodeData nodeData = stack.back().node;
+		const LeafRegion region = stack.back().region;
+		stack.pop_back();
+		QUADTREE_COUNT(scratch.counters.nodesVisited, 1);
+		const QuadNode & node = nodes[nodeData.nodeIndex];
+
+		if (node.count != -1) {
+			QUADTREE_COUNT(scratch.counters.leavesScanned, 1);
+			for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+				const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+				if (tempBuffer[elementIndex] || elementIndex == omitElementIndex) {
+					continue;
+				}
+				const Element & e = elements[elementIndex];
+				QUADTREE_COUNT(scratch.counters.elementsTested, 1);
+				if (polygon.intersects(e.x1, e.y1, e.x2, e.y2)) {
+					tempBuffer[elementIndex] = true;
+					clearList.push_back(elementIndex);
+					QUADTREE_COUNT(scratch.counters.elementsReturned, 1);
+					visit(elementIndex, e);
+				}
+			}
+			continue;
+		}
+
+		const Coord mx = nodeData.mx, my = nodeData.my;
+		const Coord hx = quadHalf(nodeData.hx), hy = quadHalf(nodeData.hy);
+		const int fc = node.firstChildIndex;
+		const Coord leftMx = mx - hx, topMy = my - hy, rightMx = mx + hx, bottomMy = my + hy;
+		const int depth = nodeData.depth + 1;
+		const SearchEntry children[4] = {
+			SearchEntry(0.0, -1, NodeData(fc + 0, depth, leftMx, topMy, hx, hy), LeafRegion(fc + 0, region.left, region.top, mx, my)),
+			SearchEntry(0.0, -1, NodeData(fc + 1, depth, rightMx, topMy, hx, hy), LeafRegion(fc + 1, mx, region.top, region.right, my)),
+			SearchEntry(0.0, -1, NodeData(fc + 2, depth, leftMx, bottomMy, hx, hy), LeafRegion(fc + 2, region.left, my, mx, region.bottom)),
+			SearchEntry(0.0, -1, NodeData(fc + 3, depth, rightMx, bottomMy, hx, hy), LeafRegion(fc + 3, mx, my, region.right, region.bottom))
+		};
+		for (int i = 0; i < 4; i++) {
+			const LeafRegion & childRegion = children[i].region;
+			if (polygon.intersects(childRegion.left, childRegion.top, childRegion.right, childRegion.bottom)) {
+				stack.push_back(children[i]);
+			}
+		}
+	}
+
+	for (int i = 0; i < clearList.size(); i++) {
+		tempBuffer[clearList[i]] = false;
+	}
+	clearList.clear();
+}
+
+// Best-first search behind nearest and withinRadius: writes up to k elements within the
+// radius of the point to 'out', closest first. Nodes and elements share one priority
+// queue ordered by distance; a node's distance is to the region it owns, which no
+// element reachable through it can be closer than (an element sticking out of a leaf is
+// also stored in the leaf holding its nearest point). So elements come off the queue in
+// order, and the search stops at the k-th one without expanding any node further away.
+// Once k elements have been queued, the distance of the k-th closest bounds the search:
+// nothing further away is queued at all. An element stored in several leaves is only
+// queued once, using tempBuffer as in query.
+// Like queryVisit with a scratch, threads may run this concurrently on an unchanging tree
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::search(Scratch& scratch, std::vector<QuadNeighbor>& out, const double x, const double y, const int k, const double radius, const int omitElementIndex) const
+{
+	out.clear();
+	if (k <= 0 || radius < 0) {
+		return;
+	}
+	QUADTREE_COUNT(scratch.counters.queries, 1);
+
+	double maxDistance = radius * radius;
+	std::vector<SearchEntry> & heap = scratch.searchHeap;
+	std::vector<double> & best = scratch.searchBest;
+	std::vector<bool> & tempBuffer = scratch.tempBuffer;
+	std::vector<int> & clearList = scratch.clearList;
+	if (tempBuffer.size() < elements.size()) {
+		tempBuffer.assign(elements.size(), false);
+	}
+
+	heap.clear();
+	best.clear();
+	heap.push_back(SearchEntry(0.0, -1, NodeData(0, 0, rootMx, rootMy, rootHx, rootHy),
+		LeafRegion(0, std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::max(), std::numeric_limits<Coord>::max())));
+
+	while (heap.size() > 0 && out.size() < k) {
+		std::pop_heap(heap.begin(), heap.end());
+		const SearchEntry entry = heap.back();
+		heap.pop_back();
+		if (entry.distance > maxDistance) {
+			break;
+		}
+
+		if (entry.elementIndex != -1) {
+			out.push_back(QuadNeighbor(entry.elementIndex, std::sqrt(entry.distance)));
+			QUADTREE_COUNT(scratch.counters.elementsReturned, 1);
+			continue;
+		}
+		QUADTREE_COUNT(scratch.counters.nodesVisited, 1);
+
+		const NodeData & nodeData = entry.node;
+		const LeafRegion & region = entry.region;
+		const QuadNode & node = nodes[nodeData.nodeIndex];
+
+		// A leaf queues its elements
+		if (node.count != -1) {
+			QUADTREE_COUNT(scratch.counters.leavesScanned, 1);
+			for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+				const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+				if (tempBuffer[elementIndex] || elementIndex == omitElementIndex) {
+					continue;
+				}
+				tempBuffer[elementIndex] = true;
+				clearList.push_back(elementIndex);
+
+				const Element & e = elements[elementIndex];
+				const double distance = distanceSquared(x, y, e.x1, e.y1, e.x2, e.y2);
+				QUADTREE_COUNT(scratch.counters.elementsTested, 1);
+				if (distance > maxDistance) {
+					continue;
+				}
+				heap.push_back(SearchEntry(distance, elementIndex, nodeData, region));
+				std::push_heap(heap.begin(), heap.end());
+
+				// Tighten the bound once there are k candidates (withinRadius has no k)
+				if (k == std::numeric_limits<int>::max()) {
+					continue;
+				}
+				best.push_back(distance);
+				std::push_heap(best.begin(), best.end());
+				if (best.size() > k) {
+					std::pop_heap(best.begin(), best.end());
+					best.pop_back();
+				}
+				if (best.size() == k) {
+					maxDistance = best.front();
+				}
+			}
+			continue;
+		}
+
+		// A branch queues its children, splitting its region the same way findAllLeaves does
+		const Coord mx = nodeData.mx, my = nodeData.my;
+		const Coord hx = quadHalf(nodeData.hx), hy = quadHalf(nodeData.hy);
+		const int fc = node.firstChildIndex;
+		const Coord leftMx = mx - hx, topMy = my - hy, rightMx = mx + hx, bottomMy = my + hy;
+		const int depth = nodeData.depth + 1;
+		const SearchEntry children[4] = {
+			SearchEntry(0.0, -1, NodeData(fc + 0, depth, leftMx, topMy, hx, hy), LeafRegion(fc + 0, region.left, region.top, mx, my)),
+			SearchEntry(0.0, -1, NodeData(fc + 1, depth, rightMx, topMy, hx, hy), LeafRegion(fc + 1, mx, region.top, region.right, my)),
+			SearchEntry(0.0, -1, NodeData(fc + 2, depth, leftMx, bottomMy, hx, hy), LeafRegion(fc + 2, region.left, my, mx, region.bottom)),
+			SearchEntry(0.0, -1, NodeData(fc + 3, depth, rightMx, bottomMy, hx, hy), LeafRegion(fc + 3, mx, my, region.right, region.bottom))
+		};
+		for (int i = 0; i < 4; i++) {
+			SearchEntry child = children[i];
+			child.distance = distanceSquared(x, y, child.region.left, child.region.top, child.region.right, child.region.bottom);
+			if (child.distance <= maxDistance) {
+				heap.push_back(child);
+				std::push_heap(heap.begin(), heap.end());
+			}
+		}
+	}
+
+	// Unmark queued elements
+	for (int i = 0; i < clearList.size(); i++) {
+		tempBuffer[clearList[i]] = false;
+	}
+	clearList.clear();
+}
+
+// Runs all the queries on the pool's threads and writes the results to 'result'.
+// Queries are handed out in chunks, each worker querying with its own scratch and
+// writing into a per-chunk buffer, which are then gathered into result.elements.
+// The tree must not be modified while the batch runs
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::queryBatch(ThreadPool& pool, const std::vector<Query>& queries, QueryBatchResult& result)
+{
+	// Number of queries handed to a worker at once
+	const int chunkSize = 64;
+	const int numQueries = static_cast<int>(queries.size());
+	const int numChunks = (numQueries + chunkSize - 1) / chunkSize;
+
+	if (workerScratch.size() < pool.size()) {
+		workerScratch.resize(pool.size());
+	}
+	for (int i = 0; i < workerScratch.size(); i++) {
+		workerScratch[i].trackLeafHits = trackHeat;
+	}
+	if (batchChunks.size() < numChunks) {
+		batchChunks.resize(numChunks);
+	}
+	result.offsets.assign(numQueries + 1, 0);
+
+	// Run the queries, storing the number of elements found by query i in offsets[i + 1]
+	pool.run(numChunks, [&](const int chunk, const int worker) {
+		Scratch & workerState = workerScratch[worker];
+		std::vector<Element> & out = batchChunks[chunk];
+		out.clear();
+
+		const int end = std::min(numQueries, (chunk + 1) * chunkSize);
+		for (int i = chunk * chunkSize; i < end; i++) {
+			const Query & q = queries[i];
+			const int start = static_cast<int>(out.size());
+			queryVisit(workerState, q.x1, q.y1, q.x2, q.y2, q.omitElementIndex, [&out](const int, const Element& e) {
+				out.push_back(e);
+			});
+			result.offsets[i + 1] = static_cast<int>(out.size()) - start;
+		}
+	});
+
+	// Turn the counts into offsets
+	for (int i = 0; i < numQueries; i++) {
+		result.offsets[i + 1] += result.offsets[i];
+	}
+
+	// Gather the chunks into the result. Each chunk's results start at the offset of its first query
+	result.elements.resize(result.offsets[numQueries], Element(Payload(), 0, 0, 0, 0));
+	pool.run(numChunks, [&](const int chunk, const int) {
+		const std::vector<Element> & out = batchChunks[chunk];
+		std::copy(out.begin(), out.end(), result.elements.begin() + result.offsets[chunk * chunkSize]);
+	});
+}
+
+// Replaces the contents of the tree with the given elements, which get the element
+// indices 0 to newElements.size() - 1 in order. Much faster than inserting them one by
+// one for level loads and full rebuilds: each node's elements are split between its
+// children once, top-down, instead of leaves being split and refilled as they overflow,
+// and each leaf's element nodes are laid out contiguously. O(n * depth) overall.
+// The tree can be changed with insert/remove/update as usual afterwards
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::build(const std::vector<Element>& newElements)
+{
+	elements.clear();
+	elementNodes.clear();
+	nodes.clear();
+	freeNodeIndex = -1;
+	cleanupCursor = 0;
+	packedValid = false;
+	clearHeat();
+
+	// Insert root, padded to a block of 4 so that every block of children starts at a
+	// multiple of 4
+	for (int i = 0; i < 4; i++) {
+		nodes.insert(QuadNode(-1, 0));
+	}
+
+	// 'work' holds the elements of every node still to be processed, each node owning
+	// a range of it. Children's ranges are appended after their parent's, last child
+	// first, and nodes are processed last in first out, so once a node is popped
+	// everything past its range belongs to finished nodes and is reused. workEnd marks
+	// the end of the live ranges; the vector itself only grows, so reused slots aren't
+	// cleared again. The first child is processed first, so nodes and element nodes come
+	// out in the depth-first Morton order of relayout
+	const int numElements = static_cast<int>(newElements.size());
+	std::vector<BuildElement> work;
+	work.reserve(2 * static_cast<size_t>(numElements));
+	for (int i = 0; i < numElements; i++) {
+		const Element & e = newElements[i];
+		work.push_back({ elements.insert(e), e.x1, e.y1, e.x2, e.y2 });
+	}
+	int workEnd = numElements;
+
+	std::vector<BuildNode> toProcess;
+	toProcess.push_back({ NodeData(0, 0, rootMx, rootMy, rootHx, rootHy), 0, numElements });
+
+	while (toProcess.size() > 0) {
+		const BuildNode pending = toProcess.back();
+		toProcess.pop_back();
+		const NodeData & nodeData = pending.data;
+		workEnd = pending.end;
+
+		if (isBuildLeaf(work, pending)) {
+			// The element node list was cleared above and is only appended to, so the
+			// leaf's element nodes get consecutive indices
+			const int count = pending.end - pending.begin;
+			const int firstElementNodeIndex = elementNodes.size();
+			for (int i = pending.begin; i < pending.end; i++) {
+				const int nextIndex = i + 1 < pending.end ? elementNodes.size() + 1 : -1;
+				elementNodes.insert(QuadElementNode(nextIndex, work[i].elementIndex));
+			}
+			nodes[nodeData.nodeIndex] = QuadNode(count > 0 ? firstElementNodeIndex : -1, count);
+			continue;
+		}
+
+		const int fc = allocateChildren();
+		nodes[nodeData.nodeIndex] = QuadNode(fc, -1);
+		splitBuildNode(work, workEnd, pending, fc, toProcess);
+	}
+	rebuildBackReferences();
+	resetChanges();
+}
+
+// Same as above, with the subtrees built in parallel on the pool. The top of the tree is
+// split on the calling thread until every node left holds a small share of the elements.
+// Those nodes' subtrees are then built by the workers into lists of their own, in the
+// layout the serial build gives them, and copied into the tree's lists side by side,
+// rebasing their indices. Rebuild time scales with the number of workers up to the
+// memory bandwidth, the top split and the copy of the elements being the serial part
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::build(ThreadPool& pool, const std::vector<Element>& newElements)
+{
+	if (pool.size() == 1) {
+		build(newElements);
+		return;
+	}
+
+	elements.clear();
+	elementNodes.clear();
+	nodes.clear();
+	freeNodeIndex = -1;
+	cleanupCursor = 0;
+	packedValid = false;
+	clearHeat();
+	for (int i = 0; i < 4; i++) {
+		nodes.insert(QuadNode(-1, 0));
+	}
+
+	// Copy the elements in parallel chunks. The list was cleared, so element i goes to
+	// slot i as with insert
+	const int numElements = static_cast<int>(newElements.size());
+	const int chunkSize = 4096;
+	const int numChunks = (numElements + chunkSize - 1) / chunkSize;
+	std::vector<BuildElement> work(numElements);
+	elements.resizeSlots(numElements, -1);
+	pool.run(numChunks, [&](const int chunk, const int) {
+		const int end = std::min(numElements, (chunk + 1) * chunkSize);
+		for (int i = chunk * chunkSize; i < end; i++) {
+			const Element & e = newElements[i];
+			elements[i] = e;
+			work[i] = { i, e.x1, e.y1, e.x2, e.y2 };
+		}
+	});
+
+	// Split the top of the tree, depth first with the first child first as in the serial
+	// build, setting aside each node small enough to be a subtree task. Ranges aren't
+	// reused here, as the tasks read theirs later
+	const int taskSize = std::max(leafCapacity(), numElements / (16 * pool.size()));
+	std::vector<BuildTask> tasks;
+	std::vector<BuildNode> toProcess;
+	int workEnd = numElements;
+	toProcess.push_back({ NodeData(0, 0, rootMx, rootMy, rootHx, rootHy), 0, numElements });
+	while (toProcess.size() > 0) {
+		const BuildNode pending = toProcess.back();
+		toProcess.pop_back();
+		const NodeData & nodeData = pending.data;
+
+		if (isBuildLeaf(work, pending)) {
+			const int count = pending.end - pending.begin;
+			const int firstElementNodeIndex = elementNodes.size();
+			for (int i = pending.begin; i < pending.end; i++) {
+				const int nextIndex = i + 1 < pending.end ? elementNodes.size() + 1 : -1;
+				elementNodes.insert(QuadElementNode(nextIndex, work[i].elementIndex));
+			}
+			nodes[nodeData.nodeIndex] = QuadNode(count > 0 ? firstElementNodeIndex : -1, count);
+			continue;
+		}
+		if (pending.end - pending.begin <= taskSize) {
+			tasks.push_back(BuildTask(pending));
+			continue;
+		}
+
+		const int fc = allocateChildren();
+		nodes[nodeData.nodeIndex] = QuadNode(fc, -1);
+		splitBuildNode(work, workEnd, pending, fc, toProcess);
+	}
+
+	// Build the subtrees, each worker reusing its own work array and stack
+	std::vector<std::vector<BuildElement>> workerWork(pool.size());
+	std::vector<std::vector<BuildNode>> workerStacks(pool.size());
+	pool.run(static_cast<int>(tasks.size()), [&](const int taskIndex, const int worker) {
+		BuildTask & task = tasks[taskIndex];
+		std::vector<BuildElement> & taskWork = workerWork[worker];
+		taskWork.assign(work.begin() + task.root.begin, work.begin() + task.root.end);
+		buildSubtree(task, taskWork, workerStacks[worker]);
+	});
+
+	// Lay the subtrees out one after another, in task order, and copy them in
+	int nodeEnd = nodes.size(), elementNodeEnd = elementNodes.size();
+	for (int i = 0; i < tasks.size(); i++) {
+		tasks[i].nodeOffset = nodeEnd;
+		tasks[i].elementNodeOffset = elementNodeEnd;
+		nodeEnd += static_cast<int>(tasks[i].nodes.size());
+		elementNodeEnd += static_cast<int>(tasks[i].elementNodes.size());
+	}
+	nodes.resizeSlots(nodeEnd, -1);
+	elementNodes.resizeSlots(elementNodeEnd, -1);
+	pool.run(static_cast<int>(tasks.size()), [&](const int taskIndex, const int) {
+		const BuildTask & task = tasks[taskIndex];
+		// A branch's firstChildIndex is a node index and a leaf's an element node index
+		auto rebase = [&task](QuadNode node) {
+			if (node.count == -1) {
+				node.firstChildIndex += task.nodeOffset;
+			}
+			else if (node.firstChildIndex != -1) {
+				node.firstChildIndex += task.elementNodeOffset;
+			}
+			return node;
+		};
+		nodes[task.root.data.nodeIndex] = rebase(task.rootNode);
+		for (int i = 0; i < task.nodes.size(); i++) {
+			nodes[task.nodeOffset + i] = rebase(task.nodes[i]);
+		}
+		for (int i = 0; i < task.elementNodes.size(); i++) {
+			QuadElementNode elementNode = task.elementNodes[i];
+			if (elementNode.nextIndex != -1) {
+				elementNode.nextIndex += task.elementNodeOffset;
+			}
+			elementNodes[task.elementNodeOffset + i] = elementNode;
+		}
+	});
+	rebuildBackReferences();
+	resetChanges();
+}
+
+// Small enough (or too deep) to be a leaf, as leafInsert would decide. Above the leaf
+// capacity a split policy, if set, decides from the node's range of 'work'. The parallel
+// build asks from its workers, so the policy's split must be safe to call concurrently
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::isBuildLeaf(const std::vector<BuildElement>& work, const BuildNode& pending) const
+{
+	if (pending.end - pending.begin <= leafCapacity() || pending.data.depth >= depthLimit()) {
+		return true;
+	}
+	if (splitPolicy == nullptr) {
+		return false;
+	}
+
+	// Nothing has queried the new nodes, so they have no heat
+	const NodeData & nodeData = pending.data;
+	QuadLeafInfo info;
+	info.depth = nodeData.depth;
+	info.cellWidth = 2.0 * nodeData.hx;
+	info.cellHeight = 2.0 * nodeData.hy;
+	for (int i = pending.begin; i < pending.end; i++) {
+		const BuildElement & e = work[i];
+		addToLeafInfo(info, nodeData.mx, nodeData.my, e.x1, e.y1, e.x2, e.y2);
+	}
+	info.elementWidth /= info.count;
+	info.elementHeight /= info.count;
+	return !splitPolicy->split(info);
+}
+
+// Hands each element of a node being built to the children it overlaps, using the same
+// rule as findLeaves, and pushes the children onto 'toProcess', last child first, with
+// their ranges of 'work' starting at workEnd, which is moved past them. The first pass sizes each child's range, the second
+// fills them. Whether an element goes to a child is unpredictable, so the second pass
+// writes it to every child and only advances the children it belongs to. Each range is
+// followed by one spare slot for the write past its end
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::splitBuildNode(std::vector<BuildElement>& work, int& workEnd, const BuildNode& pending, const int fc, std::vector<BuildNode>& toProcess)
+{
+	const NodeData & nodeData = pending.data;
+	const Coord mx = nodeData.mx, my = nodeData.my;
+	int childCount[4] = { 0, 0, 0, 0 };
+	for (int i = pending.begin; i < pending.end; i++) {
+		const BuildElement & e = work[i];
+		const bool left = e.x1 <= mx, right = e.x2 > mx;
+		if (e.y1 <= my) {
+			childCount[0] += left;
+			childCount[1] += right;
+		}
+		if (e.y2 > my) {
+			childCount[2] += left;
+			childCount[3] += right;
+		}
+	}
+
+	int childNext[4];
+	childNext[3] = workEnd;
+	for (int child = 2; child >= 0; child--) {
+		childNext[child] = childNext[child + 1] + childCount[child + 1] + 1;
+	}
+	workEnd = childNext[0] + childCount[0] + 1;
+	if (work.size() < workEnd) {
+		work.resize(std::max<size_t>(workEnd, 2 * work.size()));
+	}
+	for (int i = pending.begin; i < pending.end; i++) {
+		const BuildElement e = work[i];
+		const bool left = e.x1 <= mx, right = e.x2 > mx;
+		const bool top = e.y1 <= my, bottom = e.y2 > my;
+		work[childNext[0]] = e;
+		childNext[0] += top & left;
+		work[childNext[1]] = e;
+		childNext[1] += top & right;
+		work[childNext[2]] = e;
+		childNext[2] += bottom & left;
+		work[childNext[3]] = e;
+		childNext[3] += bottom & right;
+	}
+
+	const Coord hx = quadHalf(nodeData.hx), hy = quadHalf(nodeData.hy);
+	const Coord leftMx = mx - hx, topMy = my - hy, rightMx = mx + hx, bottomMy = my + hy;
+	const int depth = nodeData.depth + 1;
+	toProcess.push_back({ NodeData(fc + 3, depth, rightMx, bottomMy, hx, hy), childNext[3] - childCount[3], childNext[3] });
+	toProcess.push_back({ NodeData(fc + 2, depth, leftMx, bottomMy, hx, hy), childNext[2] - childCount[2], childNext[2] });
+	toProcess.push_back({ NodeData(fc + 1, depth, rightMx, topMy, hx, hy), childNext[1] - childCount[1], childNext[1] });
+	toProcess.push_back({ NodeData(fc + 0, depth, leftMx, topMy, hx, hy), childNext[0] - childCount[0], childNext[0] });
+}
+
+// Builds a task's subtree the way the serial build does, into the task's own lists. The
+// task's elements are in 'work' from 0. The subtree's root is written to task.rootNode
+// and is the node with index -1 here
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::buildSubtree(BuildTask& task, std::vector<BuildElement>& work, std::vector<BuildNode>& toProcess) const
+{
+	const NodeData & rootData = task.root.data;
+	toProcess.clear();
+	toProcess.push_back({ NodeData(-1, rootData.depth, rootData.mx, rootData.my, rootData.hx, rootData.hy), 0, task.root.end - task.root.begin });
+
+	while (toProcess.size() > 0) {
+		const BuildNode pending = toProcess.back();
+		toProcess.pop_back();
+		QuadNode & node = pending.data.nodeIndex == -1 ? task.rootNode : task.nodes[pending.data.nodeIndex];
+		int workEnd = pending.end;
+
+		if (isBuildLeaf(work, pending)) {
+			const int count = pending.end - pending.begin;
+			const int firstElementNodeIndex = static_cast<int>(task.elementNodes.size());
+			for (int i = pending.begin; i < pending.end; i++) {
+				const int nextIndex = i + 1 < pending.end ? static_cast<int>(task.elementNodes.size()) + 1 : -1;
+				task.elementNodes.push_back(QuadElementNode(nextIndex, work[i].elementIndex));
+			}
+			node = QuadNode(count > 0 ? firstElementNodeIndex : -1, count);
+			continue;
+		}
+
+		const int fc = static_cast<int>(task.nodes.size());
+		node = QuadNode(fc, -1);
+		task.nodes.resize(fc + 4, QuadNode(-1, 0));
+		splitBuildNode(work, workEnd, pending, fc, toProcess);
+	}
+}
+
+// Copies the elements of every leaf into the packed structure-of-arrays layout, which
+// queries then scan with the SIMD intersect kernel picked for this CPU. Pays off with
+// dense leaves (large maxElements) and read-heavy frames: call it once the frame's
+// changes are done. Any later change to the tree switches queries back to the leaf
+// lists until pack is called again. The packed arrays are kept to reuse their capacity
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::pack()
+{
+	packed.leafStart.assign(nodes.size(), 0);
+	packed.x1.clear();
+	packed.y1.clear();
+	packed.x2.clear();
+	packed.y2.clear();
+	packed.elementIndex.clear();
+	packed.maxLeafCount = 0;
+
+	// Leaves are found by scanning the nodes array: branches have a count of -1 and
+	// freed nodes are empty, so any node with a positive count is a leaf in the tree
+	for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+		const QuadNode & node = nodes[nodeIndex];
+		if (node.count <= 0) {
+			continue;
+		}
+
+		packed.leafStart[nodeIndex] = static_cast<int>(packed.elementIndex.size());
+		packed.maxLeafCount = std::max(packed.maxLeafCount, node.count);
+		for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+			const Element & e = elements[elementIndex];
+			packed.x1.push_back(e.x1);
+			packed.y1.push_back(e.y1);
+			packed.x2.push_back(e.x2);
+			packed.y2.push_back(e.y2);
+			packed.elementIndex.push_back(elementIndex);
+		}
+	}
+	packedValid = true;
+}
+
+// Renumbers the nodes and element nodes into depth-first Morton order, the order
+// findLeaves and traverse visit them in: a branch's block of children is followed by
+// the blocks below its first child, then its second, and so on, and the element nodes
+// of each leaf are contiguous, in leaf order. A query then reads mostly sequential
+// cache lines instead of jumping between blocks allocated over the tree's history.
+// Free slots and freed node blocks are dropped; element indices don't change. Worth
+// calling after heavy churn or a load by insert. build already lays trees out this way
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::relayout()
+{
+	FreeList<QuadNode, Allocator> newNodes;
+	FreeList<QuadElementNode, Allocator> newElementNodes;
+	newNodes.reserve(nodes.size());
+	newElementNodes.reserve(elementNodes.size());
+	for (int i = 0; i < 4; i++) {
+		newNodes.insert(QuadNode(-1, 0));
+	}
+
+	// Nodes still to be copied, as pairs of their old and new index. The new lists have
+	// no free slots, so each insert appends
+	std::vector<std::pair<int, int>> toProcess;
+	toProcess.push_back(std::make_pair(0, 0));
+
+	// The nodes keep their change epochs under their new indices. There are no more new
+	// nodes than old ones
+	std::vector<std::uint64_t> newEpochs(changeTracking ? nodes.size() : 0, 0);
+	while (toProcess.size() > 0) {
+		const int oldIndex = toProcess.back().first;
+		const int newIndex = toProcess.back().second;
+		toProcess.pop_back();
+		const QuadNode & node = nodes[oldIndex];
+		if (changeTracking) {
+			newEpochs[newIndex] = nodeEpochs[oldIndex];
+		}
+
+		if (node.count == -1) {
+			const int fc = newNodes.size();
+			for (int i = 0; i < 4; i++) {
+				newNodes.insert(QuadNode(-1, 0));
+			}
+			newNodes[newIndex] = QuadNode(fc, -1);
+
+			// Push the last child first so that the first child's subtree is laid out next
+			for (int i = 3; i >= 0; i--) {
+				toProcess.push_back(std::make_pair(node.firstChildIndex + i, fc + i));
+			}
+			continue;
+		}
+
+		const int firstElementNodeIndex = node.firstChildIndex != -1 ? newElementNodes.size() : -1;
+		for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+			const QuadElementNode & elementNode = elementNodes[elementNodeIndex];
+			const int nextIndex = elementNode.nextIndex != -1 ? newElementNodes.size() + 1 : -1;
+			newElementNodes.insert(QuadElementNode(nextIndex, elementNode.elementIndex));
+		}
+		newNodes[newIndex] = QuadNode(firstElementNodeIndex, node.count);
+	}
+
+	nodes = std::move(newNodes);
+	elementNodes = std::move(newElementNodes);
+	freeNodeIndex = -1;
+	cleanupCursor = 0;
+	packedValid = false;
+	clearHeat();
+	rebuildBackReferences();
+	if (changeTracking) {
+		nodeEpochs = std::move(newEpochs);
+		rebuildBlockParents();
+	}
+}
+
+// Finds every leaf in the tree along with the region it owns (see LeafRegion)
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::findAllLeaves(std::vector<LeafRegion>& leaves) const
+{
+	// A node still to be processed and the region it owns
+	struct PendingNode
+	{
+		NodeData data;
+		LeafRegion region;
+	};
+
+	leaves.clear();
+	std::vector<PendingNode> toProcess;
+	toProcess.push_back({ NodeData(0, 0, rootMx, rootMy, rootHx, rootHy),
+		LeafRegion(0, std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::max(), std::numeric_limits<Coord>::max()) });
+
+	while (toProcess.size() > 0) {
+		const PendingNode pending = toProcess.back();
+		toProcess.pop_back();
+		const NodeData & nodeData = pending.data;
+		const LeafRegion & region = pending.region;
+		const QuadNode & node = nodes[nodeData.nodeIndex];
+
+		if (node.count != -1) {
+			leaves.push_back(region);
+			continue;
+		}
+
+		// Split the region at the node's midpoint, the same way findLeaves does
+		const Coord mx = nodeData.mx, my = nodeData.my;
+		const Coord hx = quadHalf(nodeData.hx), hy = quadHalf(nodeData.hy);
+		const int fc = node.firstChildIndex;
+		const Coord leftMx = mx - hx, topMy = my - hy, rightMx = mx + hx, bottomMy = my + hy;
+		const int depth = nodeData.depth + 1;
+		toProcess.push_back({ NodeData(fc + 0, depth, leftMx, topMy, hx, hy), LeafRegion(fc + 0, region.left, region.top, mx, my) });
+		toProcess.push_back({ NodeData(fc + 1, depth, rightMx, topMy, hx, hy), LeafRegion(fc + 1, mx, region.top, region.right, my) });
+		toProcess.push_back({ NodeData(fc + 2, depth, leftMx, bottomMy, hx, hy), LeafRegion(fc + 2, region.left, my, mx, region.bottom) });
+		toProcess.push_back({ NodeData(fc + 3, depth, rightMx, bottomMy, hx, hy), LeafRegion(fc + 3, mx, my, region.right, region.bottom) });
+	}
+}
+
+// Appends the intersecting element pairs found in one leaf to 'pairs'.
+// An element spanning several leaves is stored in each of them, so the same pair can
+// meet in more than one leaf. Rather than marking pairs already found (as tempBuffer
+// does for elements in query), a pair is only reported by the leaf owning the top-left
+// corner of the two AABBs' intersection. Both elements always reach that leaf, and
+// exactly one leaf owns any point, so each pair is reported once with no shared state
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::leafPairs(Scratch& scratch, const LeafRegion& leaf, std::vector<std::pair<int, int>>& pairs) const
+{
+	std::vector<int> & indices = scratch.leafElementIndices;
+	std::vector<Element> & bounds = scratch.leafElementBounds;
+	indices.clear();
+	bounds.clear();
+
+	for (int elementNodeIndex = nodes[leaf.nodeIndex].firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+		const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+		indices.push_back(elementIndex);
+		bounds.push_back(elements[elementIndex]);
+	}
+
+	const int count = static_cast<int>(indices.size());
+	QUADTREE_COUNT(scratch.counters.leavesScanned, 1);
+	QUADTREE_COUNT(scratch.counters.elementsTested, count * (count - 1) / 2);
+	for (int i = 0; i < count; i++) {
+		const Element & a = bounds[i];
+		for (int j = i + 1; j < count; j++) {
+			const Element & b = bounds[j];
+			if (!intersect(a.x1, a.y1, a.x2, a.y2, b.x1, b.y1, b.x2, b.y2)) {
+				continue;
+			}
+			const Coord px = std::max(a.x1, b.x1);
+			const Coord py = std::max(a.y1, b.y1);
+			if (px > leaf.left && px <= leaf.right && py > leaf.top && py <= leaf.bottom) {
+				pairs.push_back(std::make_pair(indices[i], indices[j]));
+			}
+		}
+	}
+}
+
+// Finds every pair of intersecting elements in the tree, writing their element indices
+// to 'pairs' (cleared first). Each pair is reported exactly once, in no particular order.
+// Walks the leaves once and tests the elements sharing each leaf against each other,
+// instead of querying the tree once per element
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::findAllIntersectingPairs(std::vector<std::pair<int, int>>& pairs)
+{
+	pairs.clear();
+	findAllLeaves(pairLeaves);
+	for (int i = 0; i < pairLeaves.size(); i++) {
+		leafPairs(scratch, pairLeaves[i], pairs);
+	}
+}
+
+// Same as above with the leaves split between the pool's threads. Each worker tests
+// chunks of leaves into per-chunk buffers that are then gathered into 'pairs'.
+// The tree must not be modified while this runs
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::findAllIntersectingPairs(ThreadPool& pool, std::vector<std::pair<int, int>>& pairs)
+{
+	// Number of leaves handed to a worker at once
+	const int chunkSize = 16;
+
+	findAllLeaves(pairLeaves);
+	const int numLeaves = static_cast<int>(pairLeaves.size());
+	const int numChunks = (numLeaves + chunkSize - 1) / chunkSize;
+
+	if (workerScratch.size() < pool.size()) {
+		workerScratch.resize(pool.size());
+	}
+	if (pairChunks.size() < numChunks) {
+		pairChunks.resize(numChunks);
+	}
+
+	pool.run(numChunks, [&](const int chunk, const int worker) {
+		std::vector<std::pair<int, int>> & out = pairChunks[chunk];
+		out.clear();
+		const int end = std::min(numLeaves, (chunk + 1) * chunkSize);
+		for (int i = chunk * chunkSize; i < end; i++) {
+			leafPairs(workerScratch[worker], pairLeaves[i], out);
+		}
+	});
+
+	// Gather the chunks, each one starting where the previous one ended
+	std::vector<int> offsets(numChunks + 1, 0);
+	for (int i = 0; i < numChunks; i++) {
+		offsets[i + 1] = offsets[i] + static_cast<int>(pairChunks[i].size());
+	}
+	pairs.resize(offsets[numChunks]);
+	pool.run(numChunks, [&](const int chunk, const int) {
+		std::copy(pairChunks[chunk].begin(), pairChunks[chunk].end(), pairs.begin() + offsets[chunk]);
+	});
+}
+
+// Clean up the tree, collapsing branches whose leaves have become under-full back into a leaf.
+// Branches are processed bottom-up, so a collapse can cascade all the way to the root.
+// The freed child quads are reused by the next subdivision
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::cleanup()
+{
+	packedValid = false;
+	// Collect the branches in depth-first order. Every branch comes before its
+	// descendants, so walking the list backwards visits children before their parent
+	std::vector<int> branches, toProcess;
+	toProcess.push_back(0);
+
+	while (toProcess.size() > 0) {
+		const int nodeIndex = toProcess.back();
+		toProcess.pop_back();
+		const QuadNode & node = nodes[nodeIndex];
+
+		if (node.count == -1) {
+			branches.push_back(nodeIndex);
+			for (int i = 0; i < 4; i++) {
+				toProcess.push_back(node.firstChildIndex + i);
+			}
+		}
+	}
+
+	for (int i = static_cast<int>(branches.size()) - 1; i >= 0; i--) {
+		collapse(branches[i]);
+	}
+}
+
+// Runs a slice of cleanup, returning once the time budget is spent. Meant to be called
+// once per tick to keep the tree compact under churn without a full cleanup pause.
+// Nodes are scanned in index order from where the previous slice stopped, collapsing
+// branches whose children are all leaves; a parent scanned before its children were
+// collapsed is picked up on the next pass. Returns true when a pass over all nodes completes
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::cleanup(const std::chrono::nanoseconds budget)
+{
+	packedValid = false;
+	const auto deadline = std::chrono::steady_clock::now() + budget;
+
+	// Number of nodes scanned between checks of the clock
+	const int checkInterval = 64;
+
+	while (true) {
+		for (int i = 0; i < checkInterval; i++) {
+			if (cleanupCursor >= nodes.size()) {
+				cleanupCursor = 0;
+				return true;
+			}
+			collapse(cleanupCursor++);
+		}
+		if (std::chrono::steady_clock::now() >= deadline) {
+			return false;
+		}
+	}
+}
+
+// Turns a branch whose 4 children are leaves back into a leaf, if the distinct elements
+// held by the children fit in half a leaf. Collapsing only at half capacity leaves room
+// for inserts before the leaf splits again, so a node on the boundary doesn't thrash.
+// With a split policy the policy decides instead, on all the distinct elements.
+// Returns true if the branch was collapsed
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::collapse(const int nodeIndex)
+{
+	const QuadNode & node = nodes[nodeIndex];
+	if (node.count != -1) {
+		return false;
+	}
+
+	const int fc = node.firstChildIndex;
+	for (int i = 0; i < 4; i++) {
+		if (nodes[fc + i].count == -1) {
+			return false;
+		}
+	}
+
+	// Count the distinct elements of the children. An element spanning several children
+	// is stored in each of them, so they are marked in tempBuffer as in query
+	std::vector<bool> & tempBuffer = scratch.tempBuffer;
+	std::vector<int> & found = scratch.clearList;
+	if (tempBuffer.size() < elements.size()) {
+		tempBuffer.assign(elements.size(), false);
+	}
+	found.clear();
+
+	const int maxCollapsedElements = splitPolicy == nullptr ? leafCapacity() / 2 : std::numeric_limits<int>::max();
+	for (int i = 0; i < 4 && found.size() <= maxCollapsedElements; i++) {
+		for (int elementNodeIndex = nodes[fc + i].firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+			if (!tempBuffer[elementIndex]) {
+				tempBuffer[elementIndex] = true;
+				found.push_back(elementIndex);
+			}
+		}
+	}
+	for (int i = 0; i < found.size(); i++) {
+		tempBuffer[found[i]] = false;
+	}
+	if (found.size() > maxCollapsedElements) {
+		found.clear();
+		return false;
+	}
+
+	// The branch's own heat is what it gathered as a leaf, so a leaf the policy split
+	// for being hot isn't merged straight back for its new children being cold
+	if (splitPolicy != nullptr) {
+		QuadLeafInfo info;
+		info.depth = -1;
+		info.count = static_cast<int>(found.size());
+		info.queryHits = heat(nodeIndex);
+		for (int i = 0; i < 4; i++) {
+			info.childCounts[i] = nodes[fc + i].count;
+			info.queryHits += heat(fc + i);
+		}
+		for (int i = 0; i < found.size(); i++) {
+			const Element & e = elements[found[i]];
+			info.elementWidth += static_cast<double>(e.x2) - e.x1;
+			info.elementHeight += static_cast<double>(e.y2) - e.y1;
+		}
+		if (info.count > 0) {
+			info.elementWidth /= info.count;
+			info.elementHeight /= info.count;
+		}
+		if (!splitPolicy->merge(info)) {
+			found.clear();
+			return false;
+		}
+	}
+
+	// Release the children's element nodes and free the children
+	for (int i = 0; i < 4; i++) {
+		int elementNodeIndex = nodes[fc + i].firstChildIndex;
+		while (elementNodeIndex != -1) {
+			const int nextIndex = elementNodes[elementNodeIndex].nextIndex;
+			unlinkDuplicate(elementNodeIndex);
+			elementNodes.erase(elementNodeIndex);
+			elementNodeIndex = nextIndex;
+		}
+	}
+	freeChildren(fc);
+
+	// Make this node the leaf holding the elements
+	int firstElementNodeIndex = -1;
+	for (int i = 0; i < found.size(); i++) {
+		firstElementNodeIndex = elementNodes.insert(QuadElementNode(firstElementNodeIndex, found[i]));
+		linkElementNode(nodeIndex, firstElementNodeIndex);
+	}
+	nodes[nodeIndex] = QuadNode(firstElementNodeIndex, static_cast<int>(found.size()));
+	found.clear();
+	QUADTREE_COUNT(scratch.counters.collapses, 1);
+	return true;
+}
+
+// Returns the index of 4 contiguous empty leaves, reusing a freed block if there is one.
+// Blocks start at multiples of 4, so with 8-byte nodes a block fills half a cache line
+// when the nodes array is 32-byte aligned, as HugePageAllocator's large blocks are
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+int BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::allocateChildren()
+{
+	if (freeNodeIndex != -1) {
+		const int firstChildIndex = freeNodeIndex;
+		freeNodeIndex = nodes[firstChildIndex].firstChildIndex;
+		nodes[firstChildIndex].firstChildIndex = -1;
+		return firstChildIndex;
+	}
+
+	// Nodes are never erased from the FreeList one at a time, so these are appended contiguously
+	const int firstChildIndex = nodes.insert(QuadNode(-1, 0));
+	nodes.insert(QuadNode(-1, 0));
+	nodes.insert(QuadNode(-1, 0));
+	nodes.insert(QuadNode(-1, 0));
+	return firstChildIndex;
+}
+
+// Pushes 4 contiguous child nodes onto the free block list. They are left as empty
+// leaves, so anything scanning the nodes array (the incremental cleanup) skips them
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::freeChildren(const int firstChildIndex)
+{
+	for (int i = 0; i < 4; i++) {
+		nodes[firstChildIndex + i] = QuadNode(-1, 0);
+	}
+	nodes[firstChildIndex].firstChildIndex = freeNodeIndex;
+	freeNodeIndex = firstChildIndex;
+}
+
+// Insert an element into a node
+// Takes the fields of a NodeData object and an index to the element being inserted
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::nodeInsert(const int index, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy, const int elementIndex)
+{
+	const Coord x1 = elements[elementIndex].x1;
+	const Coord y1 = elements[elementIndex].y1;
+	const Coord x2 = elements[elementIndex].x2;
+	const Coord y2 = elements[elementIndex].y2;
+
+	// A local list is needed here as leafInsert may call back into nodeInsert when a leaf is split
+	std::vector<NodeData> leaves;
+	findLeaves(leaves, scratch, index, depth, mx, my, hx, hy, x1, y1, x2, y2);
+
+	for (int i = 0; i < leaves.size(); i++) {
+		leafInsert(leaves[i].nodeIndex, leaves[i].depth, leaves[i].mx, leaves[i].my, leaves[i].hx, leaves[i].hy, elementIndex);
+	}
+}
+
+// Insert a Quad Element into a particular leaf. Subdivide and reinsert if the leaf is full
+// Takes the fields of a NodeData object and an index to the element being inserted
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::leafInsert(const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy, const int elementIndex)
+{
+	// Insert the element into the beginning of the leaf's linked list of elements as the first child
+
+	if (changeTracking) {
+		markChanged(nodeIndex);
+	}
+
+	// Store the original first child (first child is an element index as the node is a leaf)
+	const int prevFirstChildIndex = nodes[nodeIndex].firstChildIndex;
+	QuadNode & node = nodes[nodeIndex];
+	// Replace the first child with the new QuadElementNode
+	node.firstChildIndex = elementNodes.insert(QuadElementNode(prevFirstChildIndex, elementIndex));
+	linkElementNode(nodeIndex, node.firstChildIndex);
+
+	// Subdivide if leaf is full. A split policy is asked each time the leaf reaches the
+	// capacity times a power of 2, the list already holding the new element
+	const int count = node.count;
+	bool split;
+	if (splitPolicy == nullptr) {
+		split = count == leafCapacity() && depth < depthLimit();
+	}
+	else {
+		const int multiple = count / leafCapacity();
+		split = count >= leafCapacity() && count % leafCapacity() == 0 && (multiple & (multiple - 1)) == 0 && depth < depthLimit()
+			&& policySplit(nodeIndex, depth, mx, my, hx, hy);
+	}
+
+	if (split) {
+		splitLeaf(nodeIndex, depth, mx, my, hx, hy);
+	}
+	else {
+		node.count++;
+	}
+}
+
+// Turns a leaf into a branch, handing its elements down to the 4 new children
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::splitLeaf(const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy)
+{
+	QuadNode & node = nodes[nodeIndex];
+
+	//Transfer elements from the leaf node to a list of elements
+	std::vector<int> tempElements;
+
+	// While the leaf still contains an element
+	while (node.firstChildIndex != -1) {
+		const int elementNodeIndex = node.firstChildIndex;
+
+		const int nextElementNodeIndex = elementNodes[elementNodeIndex].nextIndex;
+		const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+
+		// Pop off the element node from the leaf and remove it from the quadtree
+		node.firstChildIndex = nextElementNodeIndex;
+		unlinkDuplicate(elementNodeIndex);
+		elementNodes.erase(elementNodeIndex);
+
+		// Insert the element into the temporary list
+		tempElements.push_back(elementIndex);
+	}
+
+	QUADTREE_COUNT(scratch.counters.splits, 1);
+
+	// Allocate 4 empty child nodes and turn the current node into a branch.
+	// Allocating may grow the nodes array, so the node is looked up again afterwards
+	const int firstChildIndex = allocateChildren();
+	nodes[nodeIndex].firstChildIndex = firstChildIndex;
+	nodes[nodeIndex].count = -1;
+
+	// The children hold the leaf's elements, so they start at the leaf's epoch, the latest
+	// change among them. A collapse needs nothing, as a branch's epoch covers its children
+	if (changeTracking) {
+		if (nodeEpochs.size() < nodes.size()) {
+			nodeEpochs.resize(nodes.size(), 0);
+			blockParents.resize(nodes.size() / 4, -1);
+		}
+		blockParents[firstChildIndex / 4] = nodeIndex;
+		for (int i = 0; i < 4; i++) {
+			nodeEpochs[firstChildIndex + i] = nodeEpochs[nodeIndex];
+		}
+	}
+
+	// Transfer the elements in the former leaf node to its new children
+	for (int i = 0; i < tempElements.size(); ++i) {
+		nodeInsert(nodeIndex, depth, mx, my, hx, hy, tempElements[i]);
+	}
+}
+
+// Gathers the leaf's QuadLeafInfo from its element list and asks the split policy
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::policySplit(const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy) const
+{
+	QuadLeafInfo info;
+	info.depth = depth;
+	info.cellWidth = 2.0 * hx;
+	info.cellHeight = 2.0 * hy;
+	info.queryHits = heat(nodeIndex);
+	for (int elementNodeIndex = nodes[nodeIndex].firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+		const Element & e = elements[elementNodes[elementNodeIndex].elementIndex];
+		addToLeafInfo(info, mx, my, e.x1, e.y1, e.x2, e.y2);
+	}
+	if (info.count > 0) {
+		info.elementWidth /= info.count;
+		info.elementHeight /= info.count;
+	}
+	return splitPolicy->split(info);
+}
+
+// Counts an element of a node centred on (mx, my) in the node's QuadLeafInfo, in the
+// children it overlaps under the rule of findLeaves. The sizes are summed, to be divided
+// by the count once every element is in
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::addToLeafInfo(QuadLeafInfo& info, const Coord mx, const Coord my, const Coord x1, const Coord y1, const Coord x2, const Coord y2)
+{
+	const bool left = x1 <= mx, right = x2 > mx;
+	const bool top = y1 <= my, bottom = y2 > my;
+	info.childCounts[0] += top & left;
+	info.childCounts[1] += top & right;
+	info.childCounts[2] += bottom & left;
+	info.childCounts[3] += bottom & right;
+	info.elementWidth += static_cast<double>(x2) - x1;
+	info.elementHeight += static_cast<double>(y2) - y1;
+	info.count++;
+}
+
+// Query heat of a node, summed over the tree's scratch and the pool workers'
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+double BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::heat(const int nodeIndex) const
+{
+	double hits = nodeIndex < scratch.leafHits.size() ? scratch.leafHits[nodeIndex] : 0;
+	for (int i = 0; i < workerScratch.size(); i++) {
+		if (nodeIndex < workerScratch[i].leafHits.size()) {
+			hits += workerScratch[i].leafHits[nodeIndex];
+		}
+	}
+	return hits;
+}
+
+// Drops the recorded heat, for when node indices are reassigned
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::clearHeat()
+{
+	scratch.leafHits.clear();
+	for (int i = 0; i < workerScratch.size(); i++) {
+		workerScratch[i].leafHits.clear();
+	}
+}
+
+// Finds all leaves within a certain AABB starting from a particular node (NodeData)
+// x1, y1, x2, y2 = top-left and bottom-right of the AABB. NodeData is the first node to check.
+// After checking the first node, traverse through all child nodes and write all the relevant leaves to 'leaves'
+// Takes the fields of a NodeData object and the fields of an AABB
+// 'leaves' is cleared first. The traversal stack is the scratch's nodeStack, so that its capacity is reused between calls
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::findLeaves(std::vector<NodeData>& leaves, Scratch& scratch, const int nodeIndex, const int depth, const Coord mx, const Coord my, const Coord hx, const Coord hy,
+	const Coord x1, const Coord y1, const Coord x2, const Coord y2) const
+{
+	std::vector<NodeData> & toProcess = scratch.nodeStack;
+	leaves.clear();
+	toProcess.clear();
+	toProcess.push_back(NodeData(nodeIndex, depth, mx, my, hx, hy));
+
+	while (toProcess.size() > 0) {
+		const NodeData nodeData = toProcess.back();
+		toProcess.pop_back();
+		QUADTREE_COUNT(scratch.counters.nodesVisited, 1);
+		// If this node is a leaf, insert it to the list.
+		if (nodes[nodeData.nodeIndex].count != -1) {
+			leaves.push_back(nodeData);
+		}
+		else {
+			// Otherwise push the children that intersect the rectangle
+			pushChildren(toProcess, nodeData, x1, y1, x2, y2);
+		}
+	}
+}
+
+// Pushes the children of a branch that intersect the AABB onto 'stack'
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::pushChildren(std::vector<NodeData>& stack, const NodeData& nodeData,
+	const Coord x1, const Coord y1, const Coord x2, const Coord y2) const
+{
+	//Calculate the bounding box of the current node
+	const Coord mx = nodeData.mx, my = nodeData.my;
+	const Coord hx = quadHalf(nodeData.hx), hy = quadHalf(nodeData.hy);
+	const int fc = nodes[nodeData.nodeIndex].firstChildIndex;
+	// Calculate the centers of the 4 children 
+	const Coord leftMx = mx - hx, topMy = my - hy, rightMx = mx + hx, bottomMy = my + hy;
+
+	// Compare the AABB with the four child nodes to check for intersections
+	// Push any intersecting child nodes
+	if (y1 <= my) {
+		if (x1 <= mx)
+			stack.push_back(NodeData(fc + 0, nodeData.depth + 1, leftMx, topMy, hx, hy));
+		if (x2 > mx)
+			stack.push_back(NodeData(fc + 1, nodeData.depth + 1, rightMx, topMy, hx, hy));
+	}
+	if (y2 > my) {
+		if (x1 <= mx)
+			stack.push_back(NodeData(fc + 2, nodeData.depth + 1, leftMx, bottomMy, hx, hy));
+		if (x2 > mx)
+			stack.push_back(NodeData(fc + 3, nodeData.depth + 1, rightMx, bottomMy, hx, hy));
+	}
+}
+
+// Clips the segment from (ax, ay) along (dx, dy), for t from 0 to 1, against an AABB.
+// Returns false if they don't meet, otherwise sets 't' to where the segment enters the
+// AABB, 0 if it starts inside
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::segmentEntry(const double ax, const double ay, const double dx, const double dy,
+	const double left, const double top, const double right, const double bottom, double& t)
+{
+	double enter = 0.0, leave = 1.0;
+	if (dx == 0.0) {
+		if (ax < left || ax > right) {
+			return false;
+		}
+	}
+	else {
+		const double t1 = (left - ax) / dx, t2 = (right - ax) / dx;
+		enter = std::max(enter, std::min(t1, t2));
+		leave = std::min(leave, std::max(t1, t2));
+	}
+	if (dy == 0.0) {
+		if (ay < top || ay > bottom) {
+			return false;
+		}
+	}
+	else {
+		const double t1 = (top - ay) / dy, t2 = (bottom - ay) / dy;
+		enter = std::max(enter, std::min(t1, t2));
+		leave = std::min(leave, std::max(t1, t2));
+	}
+	if (enter > leave) {
+		return false;
+	}
+	t = enter;
+	return true;
+}
+
+// Squared distance from a point to an AABB, 0 if the point is inside it
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+double BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::distanceSquared(const double x, const double y, const double left, const double top, const double right, const double bottom)
+{
+	const double dx = std::max(std::max(left - x, x - right), 0.0);
+	const double dy = std::max(std::max(top - y, y - bottom), 0.0);
+	return dx * dx + dy * dy;
+}
+
+// Makes room in the lists for the given numbers of elements, element nodes and nodes, so
+// that they don't move, and inserts and splits don't stall copying them, until the tree
+// outgrows them. An element is stored once per leaf it overlaps, so small elements need
+// a little more than one element node each. Reserving more than the tree will use mostly
+// costs address space
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::reserve(const int numElements, const int numElementNodes, const int numNodes)
+{
+	elements.reserve(numElements);
+	elementNodes.reserve(numElementNodes);
+	nodes.reserve(numNodes);
+}
+
+// Gives memory back after the tree has shrunk, best after cleanup has collapsed what it
+// can. Free slots at the end of each list are dropped along with the spare capacity.
+// Free slots in the middle stay, as live indices never change, and are reused lowest first
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::shrinkToFit()
+{
+	elements.shrinkToFit();
+	elementNodes.shrinkToFit();
+
+	// Freed node blocks are chained by the tree rather than the list. Erase the blocks at
+	// the end of the list so the list drops them, and chain the rest in index order
+	std::vector<int> blocks;
+	for (int nodeIndex = freeNodeIndex; nodeIndex != -1; nodeIndex = nodes[nodeIndex].firstChildIndex) {
+		blocks.push_back(nodeIndex);
+	}
+	std::sort(blocks.begin(), blocks.end());
+	int end = nodes.size();
+	while (blocks.size() > 0 && blocks.back() == end - 4) {
+		blocks.pop_back();
+		end -= 4;
+	}
+	for (int nodeIndex = nodes.size() - 1; nodeIndex >= end; nodeIndex--) {
+		nodes.erase(nodeIndex);
+	}
+	nodes.shrinkToFit();
+
+	freeNodeIndex = -1;
+	for (int i = static_cast<int>(blocks.size()) - 1; i >= 0; i--) {
+		nodes[blocks[i]].firstChildIndex = freeNodeIndex;
+		freeNodeIndex = blocks[i];
+	}
+}
+
+// Makes this tree a copy of 'other', which must have the same extents. The lists are
+// copied into the memory this tree already has, so a tree recycled as a copy target stops
+// allocating once it is as big as its sources. The query scratch isn't copied
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::copyFrom(const BasicQuadtree& other)
+{
+	maxDepth = other.maxDepth;
+	maxElements = other.maxElements;
+	elements = other.elements;
+	elementNodes = other.elementNodes;
+	nodes = other.nodes;
+	freeNodeIndex = other.freeNodeIndex;
+	cleanupCursor = other.cleanupCursor;
+	splitPolicy = other.splitPolicy;
+	backReferences = other.backReferences;
+	firstElementNodes = other.firstElementNodes;
+	elementNodeLinks = other.elementNodeLinks;
+	changeTracking = other.changeTracking;
+	changeEpoch = other.changeEpoch;
+	historyStart = other.historyStart;
+	nodeEpochs = other.nodeEpochs;
+	blockParents = other.blockParents;
+	elementEpochs = other.elementEpochs;
+	changeLog = other.changeLog;
+	packedValid = other.packedValid;
+	if (packedValid) {
+		packed = other.packed;
+		packedKernel = other.packedKernel;
+	}
+}
+
+// Hands split and merge decisions to a policy, or back to the leaf capacity with nullptr.
+// The policy isn't owned and must outlive its use by the tree. Leaves already in the tree
+// keep their shape until insert, cleanup or rebalance next asks about them; build shapes
+// the whole tree with it
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::setSplitPolicy(const IQuadSplitPolicy* policy)
+{
+	splitPolicy = policy;
+}
+
+// Starts or stops recording which leaves queries scan, for the split policy to weigh
+// leaves by. Queries through the tree's own scratch and queryBatch record into the tree;
+// a caller's scratch records while its trackLeafHits is set, which the tree doesn't read.
+// Costs a counter increment per leaf scanned
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::trackQueryHeat(const bool enabled)
+{
+	trackHeat = enabled;
+	scratch.trackLeafHits = enabled;
+	for (int i = 0; i < workerScratch.size(); i++) {
+		workerScratch[i].trackLeafHits = enabled;
+	}
+	if (!enabled) {
+		clearHeat();
+	}
+}
+
+// Self-tuning pass: asks the split policy about every branch, bottom-up, and then every
+// leaf, merging and splitting as it says, and halves the query heat so that the shape
+// follows where queries go now. Meant to be called every so often, e.g. once a second,
+// while query heat is tracked, so that hot regions get finer leaves and cold ones coarser.
+// Takes time linear in the size of the tree. Returns the number of merges and splits made,
+// 0 without a split policy
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+int BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::rebalance()
+{
+	if (splitPolicy == nullptr) {
+		return 0;
+	}
+	packedValid = false;
+	int changes = 0;
+
+	// Merges first, children before their parents as in cleanup
+	std::vector<int> branches, toProcess;
+	toProcess.push_back(0);
+	while (toProcess.size() > 0) {
+		const int nodeIndex = toProcess.back();
+		toProcess.pop_back();
+		const QuadNode & node = nodes[nodeIndex];
+		if (node.count == -1) {
+			branches.push_back(nodeIndex);
+			for (int i = 0; i < 4; i++) {
+				toProcess.push_back(node.firstChildIndex + i);
+			}
+		}
+	}
+	for (int i = static_cast<int>(branches.size()) - 1; i >= 0; i--) {
+		changes += collapse(branches[i]);
+	}
+
+	// Then splits, of the leaves found before any of them is split. Elements handed down
+	// to the new children split those further by the insert rule
+	std::vector<NodeData> leaves;
+	findLeaves(leaves, scratch, 0, 0, rootMx, rootMy, rootHx, rootHy,
+		std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::lowest(), std::numeric_limits<Coord>::max(), std::numeric_limits<Coord>::max());
+	for (int i = 0; i < leaves.size(); i++) {
+		const NodeData & leaf = leaves[i];
+		if (leaf.depth < depthLimit() && nodes[leaf.nodeIndex].count > 1 && policySplit(leaf.nodeIndex, leaf.depth, leaf.mx, leaf.my, leaf.hx, leaf.hy)) {
+			splitLeaf(leaf.nodeIndex, leaf.depth, leaf.mx, leaf.my, leaf.hx, leaf.hy);
+			changes++;
+		}
+	}
+
+	for (int i = 0; i < scratch.leafHits.size(); i++) {
+		scratch.leafHits[i] >>= 1;
+	}
+	for (int i = 0; i < workerScratch.size(); i++) {
+		for (int j = 0; j < workerScratch[i].leafHits.size(); j++) {
+			workerScratch[i].leafHits[j] >>= 1;
+		}
+	}
+	return changes;
+}
+
+// Starts or stops keeping back-references from each element to its element nodes, which
+// also makes the leaves' lists doubly linked. While they are kept, remove is O(duplicates)
+// with no descent and no walk of the leaves' lists, and update finds the element's old
+// leaves without a descent. They cost 12 bytes per element node and 4 per element, and
+// a little time on every insert and split. Turning them on builds them in O(element nodes)
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::keepBackReferences(const bool enabled)
+{
+	if (enabled == backReferences) {
+		return;
+	}
+	backReferences = enabled;
+	rebuildBackReferences();
+	if (!enabled) {
+		firstElementNodes.shrink_to_fit();
+		elementNodeLinks.shrink_to_fit();
+	}
+}
+
+// Starts or stops tracking changes for queryChangedSince. Starting begins a new history
+// at the current epoch. Tracking costs a walk up from each leaf an insert or update
+// touches, stopping at the first node already marked in the same epoch, 24 bytes per
+// element, 9 per node and a log entry per removal and move until discarded
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::trackChanges(const bool enabled)
+{
+	if (enabled == changeTracking) {
+		return;
+	}
+	changeTracking = enabled;
+	resetChanges();
+	if (!enabled) {
+		nodeEpochs.shrink_to_fit();
+		blockParents.shrink_to_fit();
+		elementEpochs.shrink_to_fit();
+		changeLog.shrink_to_fit();
+	}
+}
+
+// Returns the epoch of the latest change, to pass to queryChangedSince next time
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+std::uint64_t BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::epoch() const
+{
+	return changeEpoch;
+}
+
+// Finds what changed in the specified rectangle after epoch 'since', typically the
+// epoch() of the consumer's previous query, see Changes. Returns false, with nothing
+// found, if changes aren't tracked or the history no longer reaches back to 'since'
+// (after build, load, map or discardChangesBefore), in which case the consumer should
+// fall back to a full query
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::queryChangedSince(Changes& changes, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const std::uint64_t since)
+{
+	return queryChangedSince(scratch, changes, x1, y1, x2, y2, since);
+}
+
+// Same as above but with caller-supplied scratch, so threads may run it concurrently as
+// long as nothing modifies the tree.
+// Only nodes changed after 'since' are descended into, and in their leaves only elements
+// changed after it are tested, so the time taken grows with the changes in the rectangle
+// rather than the elements in it. Removals and moves out of the rectangle come from the
+// log, which is searched for the first entry after 'since'
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::queryChangedSince(Scratch& scratch, Changes& changes, const Coord qx1, const Coord qy1, const Coord qx2, const Coord qy2, const std::uint64_t since) const
+{
+	changes.added.clear();
+	changes.moved.clear();
+	changes.removed.clear();
+	if (!changeTracking || since < historyStart) {
+		return false;
+	}
+
+	std::vector<bool> & tempBuffer = scratch.tempBuffer;
+	std::vector<int> & clearList = scratch.clearList;
+	if (tempBuffer.size() < elements.size()) {
+		tempBuffer.assign(elements.size(), false);
+	}
+
+	// Elements inserted after 'since' were never seen by the consumer, so their records are
+	// skipped. The first record after 'since' of any other element holds it as the consumer
+	// saw it, so only that record decides whether the element was in the rectangle. If it
+	// was, it is reported removed if it has since been removed, or its index reused, and
+	// moved otherwise. Only one element seen by the consumer can have had each index
+	auto first = std::upper_bound(changeLog.begin(), changeLog.end(), since, [](const std::uint64_t epoch, const ChangeRecord& record) {
+		return epoch < record.epoch;
+	});
+	for (auto it = first; it != changeLog.end(); ++it) {
+		const ChangeRecord & record = *it;
+		const int elementIndex = record.elementIndex;
+		if (record.inserted > since || tempBuffer[elementIndex]) {
+			continue;
+		}
+		tempBuffer[elementIndex] = true;
+		clearList.push_back(elementIndex);
+		const Element & e = record.element;
+		if (!intersect(qx1, qy1, qx2, qy2, e.x1, e.y1, e.x2, e.y2)) {
+			continue;
+		}
+		if (record.removed || elementEpochs[elementIndex].inserted != record.inserted) {
+			changes.removed.push_back(std::make_pair(elementIndex, e));
+		}
+		else {
+			changes.moved.push_back(elementIndex);
+		}
+	}
+
+	// Only the elements reported moved stay marked, so the walk below skips them
+	for (int i = 0; i < clearList.size(); i++) {
+		tempBuffer[clearList[i]] = false;
+	}
+	clearList.clear();
+	for (int i = 0; i < changes.moved.size(); i++) {
+		tempBuffer[changes.moved[i]] = true;
+		clearList.push_back(changes.moved[i]);
+	}
+
+	std::vector<NodeData> & stack = scratch.nodeStack;
+	stack.clear();
+	if (nodeEpochs[0] > since) {
+		stack.push_back(NodeData(0, 0, rootMx, rootMy, rootHx, rootHy));
+	}
+	while (stack.size() > 0) {
+		const NodeData nodeData = stack.back();
+		stack.pop_back();
+		const QuadNode & node = nodes[nodeData.nodeIndex];
+
+		// Push the overlapping children, then drop those unchanged since the epoch
+		if (node.count == -1) {
+			std::size_t kept = stack.size();
+			pushChildren(stack, nodeData, qx1, qy1, qx2, qy2);
+			for (std::size_t i = kept; i < stack.size(); i++) {
+				if (nodeEpochs[stack[i].nodeIndex] > since) {
+					stack[kept++] = stack[i];
+				}
+			}
+			stack.erase(stack.begin() + kept, stack.end());
+			continue;
+		}
+
+		for (int elementNodeIndex = node.firstChildIndex; elementNodeIndex != -1; elementNodeIndex = elementNodes[elementNodeIndex].nextIndex) {
+			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
+			const ElementEpochs & epochs = elementEpochs[elementIndex];
+			const Element & e = elements[elementIndex];
+			if (epochs.changed > since && !tempBuffer[elementIndex] && intersect(qx1, qy1, qx2, qy2, e.x1, e.y1, e.x2, e.y2)) {
+				tempBuffer[elementIndex] = true;
+				clearList.push_back(elementIndex);
+				if (epochs.inserted > since) {
+					changes.added.push_back(elementIndex);
+				}
+				else {
+					changes.moved.push_back(elementIndex);
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < clearList.size(); i++) {
+		tempBuffer[clearList[i]] = false;
+	}
+	clearList.clear();
+	return true;
+}
+
+// Drops the log entries of changes up to and including epoch 'since', once no consumer
+// will ask for changes since an earlier epoch. Queries since an earlier epoch fail after
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::discardChangesBefore(const std::uint64_t since)
+{
+	if (since <= historyStart) {
+		return;
+	}
+	historyStart = std::min(since, changeEpoch);
+	auto last = std::upper_bound(changeLog.begin(), changeLog.end(), historyStart, [](const std::uint64_t epoch, const ChangeRecord& record) {
+		return epoch < record.epoch;
+	});
+	changeLog.erase(changeLog.begin(), last);
+}
+
+// Stamps a leaf and the nodes above it with the current epoch. A node already stamped
+// means the nodes above it are too
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::markChanged(int nodeIndex)
+{
+	while (nodeEpochs[nodeIndex] != changeEpoch) {
+		nodeEpochs[nodeIndex] = changeEpoch;
+		if (nodeIndex == 0) {
+			break;
+		}
+		nodeIndex = blockParents[nodeIndex / 4];
+	}
+}
+
+// Logs an element as it is before being removed or moved
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::logChange(const int elementIndex, const bool removed)
+{
+	changeLog.push_back(ChangeRecord(changeEpoch, elementEpochs[elementIndex].inserted, elementIndex, removed, elements[elementIndex]));
+}
+
+// Finds the parent of every block of children, and sizes nodeEpochs to the nodes
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::rebuildBlockParents()
+{
+	nodeEpochs.resize(nodes.size(), 0);
+	blockParents.assign(nodes.size() / 4, -1);
+	std::vector<int> toProcess(1, 0);
+	while (toProcess.size() > 0) {
+		const int nodeIndex = toProcess.back();
+		toProcess.pop_back();
+		const QuadNode & node = nodes[nodeIndex];
+		if (node.count == -1) {
+			blockParents[node.firstChildIndex / 4] = nodeIndex;
+			for (int i = 0; i < 4; i++) {
+				toProcess.push_back(node.firstChildIndex + i);
+			}
+		}
+	}
+}
+
+// Starts a new history after the tree was replaced wholesale, with every element and
+// node changed in a new epoch. Clears the tracking state if changes aren't tracked
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::resetChanges()
+{
+	changeLog.clear();
+	if (!changeTracking) {
+		nodeEpochs.clear();
+		blockParents.clear();
+		elementEpochs.clear();
+		return;
+	}
+
+	changeEpoch++;
+	historyStart = changeEpoch;
+	elementEpochs.assign(elements.size(), ElementEpochs(changeEpoch, changeEpoch));
+	nodeEpochs.assign(nodes.size(), changeEpoch);
+	rebuildBlockParents();
+}
+
+// Returns the bytes allocated for the elements, element nodes and nodes. Back-references
+// and change tracking are counted with the list they index, the change log with the elements
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+QuadMemoryUsage BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::memoryUsage() const
+{
+	return QuadMemoryUsage(elements.bytes() + firstElementNodes.capacity() * sizeof(int) + elementEpochs.capacity() * sizeof(ElementEpochs) + changeLog.capacity() * sizeof(ChangeRecord),
+		elementNodes.bytes() + elementNodeLinks.capacity() * sizeof(QuadElementNodeLink),
+		nodes.bytes() + nodeEpochs.capacity() * sizeof(std::uint64_t) + blockParents.capacity() * sizeof(int));
+}
+
+// Describes the tree's type, extents and lists in a snapshot header, with no checksum
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+QuadSnapshotHeader BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::snapshotHeader() const
+{
+	QuadSnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "QUADTREE", sizeof(header.magic));
+	header.version = 2;
+	header.byteOrder = 1;
+	header.coordSize = sizeof(Coord);
+	header.payloadSize = sizeof(Payload);
+	header.floatingPoint = std::is_floating_point<Coord>::value;
+	header.elementSlotSize = static_cast<std::uint32_t>(elements.slotSize());
+	header.elementNodeSlotSize = static_cast<std::uint32_t>(elementNodes.slotSize());
+	header.nodeSlotSize = static_cast<std::uint32_t>(nodes.slotSize());
+	header.maxElements = maxElements;
+	header.maxDepth = maxDepth;
+	header.freeNodeIndex = freeNodeIndex;
+	header.elementCount = elements.size();
+	header.elementFirstFree = elements.firstFree();
+	header.elementNodeCount = elementNodes.size();
+	header.elementNodeFirstFree = elementNodes.firstFree();
+	header.nodeCount = nodes.size();
+	header.nodeFirstFree = nodes.firstFree();
+	header.rootMx = rootMx;
+	header.rootMy = rootMy;
+	header.rootHx = rootHx;
+	header.rootHy = rootHy;
+	return header;
+}
+
+// Returns true if a snapshot header is intact, was written by a tree of this type and
+// extents, and its list sizes and limits make sense
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::matchesSnapshot(const QuadSnapshotHeader& header) const
+{
+	const QuadSnapshotHeader own = snapshotHeader();
+	if (header.headerChecksum != quadSnapshotHeaderChecksum(header)) {
+		return false;
+	}
+	const std::int32_t counts[3] = { header.elementCount, header.elementNodeCount, header.nodeCount };
+	const std::int32_t firstFree[3] = { header.elementFirstFree, header.elementNodeFirstFree, header.nodeFirstFree };
+	for (int i = 0; i < 3; i++) {
+		if (counts[i] < 0 || firstFree[i] < -1 || firstFree[i] >= counts[i]) {
+			return false;
+		}
+	}
+	return std::memcmp(header.magic, own.magic, sizeof(own.magic)) == 0 && header.version == own.version && header.byteOrder == own.byteOrder
+		&& header.coordSize == own.coordSize && header.payloadSize == own.payloadSize && header.floatingPoint == own.floatingPoint
+		&& header.elementSlotSize == own.elementSlotSize && header.elementNodeSlotSize == own.elementNodeSlotSize && header.nodeSlotSize == own.nodeSlotSize
+		&& header.rootMx == own.rootMx && header.rootMy == own.rootMy && header.rootHx == own.rootHx && header.rootHy == own.rootHy
+		&& header.nodeCount > 0 && header.freeNodeIndex >= -1 && header.freeNodeIndex < header.nodeCount
+		&& header.maxElements >= 1 && header.maxDepth >= 0;
+}
+
+// Writes a snapshot of the tree to 'out' (see QuadSnapshotHeader), to be restored by
+// load or queried in place by map. The lists are written as they are in memory, free
+// slots included, so the snapshot is about memoryUsage() in size and takes no more
+// than a copy to write. Returns false if writing failed
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::save(std::ostream& out) const
+{
+	static_assert(std::is_trivially_copyable<Element>::value, "snapshots copy elements byte for byte");
+
+	QuadSnapshotHeader header = snapshotHeader();
+	const void* sections[3] = { elements.slots(), elementNodes.slots(), nodes.slots() };
+	const std::size_t sectionSizes[3] = {
+		elements.size() * elements.slotSize(),
+		elementNodes.size() * elementNodes.slotSize(),
+		nodes.size() * nodes.slotSize()
+	};
+	header.headerChecksum = quadSnapshotHeaderChecksum(header);
+	header.checksum = header.headerChecksum;
+	for (int i = 0; i < 3; i++) {
+		header.checksum = quadChecksum(header.checksum, sections[i], sectionSizes[i]);
+	}
+
+	const char padding[QuadSnapshotHeader::alignment] = {};
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	std::size_t offset = sizeof(header);
+	for (int i = 0; i < 3; i++) {
+		const std::size_t start = quadSnapshotAlign(offset);
+		out.write(padding, start - offset);
+		out.write(static_cast<const char*>(sections[i]), sectionSizes[i]);
+		offset = start + sectionSizes[i];
+	}
+	return static_cast<bool>(out);
+}
+
+// Replaces the contents of the tree with a snapshot written by save. Returns false if
+// the snapshot is for another type of tree or other extents, leaving the tree as it
+// was, or if it is damaged or cut short, leaving the tree empty
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::load(std::istream& in)
+{
+	QuadSnapshotHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || !matchesSnapshot(header)) {
+		return false;
+	}
+
+	// Read each list straight into its slots
+	void* sections[3] = {
+		elements.resizeSlots(header.elementCount, header.elementFirstFree),
+		elementNodes.resizeSlots(header.elementNodeCount, header.elementNodeFirstFree),
+		nodes.resizeSlots(header.nodeCount, header.nodeFirstFree)
+	};
+	const std::size_t sectionSizes[3] = {
+		header.elementCount * elements.slotSize(),
+		header.elementNodeCount * elementNodes.slotSize(),
+		header.nodeCount * nodes.slotSize()
+	};
+	std::uint64_t checksum = header.headerChecksum;
+	std::size_t offset = sizeof(header);
+	for (int i = 0; i < 3; i++) {
+		const std::size_t start = quadSnapshotAlign(offset);
+		in.ignore(start - offset);
+		in.read(static_cast<char*>(sections[i]), sectionSizes[i]);
+		checksum = quadChecksum(checksum, sections[i], sectionSizes[i]);
+		offset = start + sectionSizes[i];
+	}
+	if (!in || checksum != header.checksum) {
+		build(std::vector<Element>());
+		return false;
+	}
+
+	maxElements = header.maxElements;
+	maxDepth = header.maxDepth;
+	freeNodeIndex = header.freeNodeIndex;
+	cleanupCursor = 0;
+	packedValid = false;
+	clearHeat();
+	rebuildBackReferences();
+	resetChanges();
+	return true;
+}
+
+// Points the tree at a snapshot in memory, typically a file opened with MappedFile, and
+// queries it in place with nothing copied. Several processes mapping the same file share
+// one copy of it in the page cache. The snapshot must stay mapped while the tree uses it,
+// and the tree is read-only: only query, queryVisit, queryBatch, nearest, withinRadius,
+// findAllIntersectingPairs, pack and the diagnostics may be called until build or load
+// replaces its contents, or reserve or shrinkToFit copies them into memory of the tree's
+// own. 'snapshot' must be aligned like memory from malloc. Checking
+// the checksum reads the whole snapshot, so a trusted file can skip it with verify false.
+// Returns false, leaving the tree as it was, if the snapshot doesn't match the tree, is
+// cut short or fails the checksum
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::map(const void* snapshot, const std::size_t size, const bool verify)
+{
+	QuadSnapshotHeader header;
+	if (snapshot == nullptr || reinterpret_cast<std::uintptr_t>(snapshot) % alignof(std::max_align_t) != 0 || size < sizeof(header)) {
+		return false;
+	}
+	std::memcpy(&header, snapshot, sizeof(header));
+	if (!matchesSnapshot(header)) {
+		return false;
+	}
+
+	const char* bytes = static_cast<const char*>(snapshot);
+	const std::size_t sectionSizes[3] = {
+		header.elementCount * elements.slotSize(),
+		header.elementNodeCount * elementNodes.slotSize(),
+		header.nodeCount * nodes.slotSize()
+	};
+	const char* sections[3];
+	std::uint64_t checksum = header.headerChecksum;
+	std::size_t offset = sizeof(header);
+	for (int i = 0; i < 3; i++) {
+		const std::size_t start = quadSnapshotAlign(offset);
+		if (start > size || sectionSizes[i] > size - start) {
+			return false;
+		}
+		sections[i] = bytes + start;
+		if (verify) {
+			checksum = quadChecksum(checksum, sections[i], sectionSizes[i]);
+		}
+		offset = start + sectionSizes[i];
+	}
+	if (verify && checksum != header.checksum) {
+		return false;
+	}
+
+	elements.attach(sections[0], header.elementCount, header.elementFirstFree);
+	elementNodes.attach(sections[1], header.elementNodeCount, header.elementNodeFirstFree);
+	nodes.attach(sections[2], header.nodeCount, header.nodeFirstFree);
+	maxElements = header.maxElements;
+	maxDepth = header.maxDepth;
+	freeNodeIndex = header.freeNodeIndex;
+	cleanupCursor = 0;
+	packedValid = false;
+	clearHeat();
+	rebuildBackReferences();
+	resetChanges();
+	return true;
+}
+
+// Gathers the node counts and histograms of stats() from a traversal of the tree
+template <class Tree, class Coord>
+class QuadStatsVisitor : public IBasicQuadtreeVisitor<Tree, Coord>
+{
+private:
+	QuadStats& stats;
+
+public:
+	QuadStatsVisitor(QuadStats& stats) : stats(stats) {
+	}
+
+	void branch(const Tree& /*quadtree*/, const int /*node*/, const int /*depth*/, const Coord /*mx*/, const Coord /*my*/, const Coord /*hx*/, const Coord /*hy*/) const {
+		stats.branches++;
+	}
+
+	void leaf(const Tree& quadtree, const int node, const int depth, const Coord /*mx*/, const Coord /*my*/, const Coord /*hx*/, const Coord /*hy*/) const {
+		const int count = quadtree.nodes[node].count;
+		stats.leaves++;
+		stats.emptyLeaves += count == 0;
+		stats.depth = std::max(stats.depth, depth);
+		stats.elementNodes += count;
+		if (stats.leavesByDepth.size() <= depth) {
+			stats.leavesByDepth.resize(depth + 1, 0);
+		}
+		stats.leavesByDepth[depth]++;
+		if (stats.leavesByCount.size() <= count) {
+			stats.leavesByCount.resize(count + 1, 0);
+		}
+		stats.leavesByCount[count]++;
+	}
+};
+
+// A lazy query over the elements found in a rectangle, made by Quadtree::queryCursor.
+// Each call to next walks the tree only as far as the next element found, so a caller
+// that wants the first hit or the first few stops without visiting the rest of the tree.
+// Iterated as a range, once, it yields element indices:
+//   for (int elementIndex : tree.queryCursor(x1, y1, x2, y2, -1)) { ... }
+// The cursor uses its scratch until destroyed, so a scratch serves one cursor at a time
+// and can't be used for other queries meanwhile. The tree must not change while it lives
+template <class Tree, class Coord>
+class BasicQuadQueryCursor
+{
+public:
+	typedef typename Tree::Element Element;
+	typedef typename Tree::NodeData NodeData;
+	typedef typename Tree::Scratch Scratch;
+
+	// Input iterator over the element indices the cursor has left
+	class iterator
+	{
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef int value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const int* pointer;
+		typedef int reference;
+
+		explicit iterator(BasicQuadQueryCursor* cursor) : cursor(cursor) {
+		}
+
+		int operator*() const {
+			return cursor->elementIndex();
+		}
+
+		iterator& operator++() {
+			if (!cursor->next()) {
+				cursor = nullptr;
+			}
+			return *this;
+		}
+
+		bool operator==(const iterator& other) const {
+			return cursor == other.cursor;
+		}
+
+		bool operator!=(const iterator& other) const {
+			return cursor != other.cursor;
+		}
+
+	private:
+		// The cursor, or nullptr once it has run out
+		BasicQuadQueryCursor* cursor;
+	};
+
+	BasicQuadQueryCursor(const Tree& tree, Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex);
+	BasicQuadQueryCursor(BasicQuadQueryCursor&& other);
+	~BasicQuadQueryCursor();
+
+	BasicQuadQueryCursor(const BasicQuadQueryCursor&) = delete;
+	BasicQuadQueryCursor& operator=(const BasicQuadQueryCursor&) = delete;
+	BasicQuadQueryCursor& operator=(BasicQuadQueryCursor&&) = delete;
+
+	// Moves to the next element found, returning false once there are none left
+	bool next();
+
+	// The element the cursor is on, valid after next returned true
+	int elementIndex() const {
+		return current;
+	}
+
+	const Element& element() const {
+		return tree->elements[current];
+	}
+
+	// Advances to the first element, so a cursor is only iterated once
+	iterator begin() {
+		return iterator(next() ? this : nullptr);
+	}
+
+	iterator end() {
+		return iterator(nullptr);
+	}
+
+private:
+	const Tree* tree;
+
+	// nullptr once moved from
+	Scratch* scratch;
+
+	Coord x1, y1, x2, y2;
+	int omitElementIndex;
+
+	// The element node to test next in the current leaf, -1 when the leaf is done. The
+	// branches still to descend into are on the scratch's nodeStack
+	int elementNodeIndex;
+
+	// The element found by the last call to next, -1 before the first and after the last
+	int current;
+};
+
+template <class Tree, class Coord>
+BasicQuadQueryCursor<Tree, Coord>::BasicQuadQueryCursor(const Tree& tree, Scratch& scratch, const Coord x1, const Coord y1, const Coord x2, const Coord y2, const int omitElementIndex)
+	: tree(&tree), scratch(&scratch), x1(x1), y1(y1), x2(x2), y2(y2), omitElementIndex(omitElementIndex), elementNodeIndex(-1), current(-1)
+{
+	if (scratch.tempBuffer.size() < tree.elements.size()) {
+		scratch.tempBuffer.assign(tree.elements.size(), false);
+	}
+	scratch.nodeStack.clear();
+	scratch.nodeStack.push_back(NodeData(0, 0, tree.rootMx, tree.rootMy, tree.rootHx, tree.rootHy));
+	QUADTREE_COUNT(scratch.counters.queries, 1);
+}
+
+template <class Tree, class Coord>
+BasicQuadQueryCursor<Tree, Coord>::BasicQuadQueryCursor(BasicQuadQueryCursor&& other)
+	: tree(other.tree), scratch(other.scratch), x1(other.x1), y1(other.y1), x2(other.x2), y2(other.y2), omitElementIndex(other.omitElementIndex),
+	elementNodeIndex(other.elementNodeIndex), current(other.current)
+{
+	other.scratch = nullptr;
+}
+
+// Unmarks the elements found, leaving the scratch ready for the next query
+template <class Tree, class Coord>
+BasicQuadQueryCursor<Tree, Coord>::~BasicQuadQueryCursor()
+{
+	if (scratch == nullptr) {
+		return;
+	}
+	for (int i = 0; i < scratch->clearList.size(); i++) {
+		scratch->tempBuffer[scratch->clearList[i]] = false;
+	}
+	scratch->clearList.clear();
+}
+
+template <class Tree, class Coord>
+bool BasicQuadQueryCursor<Tree, Coord>::next()
+{
+	std::vector<NodeData> & stack = scratch->nodeStack;
+	for (;;) {
+		// Test the rest of the current leaf's list
+		while (elementNodeIndex != -1) {
+			const QuadElementNode & elementNode = tree->elementNodes[elementNodeIndex];
+			elementNodeIndex = elementNode.nextIndex;
+			const int elementIndex = elementNode.elementIndex;
+			if (!scratch->tempBuffer[elementIndex] && elementIndex != omitElementIndex) {
+				const Element & e = tree->elements[elementIndex];
+				QUADTREE_COUNT(scratch->counters.elementsTested, 1);
+				if (Tree::intersect(x1, y1, x2, y2, e.x1, e.y1, e.x2, e.y2)) {
+					// Mark it so that the other leaves it is in skip it
+					scratch->tempBuffer[elementIndex] = true;
+					scratch->clearList.push_back(elementIndex);
+					QUADTREE_COUNT(scratch->counters.elementsReturned, 1);
+					current = elementIndex;
+					return true;
+				}
+			}
+		}
+
+		// Then descend to the next leaf
+		if (stack.size() == 0) {
+			current = -1;
+			return false;
+		}
+		const NodeData nodeData = stack.back();
+		stack.pop_back();
+		QUADTREE_COUNT(scratch->counters.nodesVisited, 1);
+		if (tree->nodes[nodeData.nodeIndex].count != -1) {
+			QUADTREE_COUNT(scratch->counters.leavesScanned, 1);
+			elementNodeIndex = tree->nodes[nodeData.nodeIndex].firstChildIndex;
+		}
+		else {
+			tree->pushChildren(stack, nodeData, x1, y1, x2, y2);
+		}
+	}
+}
+
+// Walks the tree and the free chains to take a snapshot of the tree's shape.
+// Takes time linear in the size of the tree, so it is meant for diagnostics
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+QuadStats BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::stats() const
+{
+	QuadStats stats;
+	traverse(QuadStatsVisitor<BasicQuadtree, Coord>(stats));
+
+	stats.freeElements = elements.freeCount();
+	stats.freeElementNodes = elementNodes.freeCount();
+	stats.elements = elements.size() - stats.freeElements;
+	stats.duplication = stats.elements > 0 ? static_cast<double>(stats.elementNodes) / stats.elements : 0.0;
+	for (int nodeIndex = freeNodeIndex; nodeIndex != -1; nodeIndex = nodes[nodeIndex].firstChildIndex) {
+		stats.freeNodeBlocks++;
+	}
+	return stats;
+}
+
+// Returns the work counted by the tree's own operations and by queryBatch and
+// findAllIntersectingPairs on a pool. Queries run with a caller's scratch count into
+// that scratch instead. Always zero unless QUADTREE_STATS is defined
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+QuadCounters BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::counters() const
+{
+	QuadCounters total = scratch.counters;
+	for (int i = 0; i < workerScratch.size(); i++) {
+		total += workerScratch[i].counters;
+	}
+	return total;
+}
+
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+void BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::resetCounters()
+{
+	scratch.counters = QuadCounters();
+	for (int i = 0; i < workerScratch.size(); i++) {
+		workerScratch[i].counters = QuadCounters();
+	}
+}
+
+// Standard AABB intersection check
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+bool BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::intersect(const Coord x1A, const Coord y1A, const Coord x2A, const Coord y2A,
+	const Coord x1B, const Coord y1B, const Coord x2B, const Coord y2B)
+{
+	return x1B <= x2A && x2B >= x1A && y1B <= y2A && y2B >= y1A;
+}
+
+//void Quadtree::write(ostream & o) const
+//{
+//
+//}
+
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::BasicQuadtree(const Coord width, const Coord height, const int maxElements, const int maxDepth, const int tempBufferSize)
+	: maxElements(MaxElements > 0 ? MaxElements : maxElements), maxDepth(MaxDepth > 0 ? MaxDepth : maxDepth), rootMx(width / 2), rootMy(height / 2), rootHx(width / 2), rootHy(height / 2), freeNodeIndex(-1), cleanupCursor(0), packedKernel(QuadIntersectKernel<Coord>::get()), packedValid(false), splitPolicy(nullptr), trackHeat(false), backReferences(false), changeTracking(false), changeEpoch(0), historyStart(0)
+{
+	scratch.tempBuffer.assign(tempBufferSize, false);
+
+	// Insert root, padded to a block of 4 so that every block of children starts at a
+	// multiple of 4
+	for (int i = 0; i < 4; i++) {
+		nodes.insert(QuadNode(-1, 0));
+	}
+}
+
+// Builds the tree from a batch of elements in one go, see build
+template <class Coord, class Payload, int MaxElements, int MaxDepth, class Allocator>
+BasicQuadtree<Coord, Payload, MaxElements, MaxDepth, Allocator>::BasicQuadtree(const Coord width, const Coord height, const int maxElements, const int maxDepth, const std::vector<Element>& initialElements)
+	: BasicQuadtree(width, height, maxElements, maxDepth, static_cast<int>(initialElements.size()))
+{
+	build(initialElements);
+}
+
+// The int tree is compiled once, in quadtree.cpp
+extern template class BasicQuadtree<int, int, 0, 0>;
+
+// Represents a node in the loose quadtree.
+struct LooseQuadNode
+{
+	// Points to the first of the 4 contiguous children, or -1 if the node has none.
+	int firstChildIndex;
+
+	// Points to the first element stored in this node, or -1 if there is none.
+	int firstElementIndex;
+
+	// Stores the number of elements stored in this node.
+	int count;
+
+	// The node's midpoint and depth, kept so that update can check an element against
+	// its current node without descending from the root
+	int mx, my, depth;
+
+	LooseQuadNode(int mx, int my, int depth)
+		: firstChildIndex(-1), firstElementIndex(-1), count(0), mx(mx), my(my), depth(depth) {
+	}
+};
+
+// Represents an element in the loose quadtree. Each element is stored in exactly one
+// node, so it doubles as its node's list entry and no element nodes are needed.
+struct LooseQuadElement
+{
+	QuadElement element;
+
+	// The node storing the element
+	int nodeIndex;
+
+	// The previous and next elements in the node's doubly linked list, -1 at either end
+	int prevIndex, nextIndex;
+
+	LooseQuadElement(const QuadElement& element)
+		: element(element), nodeIndex(-1), prevIndex(-1), nextIndex(-1) {
+	}
+};
+
+// A quadtree in which every element lives in exactly one node rather than in every leaf
+// it overlaps. Node bounds are enlarged by a looseness factor around the node's regular
+// cell, and an element descends from the root as long as it fits entirely inside the
+// loose bounds of the child containing its center, so large elements stop higher up.
+// There is no maxElements: small elements sink to maxDepth (a fixed-depth tree) and nodes
+// are only created on the way down. Because no element is stored twice, queries need no
+// duplicate check and remove/update are constant time list splices.
+// Use it instead of Quadtree for workloads with mixed-size AABBs that move a lot.
+class LooseQuadtree
+{
+private:
+	// The maximum depth allowed for the quadtree.
+	int maxDepth;
+
+	// Stores all the elements in the quadtree.
+	FreeList<LooseQuadElement> elements;
+
+	// Stores all the nodes in the quadtree. The first node in this
+	// sequence is always the root.
+	FreeList<LooseQuadNode> nodes;
+
+	// Stores the first of 4 contiguous freed nodes, see Quadtree::freeNodeIndex
+	int freeNodeIndex;
+
+	// The half-size of a node's cell and of its loose bounds at each depth
+	std::vector<int> cellHx, cellHy, looseHx, looseHy;
+
+	// Traversal stack for queries, kept to reuse its capacity. Nodes store their own
+	// midpoint and depth, so only the node index is needed
+	std::vector<int> toProcess;
+
+	int findNode(const int x1, const int y1, const int x2, const int y2, const bool create);
+	bool fitsChild(const int nodeIndex, const int x1, const int y1, const int x2, const int y2) const;
+	bool fits(const int mx, const int my, const int depth, const int x1, const int y1, const int x2, const int y2) const;
+	void link(const int nodeIndex, const int elementIndex);
+	void unlink(const int elementIndex);
+
+public:
+	int insert(const int id, const int x1, const int y1, const int x2, const int y2);
+	void remove(const int elementIndex);
+	void update(const int elementIndex, const int x1, const int y1, const int x2, const int y2);
+	std::vector<QuadElement> query(const float x1, const float y1, const float x2, const float y2, const int omitElementIndex);
+	std::vector<QuadElement> query(const float x1, const float y1, const float x2, const float y2);
+	void query(std::vector<QuadElement>& out, const float x1, const float y1, const float x2, const float y2, const int omitElementIndex);
+	template <class Visitor>
+	void queryVisit(const float x1, const float y1, const float x2, const float y2, const int omitElementIndex, Visitor&& visit);
+	void cleanup();
+	LooseQuadtree(const int width, const int height, const int maxDepth, const float looseness);
+
+	// Stores the quadtree extents - boundaries
+	const int rootMx, rootMy, rootHx, rootHy;
+};
+
+// Calls visit(elementIndex, element) once for every element found in the specified
+// rectangle, excluding the specified element to omit (-1 to omit nothing). Every element
+// is stored once, so no duplicate check is needed. Children whose loose bounds miss the
+// rectangle are skipped. The visitor must not modify or query the tree.
+template <class Visitor>
+void LooseQuadtree::queryVisit(const float x1, const float y1, const float x2, const float y2, const int omitElementIndex, Visitor&& visit)
+{
+	// Cast coordinates to int
+	const int qx1 = static_cast<int>(x1);
+	const int qy1 = static_cast<int>(y1);
+	const int qx2 = static_cast<int>(x2);
+	const int qy2 = static_cast<int>(y2);
+
+	toProcess.clear();
+	toProcess.push_back(0);
+	while (toProcess.size() > 0) {
+		const int nodeIndex = toProcess.back();
+		toProcess.pop_back();
+		const LooseQuadNode & node = nodes[nodeIndex];
+
+		for (int elementIndex = node.firstElementIndex; elementIndex != -1; elementIndex = elements[elementIndex].nextIndex) {
+			const QuadElement & e = elements[elementIndex].element;
+			if (elementIndex != omitElementIndex && qx1 <= e.x2 && qx2 >= e.x1 && qy1 <= e.y2 && qy2 >= e.y1) {
+				visit(elementIndex, e);
+			}
+		}
+
+		if (node.firstChildIndex == -1) {
+			continue;
+		}
+		const int depth = node.depth + 1;
+		const int lx = looseHx[depth], ly = looseHy[depth];
+		for (int i = 0; i < 4; i++) {
+			const int childIndex = node.firstChildIndex + i;
+			const LooseQuadNode & child = nodes[childIndex];
+			if (qx1 <= child.mx + lx && qx2 >= child.mx - lx && qy1 <= child.my + ly && qy2 >= child.my - ly) {
+				toProcess.push_back(childIndex);
+			}
+		}
+	}
+}
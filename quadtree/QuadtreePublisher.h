@@ -0,0 +1,177 @@
+#pragma once
+#include "pch.h"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/// Shares a tree between one writer thread and any number of reader threads
+/// without locks, RCU style. The writer changes its own tree as usual and calls
+/// publish to make a read-only copy of it the current version. Readers pin the
+/// current version with enter, query it with their own scratch and release it
+/// with exit, never waiting on the writer, so their query latency doesn't depend
+/// on write bursts. A replaced version is reclaimed once every reader that could
+/// have seen it has exited (epoch-based reclamation), and is then recycled as
+/// the copy target of a later publish.
+/// Tree is a BasicQuadtree instantiation.
+template <class Tree>
+class QuadtreePublisher
+{
+public:
+	/// Creates a publisher for readers numbered 0 to maxReaders - 1. Nothing is
+	/// published yet.
+	explicit QuadtreePublisher(int maxReaders);
+
+	/// Deletes every version. No reader may be inside enter/exit.
+	~QuadtreePublisher();
+
+	QuadtreePublisher(const QuadtreePublisher&) = delete;
+	QuadtreePublisher& operator=(const QuadtreePublisher&) = delete;
+
+	// Writer thread only: makes a copy of 'tree' the current version and reclaims
+	// the replaced versions no reader can still be using. Every published tree must
+	// have the same extents. Takes time linear in the size of the tree.
+	void publish(const Tree& tree);
+
+	// Writer thread only: returns the number of replaced versions still held for
+	// readers that haven't exited since.
+	int retiredCount() const;
+
+	// Reader 'reader' only: pins the current version and returns it, or nullptr if
+	// nothing has been published. The version stays valid until exit. Query it with
+	// scratch(reader), e.g. through queryVisit and search, which only read the tree.
+	const Tree* enter(int reader);
+
+	// Reader 'reader' only: the reader's query scratch.
+	typename Tree::Scratch& scratch(int reader);
+
+	// Reader 'reader' only: releases the version returned by enter.
+	void exit(int reader);
+
+private:
+	// The epoch a reader entered in, or 0 while it isn't reading, and its scratch.
+	// A cache line of padding after each keeps every epoch off the lines of any
+	// reader's scratch, so that the publisher's scan of the epochs doesn't contend
+	// with readers' queries. Padding rather than alignas, which std::vector only
+	// honours from C++17
+	struct ReaderSlot
+	{
+		std::atomic<std::uint64_t> epoch;
+		char epochPadding[64];
+		typename Tree::Scratch scratch;
+		char scratchPadding[64];
+
+		ReaderSlot() : epoch(0) {
+		}
+	};
+
+	// A replaced version and the epoch that began when it was replaced. Readers that
+	// entered in that epoch or later can't be using it
+	struct RetiredVersion
+	{
+		Tree* tree;
+		std::uint64_t epoch;
+	};
+
+	void reclaim();
+
+	std::vector<ReaderSlot> readers;
+	std::atomic<Tree*> current;
+	std::atomic<std::uint64_t> epoch;
+	std::vector<RetiredVersion> retired;
+
+	// A reclaimed version kept to copy the next publish into, or nullptr
+	Tree* spare;
+};
+
+template <class Tree>
+QuadtreePublisher<Tree>::QuadtreePublisher(int maxReaders)
+	: readers(maxReaders), current(nullptr), epoch(1), spare(nullptr)
+{
+}
+
+template <class Tree>
+QuadtreePublisher<Tree>::~QuadtreePublisher()
+{
+	delete current.load();
+	for (const RetiredVersion& version : retired) {
+		delete version.tree;
+	}
+	delete spare;
+}
+
+// The swap of the current version comes before the epoch is advanced, and a reader
+// records its epoch before loading the current version, all sequentially consistent.
+// So a reader that records the new epoch or a later one loads the new version, and a
+// reader still inside with an older epoch keeps the replaced version from reclamation
+template <class Tree>
+void QuadtreePublisher<Tree>::publish(const Tree& tree)
+{
+	Tree* next;
+	if (spare != nullptr) {
+		next = spare;
+		spare = nullptr;
+		next->copyFrom(tree);
+	}
+	else {
+		next = new Tree(tree);
+	}
+
+	Tree* previous = current.exchange(next);
+	const std::uint64_t replacedEpoch = epoch.fetch_add(1) + 1;
+	if (previous != nullptr) {
+		retired.push_back({ previous, replacedEpoch });
+	}
+	reclaim();
+}
+
+// Recycles the first reclaimable version as the spare and deletes the others
+template <class Tree>
+void QuadtreePublisher<Tree>::reclaim()
+{
+	std::uint64_t oldest = epoch.load();
+	for (const ReaderSlot& reader : readers) {
+		const std::uint64_t readerEpoch = reader.epoch.load();
+		if (readerEpoch != 0 && readerEpoch < oldest) {
+			oldest = readerEpoch;
+		}
+	}
+
+	int kept = 0;
+	for (const RetiredVersion& version : retired) {
+		if (version.epoch > oldest) {
+			retired[kept++] = version;
+		}
+		else if (spare == nullptr) {
+			spare = version.tree;
+		}
+		else {
+			delete version.tree;
+		}
+	}
+	retired.resize(kept);
+}
+
+template <class Tree>
+int QuadtreePublisher<Tree>::retiredCount() const
+{
+	return static_cast<int>(retired.size());
+}
+
+template <class Tree>
+const Tree* QuadtreePublisher<Tree>::enter(int reader)
+{
+	readers[reader].epoch.store(epoch.load());
+	return current.load();
+}
+
+template <class Tree>
+typename Tree::Scratch& QuadtreePublisher<Tree>::scratch(int reader)
+{
+	return readers[reader].scratch;
+}
+
+template <class Tree>
+void QuadtreePublisher<Tree>::exit(int reader)
+{
+	readers[reader].epoch.store(0, std::memory_order_release);
+}
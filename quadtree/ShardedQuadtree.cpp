@@ -0,0 +1,40 @@
+#include "pch.h"
+#include "ShardedQuadtree.h"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+QuadFileTileStore::QuadFileTileStore(const std::string& directory) : directory(directory)
+{
+}
+
+// Writes to a temporary file renamed over the tile's, so a failed write leaves the
+// previous snapshot intact
+bool QuadFileTileStore::write(const int tileX, const int tileY, const std::string& snapshot)
+{
+	const std::string target = path(tileX, tileY);
+	const std::string temporary = target + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		if (!out.write(snapshot.data(), snapshot.size()) || !out.flush()) {
+			return false;
+		}
+	}
+	std::remove(target.c_str());
+	return std::rename(temporary.c_str(), target.c_str()) == 0;
+}
+
+bool QuadFileTileStore::read(const int tileX, const int tileY, std::string& snapshot)
+{
+	std::ifstream in(path(tileX, tileY), std::ios::binary);
+	if (!in) {
+		return false;
+	}
+	snapshot.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return !in.bad();
+}
+
+std::string QuadFileTileStore::path(const int tileX, const int tileY) const
+{
+	return directory + "/tile_" + std::to_string(tileX) + "_" + std::to_string(tileY) + ".qt";
+}
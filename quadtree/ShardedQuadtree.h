@@ -0,0 +1,535 @@
+#pragma once
+#include "pch.h"
+#include "Quadtree.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+/// Keeps the tiles a ShardedQuadtree evicts. A tile is handed over as the bytes of its
+/// snapshot and asked for again by its tile coordinates.
+class IQuadTileStore
+{
+public:
+	virtual ~IQuadTileStore() {}
+
+	// Keeps the snapshot of tile (tileX, tileY), replacing any kept before. Returns
+	// false if it couldn't be kept, in which case the tile stays in memory.
+	virtual bool write(const int tileX, const int tileY, const std::string& snapshot) = 0;
+
+	// Reads back the last snapshot written for a tile. Returns false if there is none.
+	virtual bool read(const int tileX, const int tileY, std::string& snapshot) = 0;
+};
+
+/// Keeps evicted tiles as files named tile_<x>_<y>.qt in an existing directory.
+class QuadFileTileStore : public IQuadTileStore
+{
+public:
+	explicit QuadFileTileStore(const std::string& directory);
+
+	bool write(const int tileX, const int tileY, const std::string& snapshot) override;
+	bool read(const int tileX, const int tileY, std::string& snapshot) override;
+
+private:
+	std::string path(const int tileX, const int tileY) const;
+
+	std::string directory;
+};
+
+// Where a ShardedQuadtree element is: its tile and its element index in the tile's tree
+struct QuadTileRef
+{
+	int tileIndex;
+	int elementIndex;
+
+	QuadTileRef(int tileIndex, int elementIndex) : tileIndex(tileIndex), elementIndex(elementIndex) {
+	}
+};
+
+// The tile holding a world coordinate, rounding down for negative coordinates
+template <class WorldCoord>
+inline typename std::enable_if<std::is_integral<WorldCoord>::value, int>::type quadTileOf(const WorldCoord v, const WorldCoord tileSize)
+{
+	const WorldCoord tile = v / tileSize;
+	return static_cast<int>(tile * tileSize > v ? tile - 1 : tile);
+}
+
+template <class WorldCoord>
+inline typename std::enable_if<!std::is_integral<WorldCoord>::value, int>::type quadTileOf(const WorldCoord v, const WorldCoord tileSize)
+{
+	return static_cast<int>(std::floor(v / tileSize));
+}
+
+/// A spatial index for worlds larger than one tree should hold: a grid of square tiles,
+/// each a Tree over its own local coordinates, so world coordinates can be 64-bit while
+/// each tile keeps narrow ones. Tiles are created when an element first lands in them,
+/// so memory scales with the populated area rather than the size of the world.
+/// Each element lives in the one tile holding its top left corner and may overhang it
+/// to the right and bottom. A query visits the tiles its rectangle overlaps, extended up
+/// and left by the furthest any element overhangs, so elements crossing tile borders are
+/// found once without a duplicate check.
+/// Elements are addressed by handles, which stay the same when update moves an element
+/// to another tile. With a tile store, tiles without traffic for a while can be evicted
+/// to it, and are loaded back when an operation next needs them.
+///   Tree: a BasicQuadtree instantiation. The tile size plus the largest element must
+///     fit in its Coord, and a power of 2 splits evenly all the way down
+///   WorldCoord: the type of world coordinates, e.g. long long or double
+/// Tile coordinates are ints, so the world spans up to 2^32 tiles each way.
+template <class Tree, class WorldCoord>
+class ShardedQuadtree
+{
+public:
+	typedef typename Tree::CoordType Coord;
+	typedef typename Tree::PayloadType Payload;
+	typedef BasicQuadElement<WorldCoord, Payload> Element;
+
+	// Creates an empty index of tiles tileSize wide, each a Tree with the given leaf
+	// capacity and depth limit. 'store' keeps evicted tiles and may be nullptr, in which
+	// case only empty tiles are evicted. It isn't owned.
+	ShardedQuadtree(const WorldCoord tileSize, const int maxElements, const int maxDepth, IQuadTileStore* store);
+
+	ShardedQuadtree(const ShardedQuadtree&) = delete;
+	ShardedQuadtree& operator=(const ShardedQuadtree&) = delete;
+
+	// Inserts an element and returns its handle, or -1 if its tile couldn't be loaded.
+	int insert(const Payload& id, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2);
+
+	// Removes an element. Returns false if its tile couldn't be loaded.
+	bool remove(const int handle);
+
+	// Moves an element to a new AABB, and to another tile if its top left corner left
+	// its tile. The handle stays the same. Returns false if a tile couldn't be loaded.
+	bool update(const int handle, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2);
+
+	// Reads an element in world coordinates. Returns false if its tile couldn't be loaded.
+	bool element(const int handle, Element& out);
+
+	// Calls visit(handle, element) once for every element found in the specified
+	// rectangle, excluding the element to omit (-1 to omit nothing). Tiles that can't
+	// be loaded are skipped. The visitor must not modify or query the index.
+	template <class Visitor>
+	void queryVisit(const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2, const int omitHandle, Visitor&& visit);
+
+	// Returns the elements found in the specified rectangle in 'out', cleared first.
+	void query(std::vector<Element>& out, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2, const int omitHandle);
+
+	// Advances the clock evict measures idleness by, e.g. once per frame.
+	void tick();
+
+	// Drops the tiles no operation has used in the last idleTicks ticks. Empty tiles are
+	// freed, and the others are written to the store and their trees freed. Returns the
+	// number of tiles dropped or evicted.
+	int evict(const std::uint64_t idleTicks);
+
+	// The number of tiles holding or having held elements, and how many are in memory.
+	int tileCount() const;
+	int loadedTileCount() const;
+
+	// Returns the bytes allocated by the tiles in memory and the handles.
+	QuadMemoryUsage memoryUsage() const;
+
+	// The tiles' width and height in world units
+	const WorldCoord tileSize;
+
+private:
+	struct Tile
+	{
+		int tileX, tileY;
+
+		// The tile's tree, or nullptr while the tile is evicted
+		std::unique_ptr<Tree> tree;
+
+		// The handle of each element of the tree by element index, -1 for free slots
+		std::vector<int> handles;
+
+		// The furthest right and bottom edges of the tile's elements, at least the tile's
+		// own edges. They only shrink when the tile empties
+		WorldCoord right, bottom;
+
+		// The number of elements in the tile, or -1 if the slot is free
+		int count;
+
+		// The tick of the last operation on the tile
+		std::uint64_t lastUsed;
+	};
+
+	static std::uint64_t tileKey(const int tileX, const int tileY);
+	int findTile(const int tileX, const int tileY, const bool create);
+	bool loadTile(Tile& tile);
+	int place(const int tileIndex, const Payload& id, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2);
+	void unplace(const QuadTileRef& ref);
+	void freeTile(const int tileIndex);
+
+	int maxElements, maxDepth;
+	IQuadTileStore* store;
+
+	// The tiles, with freed slots listed in freeTiles, and the slot of each tile by its key
+	std::vector<Tile> tiles;
+	std::vector<int> freeTiles;
+	std::unordered_map<std::uint64_t, int> tileIndices;
+
+	// The location of each element by handle
+	FreeList<QuadTileRef> refs;
+
+	// The furthest any tile's elements overhang its right and bottom edges
+	WorldCoord overhangX, overhangY;
+
+	std::uint64_t now;
+
+	// The tiles a query visits, kept to reuse its capacity
+	std::vector<int> queryTiles;
+};
+
+template <class Tree, class WorldCoord>
+ShardedQuadtree<Tree, WorldCoord>::ShardedQuadtree(const WorldCoord tileSize, const int maxElements, const int maxDepth, IQuadTileStore* store)
+	: tileSize(tileSize), maxElements(maxElements), maxDepth(maxDepth), store(store), overhangX(0), overhangY(0), now(0)
+{
+}
+
+template <class Tree, class WorldCoord>
+int ShardedQuadtree<Tree, WorldCoord>::insert(const Payload& id, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2)
+{
+	const int tileIndex = findTile(quadTileOf(x1, tileSize), quadTileOf(y1, tileSize), true);
+	if (tileIndex == -1) {
+		return -1;
+	}
+	const int elementIndex = place(tileIndex, id, x1, y1, x2, y2);
+	const int handle = refs.insert(QuadTileRef(tileIndex, elementIndex));
+	tiles[tileIndex].handles[elementIndex] = handle;
+	return handle;
+}
+
+template <class Tree, class WorldCoord>
+bool ShardedQuadtree<Tree, WorldCoord>::remove(const int handle)
+{
+	const QuadTileRef ref = refs[handle];
+	if (!loadTile(tiles[ref.tileIndex])) {
+		return false;
+	}
+	unplace(ref);
+	refs.erase(handle);
+	return true;
+}
+
+// A move within the tile is an update of the tile's tree. A move across a tile border
+// reinserts the element into the other tile and points the handle at it
+template <class Tree, class WorldCoord>
+bool ShardedQuadtree<Tree, WorldCoord>::update(const int handle, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2)
+{
+	const QuadTileRef ref = refs[handle];
+	if (!loadTile(tiles[ref.tileIndex])) {
+		return false;
+	}
+
+	const int tileX = quadTileOf(x1, tileSize), tileY = quadTileOf(y1, tileSize);
+	Tile & tile = tiles[ref.tileIndex];
+	if (tileX == tile.tileX && tileY == tile.tileY) {
+		const WorldCoord originX = tileSize * tileX, originY = tileSize * tileY;
+		tile.tree->update(ref.elementIndex, static_cast<Coord>(x1 - originX), static_cast<Coord>(y1 - originY),
+			static_cast<Coord>(x2 - originX), static_cast<Coord>(y2 - originY));
+		tile.right = std::max(tile.right, x2);
+		tile.bottom = std::max(tile.bottom, y2);
+		overhangX = std::max(overhangX, tile.right - (originX + tileSize));
+		overhangY = std::max(overhangY, tile.bottom - (originY + tileSize));
+		tile.lastUsed = now;
+		return true;
+	}
+
+	// Finding the new tile may grow the tiles array, so the old one is looked up again
+	const int tileIndex = findTile(tileX, tileY, true);
+	if (tileIndex == -1) {
+		return false;
+	}
+	const Payload id = tiles[ref.tileIndex].tree->element(ref.elementIndex).id;
+	unplace(ref);
+	const int elementIndex = place(tileIndex, id, x1, y1, x2, y2);
+	tiles[tileIndex].handles[elementIndex] = handle;
+	refs[handle] = QuadTileRef(tileIndex, elementIndex);
+	return true;
+}
+
+template <class Tree, class WorldCoord>
+bool ShardedQuadtree<Tree, WorldCoord>::element(const int handle, Element& out)
+{
+	const QuadTileRef ref = refs[handle];
+	Tile & tile = tiles[ref.tileIndex];
+	if (!loadTile(tile)) {
+		return false;
+	}
+	const WorldCoord originX = tileSize * tile.tileX, originY = tileSize * tile.tileY;
+	const typename Tree::Element & e = tile.tree->element(ref.elementIndex);
+	out = Element(e.id, originX + e.x1, originY + e.y1, originX + e.x2, originY + e.y2);
+	tile.lastUsed = now;
+	return true;
+}
+
+// Collects the tiles first, by looking up each tile coordinate in range or, for
+// rectangles spanning more tile coordinates than there are tiles, by scanning the tiles.
+// Each is then queried in local coordinates clamped to the extent of its elements, which
+// keeps the rectangle within the range of Coord however far it reaches
+template <class Tree, class WorldCoord>
+template <class Visitor>
+void ShardedQuadtree<Tree, WorldCoord>::queryVisit(const WorldCoord qx1, const WorldCoord qy1, const WorldCoord qx2, const WorldCoord qy2, const int omitHandle, Visitor&& visit)
+{
+	// Elements reach up to and including their tile's right and bottom edges, so a
+	// rectangle starting exactly on a tile's left or top edge also meets the tile before
+	int tx1 = quadTileOf(qx1 - overhangX, tileSize), ty1 = quadTileOf(qy1 - overhangY, tileSize);
+	const int tx2 = quadTileOf(qx2, tileSize), ty2 = quadTileOf(qy2, tileSize);
+	if (tileSize * tx1 == qx1 - overhangX) {
+		tx1--;
+	}
+	if (tileSize * ty1 == qy1 - overhangY) {
+		ty1--;
+	}
+	queryTiles.clear();
+	if ((static_cast<double>(tx2) - tx1 + 1) * (static_cast<double>(ty2) - ty1 + 1) > static_cast<double>(tileIndices.size())) {
+		for (int i = 0; i < tiles.size(); i++) {
+			const Tile & tile = tiles[i];
+			if (tile.count > 0 && tile.tileX >= tx1 && tile.tileX <= tx2 && tile.tileY >= ty1 && tile.tileY <= ty2) {
+				queryTiles.push_back(i);
+			}
+		}
+	}
+	else {
+		for (int tileY = ty1; tileY <= ty2; tileY++) {
+			for (int tileX = tx1; tileX <= tx2; tileX++) {
+				const int tileIndex = findTile(tileX, tileY, false);
+				if (tileIndex != -1 && tiles[tileIndex].count > 0) {
+					queryTiles.push_back(tileIndex);
+				}
+			}
+		}
+	}
+
+	const int omitTileIndex = omitHandle != -1 ? refs[omitHandle].tileIndex : -1;
+	for (int i = 0; i < queryTiles.size(); i++) {
+		Tile & tile = tiles[queryTiles[i]];
+		const WorldCoord originX = tileSize * tile.tileX, originY = tileSize * tile.tileY;
+		if (qx1 > tile.right || qy1 > tile.bottom || !loadTile(tile)) {
+			continue;
+		}
+		tile.lastUsed = now;
+
+		const Coord lx1 = static_cast<Coord>(std::max(qx1 - originX, static_cast<WorldCoord>(0)));
+		const Coord ly1 = static_cast<Coord>(std::max(qy1 - originY, static_cast<WorldCoord>(0)));
+		const Coord lx2 = static_cast<Coord>(std::min(qx2, tile.right) - originX);
+		const Coord ly2 = static_cast<Coord>(std::min(qy2, tile.bottom) - originY);
+		const int omitElementIndex = queryTiles[i] == omitTileIndex ? refs[omitHandle].elementIndex : -1;
+		const std::vector<int> & handles = tile.handles;
+		tile.tree->queryVisit(lx1, ly1, lx2, ly2, omitElementIndex, [&](const int elementIndex, const typename Tree::Element& e) {
+			visit(handles[elementIndex], Element(e.id, originX + e.x1, originY + e.y1, originX + e.x2, originY + e.y2));
+		});
+	}
+}
+
+template <class Tree, class WorldCoord>
+void ShardedQuadtree<Tree, WorldCoord>::query(std::vector<Element>& out, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2, const int omitHandle)
+{
+	out.clear();
+	queryVisit(x1, y1, x2, y2, omitHandle, [&out](const int, const Element& e) {
+		out.push_back(e);
+	});
+}
+
+template <class Tree, class WorldCoord>
+void ShardedQuadtree<Tree, WorldCoord>::tick()
+{
+	now++;
+}
+
+// The overhang bounds are recomputed from the tiles left, as they never shrink otherwise
+template <class Tree, class WorldCoord>
+int ShardedQuadtree<Tree, WorldCoord>::evict(const std::uint64_t idleTicks)
+{
+	int dropped = 0;
+	for (int i = 0; i < tiles.size(); i++) {
+		Tile & tile = tiles[i];
+		if (tile.count == -1 || tile.lastUsed + idleTicks > now || (tile.count > 0 && (tile.tree == nullptr || store == nullptr))) {
+			continue;
+		}
+		if (tile.count == 0) {
+			freeTile(i);
+			dropped++;
+			continue;
+		}
+
+		// The handles go first, as a count and the array, followed by the tree's snapshot
+		std::ostringstream out;
+		const std::uint32_t numHandles = static_cast<std::uint32_t>(tile.handles.size());
+		out.write(reinterpret_cast<const char*>(&numHandles), sizeof(numHandles));
+		out.write(reinterpret_cast<const char*>(tile.handles.data()), numHandles * sizeof(int));
+		if (tile.tree->save(out) && store->write(tile.tileX, tile.tileY, out.str())) {
+			tile.tree.reset();
+			std::vector<int>().swap(tile.handles);
+			dropped++;
+		}
+	}
+
+	overhangX = 0;
+	overhangY = 0;
+	for (int i = 0; i < tiles.size(); i++) {
+		const Tile & tile = tiles[i];
+		if (tile.count > 0) {
+			overhangX = std::max(overhangX, tile.right - tileSize * tile.tileX - tileSize);
+			overhangY = std::max(overhangY, tile.bottom - tileSize * tile.tileY - tileSize);
+		}
+	}
+	return dropped;
+}
+
+template <class Tree, class WorldCoord>
+int ShardedQuadtree<Tree, WorldCoord>::tileCount() const
+{
+	return static_cast<int>(tileIndices.size());
+}
+
+template <class Tree, class WorldCoord>
+int ShardedQuadtree<Tree, WorldCoord>::loadedTileCount() const
+{
+	int count = 0;
+	for (int i = 0; i < tiles.size(); i++) {
+		count += tiles[i].tree != nullptr ? 1 : 0;
+	}
+	return count;
+}
+
+// The handles are counted with the elements
+template <class Tree, class WorldCoord>
+QuadMemoryUsage ShardedQuadtree<Tree, WorldCoord>::memoryUsage() const
+{
+	QuadMemoryUsage usage(refs.bytes() + tiles.capacity() * sizeof(Tile), 0, 0);
+	for (int i = 0; i < tiles.size(); i++) {
+		const Tile & tile = tiles[i];
+		if (tile.tree != nullptr) {
+			const QuadMemoryUsage tileUsage = tile.tree->memoryUsage();
+			usage.elements += tileUsage.elements + tile.handles.capacity() * sizeof(int);
+			usage.elementNodes += tileUsage.elementNodes;
+			usage.nodes += tileUsage.nodes;
+		}
+	}
+	return usage;
+}
+
+template <class Tree, class WorldCoord>
+std::uint64_t ShardedQuadtree<Tree, WorldCoord>::tileKey(const int tileX, const int tileY)
+{
+	return static_cast<std::uint64_t>(static_cast<std::uint32_t>(tileX)) << 32 | static_cast<std::uint32_t>(tileY);
+}
+
+// Returns the slot of a tile, or -1 if there is none. With 'create' a missing tile is
+// created, and the tile is loaded and marked as used, giving -1 if it couldn't be loaded
+template <class Tree, class WorldCoord>
+int ShardedQuadtree<Tree, WorldCoord>::findTile(const int tileX, const int tileY, const bool create)
+{
+	const auto found = tileIndices.find(tileKey(tileX, tileY));
+	if (found != tileIndices.end()) {
+		if (!create) {
+			return found->second;
+		}
+		Tile & tile = tiles[found->second];
+		tile.lastUsed = now;
+		return loadTile(tile) ? found->second : -1;
+	}
+	if (!create) {
+		return -1;
+	}
+
+	int tileIndex;
+	if (freeTiles.size() > 0) {
+		tileIndex = freeTiles.back();
+		freeTiles.pop_back();
+	}
+	else {
+		tileIndex = static_cast<int>(tiles.size());
+		tiles.push_back(Tile());
+	}
+	Tile & tile = tiles[tileIndex];
+	tile.tileX = tileX;
+	tile.tileY = tileY;
+	tile.tree.reset(new Tree(static_cast<Coord>(tileSize), static_cast<Coord>(tileSize), maxElements, maxDepth, 0));
+	tile.right = tileSize * tileX + tileSize;
+	tile.bottom = tileSize * tileY + tileSize;
+	tile.count = 0;
+	tile.lastUsed = now;
+	tileIndices[tileKey(tileX, tileY)] = tileIndex;
+	return tileIndex;
+}
+
+// Reads an evicted tile back from the store. Returns false if it couldn't be
+template <class Tree, class WorldCoord>
+bool ShardedQuadtree<Tree, WorldCoord>::loadTile(Tile& tile)
+{
+	if (tile.tree != nullptr) {
+		return true;
+	}
+
+	std::string snapshot;
+	if (store == nullptr || !store->read(tile.tileX, tile.tileY, snapshot)) {
+		return false;
+	}
+	std::istringstream in(snapshot);
+	std::uint32_t numHandles = 0;
+	in.read(reinterpret_cast<char*>(&numHandles), sizeof(numHandles));
+	std::vector<int> handles(numHandles);
+	in.read(reinterpret_cast<char*>(handles.data()), numHandles * sizeof(int));
+	std::unique_ptr<Tree> tree(new Tree(static_cast<Coord>(tileSize), static_cast<Coord>(tileSize), maxElements, maxDepth, 0));
+	if (!in || !tree->load(in)) {
+		return false;
+	}
+	tile.tree = std::move(tree);
+	tile.handles = std::move(handles);
+	return true;
+}
+
+// Inserts an element into a loaded tile and returns its element index there, with the
+// tile's handle slot for it grown but not yet set
+template <class Tree, class WorldCoord>
+int ShardedQuadtree<Tree, WorldCoord>::place(const int tileIndex, const Payload& id, const WorldCoord x1, const WorldCoord y1, const WorldCoord x2, const WorldCoord y2)
+{
+	Tile & tile = tiles[tileIndex];
+	const WorldCoord originX = tileSize * tile.tileX, originY = tileSize * tile.tileY;
+	const int elementIndex = tile.tree->insert(id, static_cast<Coord>(x1 - originX), static_cast<Coord>(y1 - originY),
+		static_cast<Coord>(x2 - originX), static_cast<Coord>(y2 - originY));
+	if (tile.handles.size() <= elementIndex) {
+		tile.handles.resize(elementIndex + 1, -1);
+	}
+	tile.count++;
+	tile.right = std::max(tile.right, x2);
+	tile.bottom = std::max(tile.bottom, y2);
+	overhangX = std::max(overhangX, tile.right - (originX + tileSize));
+	overhangY = std::max(overhangY, tile.bottom - (originY + tileSize));
+	tile.lastUsed = now;
+	return elementIndex;
+}
+
+// Removes an element from its loaded tile. An emptied tile stays until evict frees it, so
+// an element moving back and forth over a border doesn't recreate the tile each time
+template <class Tree, class WorldCoord>
+void ShardedQuadtree<Tree, WorldCoord>::unplace(const QuadTileRef& ref)
+{
+	Tile & tile = tiles[ref.tileIndex];
+	tile.tree->remove(ref.elementIndex);
+	tile.handles[ref.elementIndex] = -1;
+	tile.count--;
+	tile.lastUsed = now;
+	if (tile.count == 0) {
+		tile.right = tileSize * tile.tileX + tileSize;
+		tile.bottom = tileSize * tile.tileY + tileSize;
+	}
+}
+
+template <class Tree, class WorldCoord>
+void ShardedQuadtree<Tree, WorldCoord>::freeTile(const int tileIndex)
+{
+	Tile & tile = tiles[tileIndex];
+	tileIndices.erase(tileKey(tile.tileX, tile.tileY));
+	tile.tree.reset();
+	std::vector<int>().swap(tile.handles);
+	tile.count = -1;
+	freeTiles.push_back(tileIndex);
+}
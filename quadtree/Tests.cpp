@@ -0,0 +1,759 @@
+#include "pch.h"
+#include "Quadtree.h"
+#include "PointQuadtree.h"
+#include "QuadQueryService.h"
+#include "ShardedQuadtree.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Differential tests: each structure is driven through random operations next to a plain
+// list of what it should hold, and every query is checked against a brute-force scan of
+// that list. Run by ctest. Prints each failed check and exits with 1 if any failed.
+
+static int failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			failures++; \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+		} \
+	} while (0)
+
+// The live elements of a tree by element index
+typedef std::map<int, QuadElement> Model;
+
+static bool intersects(const QuadElement& e, const int x1, const int y1, const int x2, const int y2)
+{
+	return e.x1 <= x2 && e.x2 >= x1 && e.y1 <= y2 && e.y2 >= y1;
+}
+
+static bool sameElement(const QuadElement& a, const QuadElement& b)
+{
+	return a.id == b.id && a.x1 == b.x1 && a.y1 == b.y1 && a.x2 == b.x2 && a.y2 == b.y2;
+}
+
+static double distanceSquared(const double x, const double y, const QuadElement& e)
+{
+	const double dx = std::max(std::max(e.x1 - x, x - e.x2), 0.0);
+	const double dy = std::max(std::max(e.y1 - y, y - e.y2), 0.0);
+	return dx * dx + dy * dy;
+}
+
+static int randomIndex(std::mt19937& rng, const Model& model)
+{
+	Model::const_iterator it = model.begin();
+	std::advance(it, rng() % model.size());
+	return it->first;
+}
+
+// A random AABB in a world 'size' wide, mostly small with the odd large one
+static QuadElement randomElement(std::mt19937& rng, const int id, const int size)
+{
+	const int extent = rng() % 16 == 0 ? 600 : 40;
+	const int w = rng() % extent, h = rng() % extent;
+	const int x = rng() % (size - w), y = rng() % (size - h);
+	return QuadElement(id, x, y, x + w, y + h);
+}
+
+// Checks the tree's elements, and its queries for random rectangles and points, against
+// brute force over the model
+static void checkTree(Quadtree& tree, const Model& model, std::mt19937& rng, const int size, const int numQueries)
+{
+	for (const auto & entry : model) {
+		CHECK(sameElement(tree.element(entry.first), entry.second));
+	}
+
+	std::vector<QuadElement> found;
+	std::vector<QuadNeighbor> neighbors;
+	for (int q = 0; q < numQueries; q++) {
+		const int extent = q % 8 == 0 ? size / 2 : size / 20;
+		const int x1 = static_cast<int>(rng() % size) - extent / 4, y1 = static_cast<int>(rng() % size) - extent / 4;
+		const int x2 = x1 + static_cast<int>(rng() % (extent + 1)), y2 = y1 + static_cast<int>(rng() % (extent + 1));
+		const int omit = q % 3 == 0 && model.size() > 0 ? randomIndex(rng, model) : -1;
+
+		std::vector<int> expected;
+		std::vector<int> expectedIds;
+		for (const auto & entry : model) {
+			if (entry.first != omit && intersects(entry.second, x1, y1, x2, y2)) {
+				expected.push_back(entry.first);
+				expectedIds.push_back(entry.second.id);
+			}
+		}
+		std::sort(expectedIds.begin(), expectedIds.end());
+
+		tree.query(found, x1, y1, x2, y2, omit);
+		std::vector<int> ids;
+		for (const QuadElement & e : found) {
+			ids.push_back(e.id);
+		}
+		std::sort(ids.begin(), ids.end());
+		CHECK(ids == expectedIds);
+
+		std::vector<int> visited;
+		tree.queryVisit(x1, y1, x2, y2, omit, [&](const int elementIndex, const QuadElement&) {
+			visited.push_back(elementIndex);
+		});
+		std::sort(visited.begin(), visited.end());
+		CHECK(visited == expected);
+
+		CHECK(tree.count(x1, y1, x2, y2, omit) == static_cast<int>(expected.size()));
+		CHECK(tree.any(x1, y1, x2, y2, omit) == !expected.empty());
+
+		std::vector<int> cursorIndices;
+		for (const int elementIndex : tree.queryCursor(x1, y1, x2, y2, omit)) {
+			cursorIndices.push_back(elementIndex);
+		}
+		std::sort(cursorIndices.begin(), cursorIndices.end());
+		CHECK(cursorIndices == expected);
+
+		// Ties make the order of equally distant elements arbitrary, so nearest is checked
+		// by the distances it reports, and by each element being that far away
+		const double x = x1 + 0.5, y = y1 + 0.25;
+		std::vector<double> distances;
+		for (const auto & entry : model) {
+			if (entry.first != omit) {
+				distances.push_back(distanceSquared(x, y, entry.second));
+			}
+		}
+		std::sort(distances.begin(), distances.end());
+		const int k = 1 + rng() % 8;
+		tree.nearest(neighbors, x, y, k, omit);
+		CHECK(neighbors.size() == std::min<std::size_t>(k, distances.size()));
+		for (std::size_t i = 0; i < neighbors.size() && i < distances.size(); i++) {
+			CHECK(neighbors[i].elementIndex != omit && model.count(neighbors[i].elementIndex) == 1);
+			CHECK(neighbors[i].distance == std::sqrt(distances[i]));
+			if (model.count(neighbors[i].elementIndex) == 1) {
+				CHECK(neighbors[i].distance == std::sqrt(distanceSquared(x, y, model.at(neighbors[i].elementIndex))));
+			}
+		}
+
+		const double radius = rng() % (extent + 1);
+		std::vector<int> near;
+		for (const auto & entry : model) {
+			if (entry.first != omit && distanceSquared(x, y, entry.second) <= radius * radius) {
+				near.push_back(entry.first);
+			}
+		}
+		tree.withinRadius(neighbors, x, y, radius, omit);
+		std::vector<int> within;
+		for (std::size_t i = 0; i < neighbors.size(); i++) {
+			within.push_back(neighbors[i].elementIndex);
+			CHECK(i == 0 || neighbors[i - 1].distance <= neighbors[i].distance);
+		}
+		std::sort(within.begin(), within.end());
+		CHECK(within == near);
+	}
+}
+
+// Checks findAllIntersectingPairs, serial and on the pool, against testing every pair
+static void checkPairs(Quadtree& tree, const Model& model, ThreadPool& pool)
+{
+	std::vector<std::pair<int, int>> expected;
+	for (Model::const_iterator a = model.begin(); a != model.end(); ++a) {
+		Model::const_iterator b = a;
+		for (++b; b != model.end(); ++b) {
+			if (intersects(a->second, b->second.x1, b->second.y1, b->second.x2, b->second.y2)) {
+				expected.push_back(std::make_pair(a->first, b->first));
+			}
+		}
+	}
+
+	std::vector<std::pair<int, int>> pairs;
+	for (int parallel = 0; parallel < 2; parallel++) {
+		if (parallel) {
+			tree.findAllIntersectingPairs(pool, pairs);
+		}
+		else {
+			tree.findAllIntersectingPairs(pairs);
+		}
+		for (std::pair<int, int> & pair : pairs) {
+			pair = std::make_pair(std::min(pair.first, pair.second), std::max(pair.first, pair.second));
+		}
+		std::sort(pairs.begin(), pairs.end());
+		CHECK(pairs == expected);
+	}
+}
+
+// Queries a tree mapped onto a snapshot, then copies it into memory of its own with
+// reserve or shrinkToFit and changes it, which must leave the snapshot as it was
+static void checkMapped(const std::string& snapshot, const Model& model, std::mt19937& rng, const int size, const bool reserve)
+{
+	std::vector<std::max_align_t> buffer(snapshot.size() / sizeof(std::max_align_t) + 1);
+	std::memcpy(buffer.data(), snapshot.data(), snapshot.size());
+	Quadtree mapped(size, size, 8, 8, 10);
+	CHECK(mapped.map(buffer.data(), snapshot.size(), true));
+	checkTree(mapped, model, rng, size, 20);
+
+	if (reserve) {
+		mapped.reserve(static_cast<int>(model.size()) + 100, 0, 0);
+	}
+	else {
+		mapped.shrinkToFit();
+	}
+	checkTree(mapped, model, rng, size, 20);
+
+	Model changed = model;
+	for (int i = 0; i < 200; i++) {
+		if (i % 2 == 0) {
+			const int elementIndex = randomIndex(rng, changed);
+			mapped.remove(elementIndex);
+			changed.erase(elementIndex);
+		}
+		else {
+			const QuadElement e = randomElement(rng, -1 - i, size);
+			changed.emplace(mapped.insert(e.id, e.x1, e.y1, e.x2, e.y2), e);
+		}
+	}
+	checkTree(mapped, changed, rng, size, 20);
+	CHECK(std::memcmp(buffer.data(), snapshot.data(), snapshot.size()) == 0);
+}
+
+// Inserts, removes and updates elements at random, checking queries in between and after
+// each of the operations that reorganise the tree
+static void testChurn(ThreadPool& pool, const bool backReferences)
+{
+	const int size = 1 << 13;
+	std::mt19937 rng(backReferences ? 2 : 1);
+	Quadtree tree(size, size, 8, 8, 10);
+	tree.keepBackReferences(backReferences);
+	Model model;
+	int nextId = 0;
+
+	for (int round = 0; round < 24; round++) {
+		const int operations = round == 0 ? 3000 : 600;
+		for (int i = 0; i < operations; i++) {
+			const int choice = rng() % 10;
+			if (choice < 4 || model.size() < 100) {
+				const QuadElement e = randomElement(rng, nextId++, size);
+				const int elementIndex = tree.insert(e.id, e.x1, e.y1, e.x2, e.y2);
+				CHECK(model.count(elementIndex) == 0);
+				model.erase(elementIndex);
+				model.emplace(elementIndex, e);
+			}
+			else if (choice < 7) {
+				const int elementIndex = randomIndex(rng, model);
+				tree.remove(elementIndex);
+				model.erase(elementIndex);
+			}
+			else {
+				// Mostly short moves that stay in the same leaves, sometimes jumps
+				const int elementIndex = randomIndex(rng, model);
+				QuadElement & e = model.at(elementIndex);
+				QuadElement moved = choice == 9 ? randomElement(rng, e.id, size) : e;
+				if (choice != 9) {
+					const int w = e.x2 - e.x1, h = e.y2 - e.y1;
+					moved.x1 = std::min(std::max(e.x1 + static_cast<int>(rng() % 21) - 10, 0), size - 1 - w);
+					moved.y1 = std::min(std::max(e.y1 + static_cast<int>(rng() % 21) - 10, 0), size - 1 - h);
+					moved.x2 = moved.x1 + w;
+					moved.y2 = moved.y1 + h;
+				}
+				tree.update(elementIndex, moved.x1, moved.y1, moved.x2, moved.y2);
+				e = moved;
+			}
+		}
+		checkTree(tree, model, rng, size, 40);
+
+		switch (round % 6) {
+		case 0:
+			tree.cleanup();
+			break;
+		case 1:
+			tree.cleanup();
+			tree.shrinkToFit();
+			break;
+		case 2:
+			tree.relayout();
+			break;
+		case 3: {
+			// A snapshot loads into a tree of the same extents with the same element indices
+			std::stringstream snapshot;
+			CHECK(tree.save(snapshot));
+			Quadtree loaded(size, size, 8, 8, 10);
+			CHECK(loaded.load(snapshot));
+			checkTree(loaded, model, rng, size, 40);
+			checkMapped(snapshot.str(), model, rng, size, round % 12 == 3);
+			break;
+		}
+		case 4:
+		case 5: {
+			// A build gives the elements indices in the order they are passed
+			std::vector<QuadElement> elements;
+			for (const auto & entry : model) {
+				elements.push_back(entry.second);
+			}
+			if (round % 6 == 4) {
+				tree.build(pool, elements);
+			}
+			else {
+				tree.build(elements);
+			}
+			model.clear();
+			for (int i = 0; i < static_cast<int>(elements.size()); i++) {
+				model.emplace(i, elements[i]);
+			}
+			break;
+		}
+		}
+		checkTree(tree, model, rng, size, 40);
+		if (round % 4 == 0) {
+			checkPairs(tree, model, pool);
+		}
+	}
+}
+
+// The ids of a model's elements, by id
+static std::map<int, QuadElement> byId(const Model& model)
+{
+	std::map<int, QuadElement> elements;
+	for (const auto & entry : model) {
+		elements.emplace(entry.second.id, entry.second);
+	}
+	return elements;
+}
+
+// Keeps a copy of what is in a rectangle up to date from queryChangedSince alone, and
+// checks it, and each batch of changes reported, against brute force. Some moves go into
+// the rectangle, so that elements entering it and then removed are common
+static void testChanges()
+{
+	const int size = 1 << 13;
+	std::mt19937 rng(3);
+	Quadtree tree(size, size, 8, 8, 10);
+	tree.trackChanges(true);
+	Model model;
+	int nextId = 0;
+
+	// The watched rectangle and the copy of its elements
+	const int x1 = size / 4, y1 = size / 3, x2 = x1 + size / 3, y2 = y1 + size / 4;
+	Model copy;
+	std::uint64_t since = tree.epoch();
+
+	for (int round = 0; round < 80; round++) {
+		// The elements as the consumer saw them, and the ones updated since
+		const std::map<int, QuadElement> seen = byId(model);
+		std::set<int> updated;
+
+		const int operations = 1 + rng() % 300;
+		for (int i = 0; i < operations; i++) {
+			const int choice = rng() % 10;
+			if (choice < 4 || model.size() < 100) {
+				const QuadElement e = randomElement(rng, nextId++, size);
+				const int elementIndex = tree.insert(e.id, e.x1, e.y1, e.x2, e.y2);
+				model.erase(elementIndex);
+				model.emplace(elementIndex, e);
+			}
+			else if (choice < 6) {
+				const int elementIndex = randomIndex(rng, model);
+				tree.remove(elementIndex);
+				model.erase(elementIndex);
+			}
+			else {
+				const int elementIndex = randomIndex(rng, model);
+				QuadElement & e = model.at(elementIndex);
+				e = randomElement(rng, e.id, size);
+				if (choice == 9) {
+					const int x = x1 + rng() % (x2 - x1), y = y1 + rng() % (y2 - y1);
+					e = QuadElement(e.id, x, y, x + e.x2 - e.x1, y + e.y2 - e.y1);
+				}
+				tree.update(elementIndex, e.x1, e.y1, e.x2, e.y2);
+				updated.insert(e.id);
+			}
+		}
+		if (round % 7 == 3) {
+			tree.cleanup();
+		}
+		if (round % 11 == 5) {
+			tree.relayout();
+		}
+		if (round % 13 == 7) {
+			tree.discardChangesBefore(tree.epoch());
+		}
+
+		// Removals go first, as their indices may since have been reused by additions
+		QuadChanges changes;
+		if (tree.queryChangedSince(changes, x1, y1, x2, y2, since)) {
+			const std::map<int, QuadElement> current = byId(model);
+			std::set<int> expectedAdded, expectedMoved, expectedRemoved;
+			for (const auto & entry : current) {
+				const bool wasSeen = seen.count(entry.first) == 1;
+				if (!wasSeen && intersects(entry.second, x1, y1, x2, y2)) {
+					expectedAdded.insert(entry.first);
+				}
+				if (wasSeen && updated.count(entry.first) == 1 && (intersects(entry.second, x1, y1, x2, y2) || intersects(seen.at(entry.first), x1, y1, x2, y2))) {
+					expectedMoved.insert(entry.first);
+				}
+			}
+			for (const auto & entry : seen) {
+				if (current.count(entry.first) == 0 && intersects(entry.second, x1, y1, x2, y2)) {
+					expectedRemoved.insert(entry.first);
+				}
+			}
+
+			std::set<int> added, moved, removed;
+			for (const int elementIndex : changes.added) {
+				CHECK(model.count(elementIndex) == 1 && added.insert(model.at(elementIndex).id).second);
+			}
+			for (const int elementIndex : changes.moved) {
+				CHECK(model.count(elementIndex) == 1 && moved.insert(model.at(elementIndex).id).second);
+			}
+			for (const auto & entry : changes.removed) {
+				CHECK(removed.insert(entry.second.id).second);
+				CHECK(seen.count(entry.second.id) == 1 && sameElement(seen.at(entry.second.id), entry.second));
+			}
+			CHECK(added == expectedAdded);
+			CHECK(moved == expectedMoved);
+			CHECK(removed == expectedRemoved);
+
+			for (const auto & removed : changes.removed) {
+				copy.erase(removed.first);
+			}
+			for (int pass = 0; pass < 2; pass++) {
+				for (const int elementIndex : pass == 0 ? changes.added : changes.moved) {
+					CHECK(model.count(elementIndex) == 1);
+					copy.erase(elementIndex);
+					const QuadElement & e = tree.element(elementIndex);
+					if (intersects(e, x1, y1, x2, y2)) {
+						copy.emplace(elementIndex, e);
+					}
+				}
+			}
+		}
+		else {
+			// The history needed was discarded: start over from a full query
+			CHECK(round % 13 == 7);
+			copy.clear();
+			tree.queryVisit(x1, y1, x2, y2, -1, [&](const int elementIndex, const QuadElement& e) {
+				copy.emplace(elementIndex, e);
+			});
+		}
+		since = tree.epoch();
+
+		Model expected;
+		for (const auto & entry : model) {
+			if (intersects(entry.second, x1, y1, x2, y2)) {
+				expected.emplace(entry.first, entry.second);
+			}
+		}
+		CHECK(copy.size() == expected.size());
+		for (const auto & entry : expected) {
+			CHECK(copy.count(entry.first) == 1 && sameElement(copy.at(entry.first), entry.second));
+		}
+	}
+}
+
+// Keeps evicted tiles in memory, counting reads
+struct MemoryTileStore : IQuadTileStore
+{
+	std::map<std::pair<int, int>, std::string> tiles;
+	int reads = 0;
+
+	bool write(const int tileX, const int tileY, const std::string& snapshot) override {
+		tiles[std::make_pair(tileX, tileY)] = snapshot;
+		return true;
+	}
+
+	bool read(const int tileX, const int tileY, std::string& snapshot) override {
+		const auto found = tiles.find(std::make_pair(tileX, tileY));
+		if (found == tiles.end()) {
+			return false;
+		}
+		snapshot = found->second;
+		reads++;
+		return true;
+	}
+};
+
+// Moves elements about a sharded world, evicting the idle tiles between rounds so that
+// queries and updates have to reload them
+static void testSharded()
+{
+	typedef ShardedQuadtree<Quadtree, long long> Sharded;
+	struct Entry
+	{
+		long long x1, y1, x2, y2;
+		int handle;
+		bool live;
+	};
+
+	const long long tileSize = 4096, span = 40000;
+	std::mt19937 rng(4);
+	MemoryTileStore store;
+	Sharded world(tileSize, 8, 8, &store);
+	std::vector<Entry> entries;
+
+	auto place = [&](Entry& entry) {
+		entry.x1 = static_cast<long long>(rng() % (2 * span)) - span;
+		entry.y1 = static_cast<long long>(rng() % (2 * span)) - span;
+		entry.x2 = entry.x1 + (rng() % 8 == 0 ? rng() % 3000 : rng() % 20);
+		entry.y2 = entry.y1 + (rng() % 8 == 0 ? rng() % 3000 : rng() % 20);
+	};
+	auto check = [&](const int numQueries) {
+		std::vector<Sharded::Element> found;
+		for (int q = 0; q < numQueries; q++) {
+			const long long extent = q % 10 == 0 ? span : 2 * tileSize;
+			const long long x1 = static_cast<long long>(rng() % (2 * span)) - span, y1 = static_cast<long long>(rng() % (2 * span)) - span;
+			const long long x2 = x1 + static_cast<long long>(rng() % extent), y2 = y1 + static_cast<long long>(rng() % extent);
+			const int omit = q % 3 == 0 ? entries[rng() % entries.size()].handle : -1;
+			std::vector<int> expected;
+			for (int id = 0; id < static_cast<int>(entries.size()); id++) {
+				const Entry & e = entries[id];
+				if (e.live && e.handle != omit && e.x1 <= x2 && e.x2 >= x1 && e.y1 <= y2 && e.y2 >= y1) {
+					expected.push_back(id);
+				}
+			}
+			world.query(found, x1, y1, x2, y2, omit);
+			std::vector<int> ids;
+			for (const Sharded::Element & e : found) {
+				ids.push_back(e.id);
+				const Entry & entry = entries[e.id];
+				CHECK(e.x1 == entry.x1 && e.y1 == entry.y1 && e.x2 == entry.x2 && e.y2 == entry.y2);
+			}
+			std::sort(ids.begin(), ids.end());
+			CHECK(ids == expected);
+		}
+	};
+
+	for (int id = 0; id < 5000; id++) {
+		Entry entry;
+		place(entry);
+		entry.handle = world.insert(id, entry.x1, entry.y1, entry.x2, entry.y2);
+		entry.live = true;
+		CHECK(entry.handle >= 0);
+		entries.push_back(entry);
+	}
+	check(200);
+
+	for (int round = 0; round < 6; round++) {
+		// Only the tiles around the origin stay in use, the rest go idle and are evicted
+		for (int t = 0; t < 3; t++) {
+			world.tick();
+			std::vector<Sharded::Element> found;
+			world.query(found, 0, 0, tileSize, tileSize, -1);
+		}
+		const int loaded = world.loadedTileCount();
+		const int evicted = world.evict(2);
+		CHECK(evicted > 0);
+		CHECK(world.loadedTileCount() == loaded - evicted);
+		check(100);
+
+		for (int i = 0; i < 2000; i++) {
+			const int id = rng() % entries.size();
+			Entry & entry = entries[id];
+			if (!entry.live) {
+				continue;
+			}
+			if (i % 3 == 0) {
+				CHECK(world.remove(entry.handle));
+				entry.live = false;
+				continue;
+			}
+			if (i % 3 == 1) {
+				const long long dx = static_cast<long long>(rng() % 21) - 10, dy = static_cast<long long>(rng() % 21) - 10;
+				entry.x1 += dx;
+				entry.x2 += dx;
+				entry.y1 += dy;
+				entry.y2 += dy;
+			}
+			else {
+				place(entry);
+			}
+			CHECK(world.update(entry.handle, entry.x1, entry.y1, entry.x2, entry.y2));
+			Sharded::Element e(0, 0, 0, 0, 0);
+			CHECK(world.element(entry.handle, e));
+			CHECK(e.id == id && e.x1 == entry.x1 && e.y1 == entry.y1 && e.x2 == entry.x2 && e.y2 == entry.y2);
+		}
+		check(100);
+	}
+	CHECK(store.reads > 0);
+}
+
+// Snaps elements and queries to quarters of a tile, so that their edges often lie
+// exactly on tile borders, where the closed intersection test meets the next tile
+template <class Tree, class WorldCoord>
+static void testShardedBorders(const unsigned seed)
+{
+	typedef ShardedQuadtree<Tree, WorldCoord> Sharded;
+	typedef typename Sharded::Element Element;
+
+	const WorldCoord tileSize = 128, step = tileSize / 4;
+	std::mt19937 rng(seed);
+	Sharded world(tileSize, 4, 8, nullptr);
+	std::vector<Element> elements;
+	std::vector<int> handles;
+
+	// A lattice point from 4 tiles left or up of the origin to 4 tiles right or down
+	auto lattice = [&]() {
+		return step * (static_cast<int>(rng() % 33) - 16);
+	};
+	auto place = [&](const int id) {
+		const WorldCoord x1 = lattice(), y1 = lattice();
+		const WorldCoord w = step * static_cast<int>(rng() % (rng() % 8 == 0 ? 12 : 5));
+		const WorldCoord h = step * static_cast<int>(rng() % (rng() % 8 == 0 ? 12 : 5));
+		return Element(id, x1, y1, x1 + w, y1 + h);
+	};
+	auto check = [&](const int numQueries) {
+		std::vector<Element> found;
+		for (int q = 0; q < numQueries; q++) {
+			const WorldCoord x1 = lattice(), y1 = lattice();
+			const WorldCoord x2 = x1 + step * static_cast<int>(rng() % 6), y2 = y1 + step * static_cast<int>(rng() % 6);
+			std::vector<int> expected;
+			for (const Element & e : elements) {
+				if (e.x1 <= x2 && e.x2 >= x1 && e.y1 <= y2 && e.y2 >= y1) {
+					expected.push_back(e.id);
+				}
+			}
+			world.query(found, x1, y1, x2, y2, -1);
+			std::vector<int> ids;
+			for (const Element & e : found) {
+				ids.push_back(e.id);
+			}
+			std::sort(ids.begin(), ids.end());
+			CHECK(ids == expected);
+		}
+	};
+
+	// Reproduces an element ending on its tile's right edge missed by a query starting there
+	elements.push_back(Element(0, 10, 10, tileSize, 20));
+	handles.push_back(world.insert(0, 10, 10, tileSize, 20));
+	std::vector<Element> found;
+	world.query(found, tileSize, 0, 200, 200, -1);
+	CHECK(found.size() == 1);
+
+	for (int id = 1; id < 400; id++) {
+		elements.push_back(place(id));
+		const Element & e = elements.back();
+		handles.push_back(world.insert(id, e.x1, e.y1, e.x2, e.y2));
+	}
+	check(500);
+	for (int round = 0; round < 4; round++) {
+		for (int i = 0; i < 100; i++) {
+			const int id = rng() % elements.size();
+			elements[id] = place(id);
+			const Element & e = elements[id];
+			CHECK(world.update(handles[id], e.x1, e.y1, e.x2, e.y2));
+		}
+		check(500);
+	}
+}
+
+// Answers queries through the service's dispatcher and checks them against brute force.
+// Stopping a service that isn't running does nothing
+static void testService(ThreadPool& pool)
+{
+	const int size = 1 << 13;
+	std::mt19937 rng(8);
+	Quadtree tree(size, size, 8, 8, 10);
+	Model model;
+	for (int id = 0; id < 3000; id++) {
+		const QuadElement e = randomElement(rng, id, size);
+		model.emplace(tree.insert(e.id, e.x1, e.y1, e.x2, e.y2), e);
+	}
+
+	QuadQueryService<Quadtree> service(tree, pool);
+	service.stop();
+	service.start(std::chrono::microseconds(200), 64);
+
+	std::vector<std::future<std::vector<QuadElement>>> futures;
+	std::vector<std::vector<int>> expected;
+	for (int q = 0; q < 500; q++) {
+		const int x1 = rng() % size, y1 = rng() % size;
+		const int x2 = x1 + rng() % (size / 20), y2 = y1 + rng() % (size / 20);
+		std::vector<int> ids;
+		for (const auto & entry : model) {
+			if (intersects(entry.second, x1, y1, x2, y2)) {
+				ids.push_back(entry.second.id);
+			}
+		}
+		std::sort(ids.begin(), ids.end());
+		expected.push_back(ids);
+		futures.push_back(service.query(x1, y1, x2, y2, -1));
+	}
+	for (int q = 0; q < static_cast<int>(futures.size()); q++) {
+		std::vector<int> ids;
+		for (const QuadElement & e : futures[q].get()) {
+			ids.push_back(e.id);
+		}
+		std::sort(ids.begin(), ids.end());
+		CHECK(ids == expected[q]);
+	}
+	service.stop();
+	service.stop();
+}
+
+// Builds point trees from empty and non-empty sets, including points outside the tree
+// and many on the same spot, checking queries against brute force
+static void testPoints()
+{
+	const int size = 1 << 16;
+	std::mt19937 rng(5);
+	PointQuadtree tree(size, size, 8, 16);
+	std::vector<QuadPoint> points;
+	std::vector<QuadPoint> found;
+
+	const int counts[] = { 0, 20000, 0, 1, 5000 };
+	for (const int n : counts) {
+		points.clear();
+		for (int i = 0; i < n; i++) {
+			const int x = i % 97 == 0 ? size / 2 : static_cast<int>(rng() % (size + size / 10)) - size / 20;
+			const int y = i % 97 == 0 ? size / 4 : static_cast<int>(rng() % (size + size / 10)) - size / 20;
+			points.push_back(QuadPoint(i, x, y));
+		}
+		tree.build(points);
+		CHECK(tree.size() == n);
+
+		for (int q = 0; q < 200; q++) {
+			const int x1 = static_cast<int>(rng() % size), y1 = static_cast<int>(rng() % size);
+			const int extent = q % 10 == 0 ? 0 : size / 4;
+			const int x2 = x1 + static_cast<int>(rng() % (extent + 1)), y2 = y1 + static_cast<int>(rng() % (extent + 1));
+			std::vector<int> expected;
+			for (const QuadPoint & p : points) {
+				if (p.x >= x1 && p.x <= x2 && p.y >= y1 && p.y <= y2) {
+					expected.push_back(p.id);
+				}
+			}
+			tree.query(found, x1, y1, x2, y2);
+			std::vector<int> ids;
+			for (const QuadPoint & p : found) {
+				ids.push_back(p.id);
+			}
+			std::sort(ids.begin(), ids.end());
+			CHECK(ids == expected);
+			CHECK(tree.count(x1, y1, x2, y2) == static_cast<int>(expected.size()));
+		}
+	}
+}
+
+int main()
+{
+	ThreadPool pool(4);
+	testChurn(pool, false);
+	testChurn(pool, true);
+	testChanges();
+	testSharded();
+	testShardedBorders<Quadtree, long long>(6);
+	testShardedBorders<BasicQuadtree<float, int, 0, 0>, double>(7);
+	testService(pool);
+	testPoints();
+
+	if (failures > 0) {
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All checks passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include "pch.h"
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads)
+	: currentTask(nullptr), numTasks(0), nextTask(0), busyWorkers(0), generation(0), stopping(false)
+{
+	if (numThreads <= 0) {
+		numThreads = static_cast<int>(std::thread::hardware_concurrency());
+		if (numThreads <= 0) {
+			numThreads = 1;
+		}
+	}
+
+	// Worker 0 is the thread calling run
+	for (int i = 1; i < numThreads; i++) {
+		threads.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	startCondition.notify_all();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+int ThreadPool::size() const
+{
+	return static_cast<int>(threads.size()) + 1;
+}
+
+void ThreadPool::run(int numTasks, const std::function<void(int, int)>& task)
+{
+	if (numTasks <= 0) {
+		return;
+	}
+
+	// Nothing to hand out - run inline
+	if (threads.empty() || numTasks == 1) {
+		for (int i = 0; i < numTasks; i++) {
+			task(i, 0);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		currentTask = &task;
+		this->numTasks = numTasks;
+		nextTask.store(0, std::memory_order_relaxed);
+		busyWorkers = static_cast<int>(threads.size());
+		generation++;
+	}
+	startCondition.notify_all();
+
+	work(0);
+
+	// Wait for the other workers to finish their last task
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [this] { return busyWorkers == 0; });
+	currentTask = nullptr;
+}
+
+void ThreadPool::work(int workerIndex)
+{
+	for (int i = nextTask.fetch_add(1, std::memory_order_relaxed); i < numTasks; i = nextTask.fetch_add(1, std::memory_order_relaxed)) {
+		(*currentTask)(i, workerIndex);
+	}
+}
+
+void ThreadPool::workerLoop(int workerIndex)
+{
+	long long seenGeneration = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			startCondition.wait(lock, [&] { return stopping || generation != seenGeneration; });
+			if (stopping) {
+				return;
+			}
+			seenGeneration = generation;
+		}
+
+		work(workerIndex);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busyWorkers--;
+		}
+		doneCondition.notify_one();
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "pch.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Provides a fixed set of worker threads that run a batch of indexed tasks
+/// and wait for all of them to finish. The calling thread takes part in the
+/// batch as worker 0, so a pool of size 1 runs everything inline.
+class ThreadPool
+{
+public:
+	/// Creates a pool with numThreads workers in total, including the calling
+	/// thread. A value of 0 uses the number of hardware threads.
+	explicit ThreadPool(int numThreads);
+
+	/// Stops and joins the worker threads.
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Returns the number of workers, including the calling thread.
+	int size() const;
+
+	// Calls task(taskIndex, workerIndex) for every taskIndex in [0, numTasks)
+	// and returns once all tasks are done. workerIndex is in [0, size()) and
+	// is never used by two tasks at the same time, so it can index per-worker
+	// state. Must not be called from inside a task.
+	void run(int numTasks, const std::function<void(int, int)>& task);
+
+private:
+	// Takes tasks from the current batch until none are left
+	void work(int workerIndex);
+
+	void workerLoop(int workerIndex);
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable startCondition;
+	std::condition_variable doneCondition;
+
+	// The batch being run. generation is bumped for each batch so that
+	// sleeping workers can tell a new batch from a spurious wake-up
+	const std::function<void(int, int)>* currentTask;
+	int numTasks;
+	std::atomic<int> nextTask;
+	int busyWorkers;
+	long long generation;
+	bool stopping;
+};
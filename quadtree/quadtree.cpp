@@ -1,486 +1,347 @@
 #include "pch.h"
-#include <iostream>
-#include "FreeList.h"
-#include <vector>
-
-// Represents a node in the quadtree.
-struct QuadNode
+#include "Quadtree.h"
+#include "PointQuadtree.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+// Writes the stats as "name value" lines, followed by the histograms as one line per
+// bucket: "leavesByDepth depth leaves" and "leavesByCount elementCount leaves"
+std::ostream& operator<<(std::ostream& out, const QuadStats& stats)
 {
-	// Points to the first child if this node is a branch or the first
-	// element node if this node is a leaf.
-	int firstChildIndex;
-
-	// Stores the number of elements in the leaf or -1 if it this node is
-	// not a leaf
-	int count;
-
-	QuadNode(int firstChildIndex, int count) : firstChildIndex(firstChildIndex), count(count) {
+	out << "branches " << stats.branches << "\n"
+		<< "leaves " << stats.leaves << "\n"
+		<< "emptyLeaves " << stats.emptyLeaves << "\n"
+		<< "depth " << stats.depth << "\n"
+		<< "elements " << stats.elements << "\n"
+		<< "elementNodes " << stats.elementNodes << "\n"
+		<< "duplication " << stats.duplication << "\n"
+		<< "freeElements " << stats.freeElements << "\n"
+		<< "freeElementNodes " << stats.freeElementNodes << "\n"
+		<< "freeNodeBlocks " << stats.freeNodeBlocks << "\n";
+	for (int i = 0; i < stats.leavesByDepth.size(); i++) {
+		out << "leavesByDepth " << i << " " << stats.leavesByDepth[i] << "\n";
+	}
+	for (int i = 0; i < stats.leavesByCount.size(); i++) {
+		out << "leavesByCount " << i << " " << stats.leavesByCount[i] << "\n";
 	}
-};
+	return out;
+}
 
-// Represents an element node in the quadtree.
-struct QuadElementNode
+std::uint64_t quadChecksum(std::uint64_t hash, const void* data, const std::size_t size)
 {
-	// Points to the next element node in the leaf node. A value of -1
-	// indicates the end of the list.
-	int nextIndex;
-
-	// Stores the element index.
-	int elementIndex;
-
-	QuadElementNode(int nextIndex, int elementIndex)
-		: nextIndex(nextIndex), elementIndex(elementIndex) {
+	const std::uint64_t prime = 1099511628211ULL;
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	std::size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		std::uint64_t word;
+		std::memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * prime;
+	}
+	for (; i < size; i++) {
+		hash = (hash ^ bytes[i]) * prime;
 	}
-};
+	return hash;
+}
 
-// Represents an element in the quadtree.
-struct QuadElement
+QuadPolygon::QuadPolygon(const std::vector<double>& x, const std::vector<double>& y)
+	: x(x), y(y), left(x[0]), top(y[0]), right(x[0]), bottom(y[0])
 {
-	// Stores the ID for the element (can be used to
-	// refer to external data).
-	int id;
-
-	// Stores the rectangle, AABB for the element.
-	// x1, y1 = top left point
-	// x2, y2 = bottom right point
-	int x1, y1, x2, y2;
+	const int n = static_cast<int>(x.size());
+	for (int i = 0; i < n; i++) {
+		left = std::min(left, x[i]);
+		top = std::min(top, y[i]);
+		right = std::max(right, x[i]);
+		bottom = std::max(bottom, y[i]);
+	}
 
-	QuadElement(int id, int x1, int y1, int x2, int y2)
-		: id(id), x1(x1), y1(y1), x2(x2), y2(y2) {
+	// The normal of each edge, and the polygon's extent along it. Axis-aligned edges are
+	// covered by the bounding box test, and zero-length ones have no normal
+	for (int i = 0; i < n; i++) {
+		const int j = (i + 1) % n;
+		const double nx = y[j] - y[i], ny = x[i] - x[j];
+		if (nx == 0.0 || ny == 0.0) {
+			continue;
+		}
+		double axisLow = std::numeric_limits<double>::infinity(), axisHigh = -std::numeric_limits<double>::infinity();
+		for (int v = 0; v < n; v++) {
+			const double projection = x[v] * nx + y[v] * ny;
+			axisLow = std::min(axisLow, projection);
+			axisHigh = std::max(axisHigh, projection);
+		}
+		axisX.push_back(nx);
+		axisY.push_back(ny);
+		axisMin.push_back(axisLow);
+		axisMax.push_back(axisHigh);
 	}
-};
+}
 
-// Contains the AABB, depth and the index of the Node in the nodes FreeList. The AABB is calculated at runtime
-struct QuadNodeData
+QuadPolygon QuadPolygon::frustum(const double x, const double y, const double dirX, const double dirY, const double halfAngle, const double nearDistance, const double farDistance)
 {
-	// The index of the node in the nodes FreeList this QuadNodeData object refers to
-	int nodeIndex;
-
-	// The depth of the node
-	int depth;
-
-	// Mid point
-	int mx;
-	int my;
-	// Half-lengthsQuadElt
-	int hx;
-	int hy;
+	const double length = std::sqrt(dirX * dirX + dirY * dirY);
+	const double ux = dirX / length, uy = dirY / length;
+	const double spread = std::tan(halfAngle);
+	const double nearHalf = nearDistance * spread, farHalf = farDistance * spread;
+
+	// Near and far edges, the sides running between them
+	const std::vector<double> xs = {
+		x + ux * nearDistance - uy * nearHalf, x + ux * farDistance - uy * farHalf,
+		x + ux * farDistance + uy * farHalf, x + ux * nearDistance + uy * nearHalf };
+	const std::vector<double> ys = {
+		y + uy * nearDistance + ux * nearHalf, y + uy * farDistance + ux * farHalf,
+		y + uy * farDistance - ux * farHalf, y + uy * nearDistance - ux * nearHalf };
+	return QuadPolygon(xs, ys);
+}
 
-	QuadNodeData(int nodeIndex, int depth, int mx, int my, int hx, int hy)
-		: nodeIndex(nodeIndex), depth(depth), mx(mx), my(my), hx(hx), hy(hy) {
+// Separating axis test: the shapes overlap unless their extents are disjoint along x, y
+// or one of the polygon's edge normals. Along each normal the AABB's extent runs between
+// the corners picked by the signs of the normal
+bool QuadPolygon::intersects(const double x1, const double y1, const double x2, const double y2) const
+{
+	if (x2 < left || x1 > right || y2 < top || y1 > bottom) {
+		return false;
 	}
+	for (int i = 0; i < axisX.size(); i++) {
+		const double nx = axisX[i], ny = axisY[i];
+		const double low = (nx > 0.0 ? x1 : x2) * nx + (ny > 0.0 ? y1 : y2) * ny;
+		const double high = (nx > 0.0 ? x2 : x1) * nx + (ny > 0.0 ? y2 : y1) * ny;
+		if (high < axisMin[i] || low > axisMax[i]) {
+			return false;
+		}
+	}
+	return true;
+}
 
-};
-class Quadtree;
-
-class IQuadtreeVisitor
+QuadCostSplitPolicy::QuadCostSplitPolicy(const double nodeCost, const double splitGain)
+	: nodeCost(nodeCost), splitGain(splitGain)
 {
-	// Called when traversing a branch node.
-	// (mx, my) indicate the center of the node's AABB.
-	// (hx, hy) indicate the half-size of the node's AABB.
-public:
-	virtual void branch(const Quadtree& quadtree, const int node, const int depth, const int mx, const int my, const int hx, const int hy) const = 0;
-
-	// Called when traversing a leaf node.
-	// (mx, my) indicate the center of the node's AABB.
-	// (hx, hy) indicate the half-size of the node's AABB.
-	virtual void leaf(const Quadtree& quadtree, const int node, const int depth, const int mx, const int my, const int hx, const int hy) const = 0;
-};
-
-class Quadtree
-{
-private:
-	// The maximum depth allowed for the quadtree.
-	int maxDepth;
-	// The maximum numbeer of elements allowed in a leaf before subdividing
-	int maxElements;
-
-	// Stores all the elements in the quadtree.
-	FreeList<QuadElement> elements;
-
-	// Stores all the element nodes in the quadtree.
-	FreeList<QuadElementNode> elementNodes;
-
-	// Stores all the nodes in the quadtree. The first node in this
-	// sequence is always the root.
-	FreeList<QuadNode> nodes;
-
-	// Stores the first free node in the quadtree to be reclaimed as 4
-	// contiguous nodes at once. A value of -1 indicates that the free
-	// list is empty, at which point we simply insert 4 nodes to the
-	// back of the nodes array.
-	int freeNodeIndex;
-
-	// Temp buffer variables for queries - used to check if element is already found (avoid returning repeated elements)
-	std::vector<bool> tempBuffer;
-
-	void nodeInsert(const int nodeIndex, const int depth, const int mx, const int my, const int hx, const int hy, const int elementIndex);
-	void leafInsert(const int nodeIndex, const int depth, const int mx, const int my, const int hx, const int hy, const int elt);
-	std::vector<QuadNodeData> findLeaves(const int nodeIndex, const int depth, const int mx, const int my, const int hx, const int hy, const int left, const int right, const int top, const int bottom);
-	void traverse(const IQuadtreeVisitor& visitor);
-	static bool intersect(const int l1, const int r1, const int t1, const int b1, const int l2, const int r2, const int t2, const int b2);
-
-public:
-	int insert(const int id, const int x1, const int y1, const int x2, const int y2);
-	void remove(const int elementIndex);
-	std::vector<QuadElement> query(const float x1, const float y1, const float x2, const float y2, const int omitElementIndex);
-	std::vector<QuadElement> query(const float x1, const float y1, const float x2, const float y2);
-	void cleanup();
-	Quadtree(const int width, const int height, const int startMaxElements, const int maxDepth, const int tempBufferSize);
-
-	// Stores the quadtree extents - boundaries
-	const int rootMx, rootMy, rootHx, rootHy;
-};
-
-// Insert an element into the quadtree - make sure the element's fields are initialised
-int Quadtree::insert(const int id, const int x1, const int y1, const int x2, const int y2)
-{
-	const int newElementIndex = elements.insert(QuadElement(id, x1, y1, x2, y2));
-	nodeInsert(0, 0, rootMx, rootMy, rootHx, rootHy, newElementIndex);
-	return newElementIndex;
 }
 
-// Remove an element from the quadtree - removes all element nodes and the element itself
-void Quadtree::remove(const int elementIndex)
+double QuadCostSplitPolicy::gain(const QuadLeafInfo& info) const
 {
-	const QuadElement & e = elements[elementIndex];
-	std::vector<QuadNodeData> leaves = findLeaves(0, 0, rootMx, rootMy, rootHx, rootHy, e.x1, e.y1, e.x2, e.y2);
+	const double splitCost = nodeCost + (info.childCounts[0] + info.childCounts[1] + info.childCounts[2] + info.childCounts[3]) / 4.0;
+	return (info.count - splitCost) * (1.0 + info.queryHits);
+}
 
-	// For each leaf node remove the element nodes
-	for (int i = 0; i < leaves.size(); i++) {
+bool QuadCostSplitPolicy::split(const QuadLeafInfo& leaf) const
+{
+	return gain(leaf) >= splitGain;
+}
 
-		// The index of the Node object in nodes the QuadNodeData object refers to
-		const int nodeIndex = leaves[i].nodeIndex;
+bool QuadCostSplitPolicy::merge(const QuadLeafInfo& branch) const
+{
+	return gain(branch) < splitGain / 2;
+}
 
-		// Traverse the list until the element node is found
-		int elementNodeIndex = nodes[nodeIndex].firstChildIndex;
-		int prevElementNodeIndex = -1;
-		while (elementNodeIndex != -1 && elementNodes[elementNodeIndex].elementIndex != elementIndex) {
-			prevElementNodeIndex = elementNodeIndex;
-			elementNodeIndex = elementNodes[elementNodeIndex].nextIndex;
-		}
-		// If nodeIndex == -1, the element could not be found in the leaf
-		if (elementNodeIndex != -1) {
-			// Remove the element node (LinkedList removal)
-			const int nextIndex = elementNodes[elementNodeIndex].nextIndex;
-			if (prevElementNodeIndex == -1) {
-				nodes[nodeIndex].firstChildIndex = nextIndex;
-			}
-			else {
-				elementNodes[prevElementNodeIndex].nextIndex = nextIndex;
-			}
+// Compile the int tree here once, rather than in every file using it (see Quadtree.h)
+template class BasicQuadtree<int, int, 0, 0>;
+template class BasicPointQuadtree<int, int>;
 
-			elementNodes.erase(elementNodeIndex);
-			nodes[nodeIndex].count--;
-		}
-	}
-	// Remove the element itself
-	elements.erase(elementIndex);
-}
-//class A : public IQuadtreeVisitor {
-//	virtual void branch(const Quadtree& quadtree, const int node, const int depth, const int mx, const int my, const int hx, const int hy) override {
-//
-//	}
-//
-//	virtual void leaf(const Quadtree& quadtree, const int node, const int depth, const int mx, const int my, const int hx, const int hy) override {
-//
-//	}
-//};
-
-// Traverse all the nodes in the tree, calling 'branch' for branch nodes and 'leaf' for leaf nodes
-void Quadtree::traverse(const IQuadtreeVisitor& visitor)
+// Looseness is the size of a node's loose bounds relative to its cell, and must be
+// above 1. At 2, any element no bigger than a cell fits in the node holding its center
+LooseQuadtree::LooseQuadtree(const int width, const int height, const int maxDepth, const float looseness)
+	: maxDepth(maxDepth), freeNodeIndex(-1), rootMx(width / 2), rootMy(height / 2), rootHx(width / 2), rootHy(height / 2)
 {
-	std::vector<QuadNodeData> toProcess;
-	toProcess.push_back(QuadNodeData(0, 0, rootMx, rootMy, rootHx, rootHy));
-
-	while (toProcess.size() > 0) {
-		const QuadNodeData nodeData = toProcess.back();
-		toProcess.pop_back();
-		const QuadNode & node = nodes[nodeData.nodeIndex];
-		const int fc = node.firstChildIndex;
-
-		// If the node is not a leaf
-		if (node.count == -1) {
-
-			// Push the child nodes onto the list (calculate the AABB)
-			const int hx = nodeData.hx >> 1, hy = nodeData.hy >> 1;
-			const int leftMx = nodeData.mx - hx, topMy = nodeData.my - hy, rightMx = nodeData.mx + hx, bottomMy = nodeData.my + hy;
-			toProcess.push_back(QuadNodeData(fc + 0, nodeData.depth + 1, leftMx, topMy, hx, hy));
-			toProcess.push_back(QuadNodeData(fc + 1, nodeData.depth + 1, rightMx, topMy, hx, hy));
-			toProcess.push_back(QuadNodeData(fc + 2, nodeData.depth + 1, leftMx, bottomMy, hx, hy));
-			toProcess.push_back(QuadNodeData(fc + 3, nodeData.depth + 1, rightMx, bottomMy, hx, hy));
-
-			// Visit the branch
-			visitor.branch(*this, nodeData.nodeIndex, nodeData.depth, nodeData.mx, nodeData.my, nodeData.hx, nodeData.hy);
-		}
-		else {
-			visitor.leaf(*this, nodeData.nodeIndex, nodeData.depth, nodeData.mx, nodeData.my, nodeData.hx, nodeData.hy);
-		}
+	int hx = rootHx, hy = rootHy;
+	for (int depth = 0; depth <= maxDepth; depth++) {
+		cellHx.push_back(hx);
+		cellHy.push_back(hy);
+		looseHx.push_back(static_cast<int>(hx * looseness));
+		looseHy.push_back(static_cast<int>(hy * looseness));
+		hx >>= 1;
+		hy >>= 1;
 	}
 
+	// Insert root
+	nodes.insert(LooseQuadNode(rootMx, rootMy, 0));
 }
 
+// Insert an element into the quadtree
+int LooseQuadtree::insert(const int id, const int x1, const int y1, const int x2, const int y2)
+{
+	const int elementIndex = elements.insert(LooseQuadElement(QuadElement(id, x1, y1, x2, y2)));
+	link(findNode(x1, y1, x2, y2, true), elementIndex);
+	return elementIndex;
+}
 
-// Returns a list of elements found in the specified rectangle excluding the
-// specified element to omit.
-std::vector<QuadElement> Quadtree::query(const float x1, const float y1, const float x2, const float y2, const int omitElementIndex)
+// Remove an element from the quadtree. Nodes left empty are freed by cleanup
+void LooseQuadtree::remove(const int elementIndex)
 {
-	// Contains the elements
-	std::vector<QuadElement> out;
-	// Keeps track of bool
-	std::vector<int> clearList;
-
-	// Cast coordinates to int
-	const int qx1 = static_cast<int>(x1);
-	const int qy1 = static_cast<int>(y1);
-	const int qx2 = static_cast<int>(x2);
-	const int qy2 = static_cast<int>(y2);
-
-	std::vector<QuadNodeData> leaves = findLeaves(0, 0, rootMx, rootMy, rootHx, rootHy, qx1, qy1, qx2, qy2);
-
-	// tempBuffer is used to track whether an element has already been added (elementNodes)
-	// Increase temporary buffer size to acomodate number of elements
-	// Check speed - may be faster by avoiding resizing multiple times, may be slower by unnecessary check
-	if (tempBuffer.size() < elements.size()) {
-		tempBuffer.assign(elements.size(), false);
-	}
+	unlink(elementIndex);
+	elements.erase(elementIndex);
+}
 
-	// For each leaf, look for elements that intersect the AABB
-	for (int i = 0; i < leaves.size(); i++) {
-		const int nodeIndex = leaves[i].nodeIndex;
-
-		// Walk the list and add elements that intersect
-		int elementNodeIndex = nodes[nodeIndex].firstChildIndex;
-		while (elementNodeIndex != -1) {
-			// elementIndex checks
-			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
-			if (!tempBuffer[elementIndex] && elementIndex != omitElementIndex) {
-				const QuadElement & e = elements[elementIndex];
-				// Element checks
-				if (intersect(qx1, qy1, qx2, qy2, e.x1, e.y1, e.x2, e.y2)) {
-					// Element found - added to query result
-					out.push_back(e);
-					tempBuffer[elementIndex] = true;
-					clearList.push_back(elementIndex);
-				}
-			}
-			elementNodeIndex = elementNodes[elementNodeIndex].nextIndex;
-		}
+// Move an element to a new AABB, keeping its element index. If the element still fits its
+// node and is not small enough for a child, only its coordinates are rewritten
+void LooseQuadtree::update(const int elementIndex, const int x1, const int y1, const int x2, const int y2)
+{
+	LooseQuadElement & e = elements[elementIndex];
+	e.element.x1 = x1;
+	e.element.y1 = y1;
+	e.element.x2 = x2;
+	e.element.y2 = y2;
+
+	const LooseQuadNode & node = nodes[e.nodeIndex];
+	if ((e.nodeIndex == 0 || fits(node.mx, node.my, node.depth, x1, y1, x2, y2)) && !fitsChild(e.nodeIndex, x1, y1, x2, y2)) {
+		return;
 	}
 
-	// Clear the element buffer - Unmark inserted elements
-	for (int i = 0; i < clearList.size(); i++) {
-		tempBuffer[clearList[i]] = false;
-	}
-	return out;
+	unlink(elementIndex);
+	link(findNode(x1, y1, x2, y2, true), elementIndex);
 }
 
-// Returns a list of elements found in the specified rectangle
-std::vector<QuadElement> Quadtree::query(const float x1, const float y1, const float x2, const float y2)
+// Returns true if the AABB fits inside the loose bounds of a node
+bool LooseQuadtree::fits(const int mx, const int my, const int depth, const int x1, const int y1, const int x2, const int y2) const
 {
-	return query(x1, y1, x2, y2, -1);
+	return x1 >= mx - looseHx[depth] && x2 <= mx + looseHx[depth] && y1 >= my - looseHy[depth] && y2 <= my + looseHy[depth];
 }
 
-// Clean up the tree, removing empty leaves
-void Quadtree::cleanup()
+// Returns true if the AABB would descend from the node into the child containing its center
+bool LooseQuadtree::fitsChild(const int nodeIndex, const int x1, const int y1, const int x2, const int y2) const
 {
-	std::vector<QuadNode> toProcess;
-
-	// Only process if the root is not a leaf
-	if (nodes[0].count == -1) {
-		toProcess.push_back(nodes[0]);
+	const LooseQuadNode & node = nodes[nodeIndex];
+	if (node.depth >= maxDepth) {
+		return false;
 	}
 
-	while (toProcess.size() > 0) {
-		QuadNode node = toProcess.back();
-		toProcess.pop_back();
-
-		int numEmptyLeaves = 0;
-
-		// Loop through the children
-		for (int i = 0; i < 4; i++) {
+	// Midpoint of the AABB, computed without overflowing
+	const int cx = x1 + (x2 - x1) / 2, cy = y1 + (y2 - y1) / 2;
+	const int hx = cellHx[node.depth + 1], hy = cellHy[node.depth + 1];
+	const int childMx = cx <= node.mx ? node.mx - hx : node.mx + hx;
+	const int childMy = cy <= node.my ? node.my - hy : node.my + hy;
+	return fits(childMx, childMy, node.depth + 1, x1, y1, x2, y2);
+}
 
-			const QuadNode& child = nodes[node.firstChildIndex + i];
+// Returns the node an AABB belongs in: the deepest node on the path of its center whose
+// loose bounds contain it. Missing nodes on the way are created if 'create' is set,
+// otherwise the deepest existing node is returned
+int LooseQuadtree::findNode(const int x1, const int y1, const int x2, const int y2, const bool create)
+{
+	const int cx = x1 + (x2 - x1) / 2, cy = y1 + (y2 - y1) / 2;
+	int nodeIndex = 0;
+	while (fitsChild(nodeIndex, x1, y1, x2, y2)) {
+		if (nodes[nodeIndex].firstChildIndex == -1) {
+			if (!create) {
+				break;
+			}
 
-			// Increment empty leaf count if the child is an empty leaf
-			// Otherwise if the child is a branch, add it to the stack to be processed in the next iteration
-			// Don't do anything if the child is a leaf with children
-			if (child.count == 0) {
-				numEmptyLeaves++;
+			// Allocate the 4 children, reusing a freed block if there is one
+			const LooseQuadNode parent = nodes[nodeIndex];
+			const int depth = parent.depth + 1;
+			const int hx = cellHx[depth], hy = cellHy[depth];
+			int fc = freeNodeIndex;
+			if (fc != -1) {
+				freeNodeIndex = nodes[fc].firstChildIndex;
+				nodes[fc + 0] = LooseQuadNode(parent.mx - hx, parent.my - hy, depth);
+				nodes[fc + 1] = LooseQuadNode(parent.mx + hx, parent.my - hy, depth);
+				nodes[fc + 2] = LooseQuadNode(parent.mx - hx, parent.my + hy, depth);
+				nodes[fc + 3] = LooseQuadNode(parent.mx + hx, parent.my + hy, depth);
 			}
-			else if (child.count == -1) {
-				toProcess.push_back(child);
+			else {
+				fc = nodes.insert(LooseQuadNode(parent.mx - hx, parent.my - hy, depth));
+				nodes.insert(LooseQuadNode(parent.mx + hx, parent.my - hy, depth));
+				nodes.insert(LooseQuadNode(parent.mx - hx, parent.my + hy, depth));
+				nodes.insert(LooseQuadNode(parent.mx + hx, parent.my + hy, depth));
 			}
+			nodes[nodeIndex].firstChildIndex = fc;
 		}
 
-		// If all the children were empty leaves, remove them and 
-		// make this node the new empty leaf.
-		if (numEmptyLeaves == 4)
-		{
-			// Push all 4 children to the free list. Note: See quadtree declaration for freeNode
-			nodes[node.firstChildIndex].firstChildIndex = freeNodeIndex;
-			freeNodeIndex = node.firstChildIndex;
-
-			// Make this node the new empty leaf.
-			node.firstChildIndex = -1;
-			node.count = 0;
-		}
+		const LooseQuadNode & node = nodes[nodeIndex];
+		nodeIndex = node.firstChildIndex + (cx <= node.mx ? 0 : 1) + (cy <= node.my ? 0 : 2);
 	}
+	return nodeIndex;
 }
 
-// Insert an element into a node
-// Takes the fields of a QuadNodeData object and an index to the element being inserted
-void Quadtree::nodeInsert(const int index, const int depth, const int mx, const int my, const int hx, const int hy, const int elementIndex)
+// Push an element onto the front of a node's list
+void LooseQuadtree::link(const int nodeIndex, const int elementIndex)
 {
-	const int x1 = elements[elementIndex].x1;
-	const int y1 = elements[elementIndex].y1;
-	const int x2 = elements[elementIndex].x2;
-	const int y2 = elements[elementIndex].y2;
-
-	std::vector<QuadNodeData> leaves = findLeaves(index, depth, mx, my, hx, hy, x1, y1, x2, y2);
-
-	for (int i = 0; i < leaves.size(); i++) {
-		leafInsert(leaves[i].nodeIndex, leaves[i].depth, leaves[i].mx, leaves[i].my, leaves[i].hx, leaves[i].hy, elementIndex);
+	LooseQuadNode & node = nodes[nodeIndex];
+	LooseQuadElement & e = elements[elementIndex];
+	e.nodeIndex = nodeIndex;
+	e.prevIndex = -1;
+	e.nextIndex = node.firstElementIndex;
+	if (node.firstElementIndex != -1) {
+		elements[node.firstElementIndex].prevIndex = elementIndex;
 	}
+	node.firstElementIndex = elementIndex;
+	node.count++;
 }
 
-// Insert a Quad Element into a particular leaf. Subdivide and reinsert if the leaf is full
-// Takes the fields of a QuadNodeData object and an index to the element being inserted
-void Quadtree::leafInsert(const int nodeIndex, const int depth, const int mx, const int my, const int hx, const int hy, const int elementIndex)
+// Take an element out of its node's list
+void LooseQuadtree::unlink(const int elementIndex)
 {
-	// Insert the element into the beginning of the leaf's linked list of elements as the first child
-
-	// Store the original first child (first child is an element index as the node is a leaf)
-	const int prevFirstChildIndex = nodes[nodeIndex].firstChildIndex;
-	QuadNode & node = nodes[nodeIndex];
-	// Replace the first child with the new QuadElementNode
-	node.firstChildIndex = elementNodes.insert(QuadElementNode(prevFirstChildIndex, elementIndex));
-
-	// Subdivide if leaf is full
-	if (node.count == maxElements && depth < maxDepth) {
-
-		//Transfer elements from the leaf node to a list of elements
-		std::vector<int> tempElements;
-
-		// While the leaf still contains an element
-		while (node.firstChildIndex != -1) {
-			const int elementNodeIndex = node.firstChildIndex;
-
-			const int nextElementNodeIndex = elementNodes[elementNodeIndex].nextIndex;
-			const int elementIndex = elementNodes[elementNodeIndex].elementIndex;
-
-			// Pop off the element node from the leaf and remove it from the quadtree
-			node.firstChildIndex = nextElementNodeIndex;
-			elementNodes.erase(elementNodeIndex);
-
-			// Insert the element into the temporary list
-			tempElements.push_back(elementIndex);
-		}
-
-		// Set the first child of the current node and allocate 4 empty child nodes
-		node.firstChildIndex = nodes.insert(QuadNode(-1, 0));
-		nodes.insert(QuadNode(-1, 0));
-		nodes.insert(QuadNode(-1, 0));
-		nodes.insert(QuadNode(-1, 0));
-
-		// Transfer the elements in the former leaf node to its new children
-		for (int i = 0; i < tempElements.size(); ++i) {
-			nodeInsert(nodeIndex, depth, mx, my, hx, hy, tempElements[i]);
-		}
+	const LooseQuadElement & e = elements[elementIndex];
+	LooseQuadNode & node = nodes[e.nodeIndex];
+	if (e.prevIndex != -1) {
+		elements[e.prevIndex].nextIndex = e.nextIndex;
 	}
 	else {
-		node.count++;
+		node.firstElementIndex = e.nextIndex;
+	}
+	if (e.nextIndex != -1) {
+		elements[e.nextIndex].prevIndex = e.prevIndex;
 	}
+	node.count--;
 }
 
-// Finds all leaves within a certain AABB starting from a particular node (QuadNodeData)
-// x1, y1, x2, y2 = top-left and bottom-right of the AABB. QuadNodeData is the first node to check.
-// After checking the first node, traverse through all child nodes and return all the relevant leaves
-// Takes the fields of a QuadNodeData object and the fields of an AABB
-std::vector<QuadNodeData> Quadtree::findLeaves(const int nodeIndex, const int depth, const int mx, const int my, const int hx, const int hy,
-	const int x1, const int y1, const int x2, const int y2)
+// Writes the elements found in the specified rectangle to 'out', excluding the
+// specified element to omit. 'out' is cleared first, keeping its capacity.
+void LooseQuadtree::query(std::vector<QuadElement>& out, const float x1, const float y1, const float x2, const float y2, const int omitElementIndex)
 {
-	std::vector<QuadNodeData> leaves, toProcess;
-	toProcess.push_back(QuadNodeData(nodeIndex, depth, mx, my, hx, hy));
-
-	while (toProcess.size() > 0) {
-		const QuadNodeData nodeData = toProcess.back();
-		toProcess.pop_back();
-		// If this node is a leaf, insert it to the list.
-		if (nodes[nodeData.nodeIndex].count != -1) {
-			leaves.push_back(nodeData);
-		}
-		else {
-			// Otherwise push the children that intersect the rectangle.
-
-			//Calculate the bounding box of the current node
-			const int mx = nodeData.mx, my = nodeData.my;
-			const int hx = nodeData.hx >> 1, hy = nodeData.hy >> 1;
-			const int fc = nodes[nodeData.nodeIndex].firstChildIndex;
-			// Calculate the centers of the 4 children 
-			const int leftMx = mx - hx, topMy = my - hx, rightMx = mx + hx, bottomMy = my + hy;
-
-			// Compare the AABB with the four child nodes to check for intersections
-			// Push any intersecting child nodes
-			if (y1 <= my) {
-				if (x1 <= mx)
-					toProcess.push_back(QuadNodeData(fc + 0, nodeData.depth + 1, leftMx, topMy, hx, hy));
-				if (x2 > mx)
-					toProcess.push_back(QuadNodeData(fc + 1, nodeData.depth + 1, rightMx, topMy, hx, hy));
-			}
-			if (y2 > my) {
-				if (x1 <= mx)
-					toProcess.push_back(QuadNodeData(fc + 2, nodeData.depth + 1, leftMx, bottomMy, hx, hy));
-				if (x2 > mx)
-					toProcess.push_back(QuadNodeData(fc + 3, nodeData.depth + 1, rightMx, bottomMy, hx, hy));
-			}
-		}
-	}
-	return leaves;
+	out.clear();
+	queryVisit(x1, y1, x2, y2, omitElementIndex, [&out](const int, const QuadElement& e) {
+		out.push_back(e);
+	});
 }
 
-// Standard AABB intersection check
-bool Quadtree::intersect(const int x1A, const int y1A, const int x2A, const int y2A,
-	const int x1B, const int y1B, const int x2B, const int y2B)
+// Returns a list of elements found in the specified rectangle excluding the
+// specified element to omit.
+std::vector<QuadElement> LooseQuadtree::query(const float x1, const float y1, const float x2, const float y2, const int omitElementIndex)
 {
-	return x1B <= x2A && x2B >= x1A && y1B <= y2A && y2B >= y1A;
+	std::vector<QuadElement> out;
+	query(out, x1, y1, x2, y2, omitElementIndex);
+	return out;
 }
 
-//void Quadtree::write(ostream & o) const
-//{
-//
-//}
-
-Quadtree::Quadtree(const int width, const int height, const int maxElements, const int maxDepth, const int tempBufferSize)
-	: maxElements(maxElements), maxDepth(maxDepth), rootMx(width / 2), rootMy(height / 2), rootHx(width / 2), rootHy(height / 2), tempBuffer(tempBufferSize, false)
+// Returns a list of elements found in the specified rectangle
+std::vector<QuadElement> LooseQuadtree::query(const float x1, const float y1, const float x2, const float y2)
 {
-	// Insert root
-	nodes.insert(QuadNode(-1, -1));
+	return query(x1, y1, x2, y2, -1);
 }
 
-class Entity {
-public:
-	int id;
-	int x1, y1, x2, y2;
-	Entity(int id, int x1, int y1, int x2, int y2) : id(id), x1(x1), y1(y1), x2(x2), y2(y2) {
-
-	}
-};
-
-int main()
+// Clean up the tree, freeing every block of 4 children that holds no elements and has
+// no children of its own. Processed bottom-up, so whole empty subtrees are released
+void LooseQuadtree::cleanup()
 {
-	std::cout << "asdsadasd";
-	Quadtree quadtree(1000, 1000, 50, 10, 100);
-	Entity entity(1, 10, 10, 20, 20);
-	quadtree.insert(entity.x1, entity.x1, entity.y1, entity.x2, entity.y2);
-
-	/*std::vector<Entity> entities;
-	for (int i = 0; i < 1; ++i) {
-		entities.push_back(Entity(i * ));
-	}*/
-
-
+	// Collect the nodes with children in depth-first order, then walk the list
+	// backwards so that children are handled before their parent
+	std::vector<int> parents, stack;
+	stack.push_back(0);
+	while (stack.size() > 0) {
+		const int nodeIndex = stack.back();
+		stack.pop_back();
+		const int fc = nodes[nodeIndex].firstChildIndex;
+		if (fc != -1) {
+			parents.push_back(nodeIndex);
+			for (int i = 0; i < 4; i++) {
+				stack.push_back(fc + i);
+			}
+		}
+	}
 
+	for (int i = static_cast<int>(parents.size()) - 1; i >= 0; i--) {
+		const int fc = nodes[parents[i]].firstChildIndex;
+		bool empty = true;
+		for (int j = 0; j < 4 && empty; j++) {
+			empty = nodes[fc + j].count == 0 && nodes[fc + j].firstChildIndex == -1;
+		}
+		if (empty) {
+			nodes[fc].firstChildIndex = freeNodeIndex;
+			freeNodeIndex = fc;
+			nodes[parents[i]].firstChildIndex = -1;
+		}
+	}
 }
 
 